@@ -45,53 +45,97 @@
  * that has not expired but was not recently used to be purged prior to an entry that has
  * expired, but was recently used.
  *
- * To accommodate complication (2) this implementation maintains a list of monotonic
- * "generations" that control when entries are actually "forgotten". As file system
- * operations arrive, the current generation is computed from the "interrupt time"
- * and a reference is taken on that generation (i.e. a reference count is incremented).
- * When the operation is complete the reference on the associated generation is released
- * (i.e. the reference count is decremented). If there are no remaining references on the
- * generation (i.e. the reference count is zero) the generation can be "forgotten", which
- * means that all entries that have expired and have not been used since the generation's
- * time can now be "forgotten" (i.e. the corresponding FUSE messages can be sent).
+ * To accommodate complication (2) this implementation tracks active file system
+ * operations using per-CPU "epochs" (see epoch.c) that control when entries are actually
+ * "forgotten". As file system operations arrive they enter the current epoch (a "generation"
+ * in the interface of this class) and leave it when they are complete. Periodically the
+ * expiration routine advances the epoch and computes the start time of the oldest epoch
+ * that still has active operations; all entries that have expired and have not been used
+ * since that time can now be "forgotten" (i.e. the corresponding FUSE messages can be sent).
  *
  * These two primary complications together with the fact that the implementation must
  * deal with failures and re-setting existing entries make the code rather complicated.
  */
 
+VOID FuseCacheInitialize(VOID);
+static VOID FuseCacheRebalance(UINT64 InterruptTime);
 NTSTATUS FuseCacheCreate(ULONG Capacity, BOOLEAN CaseInsensitive, FUSE_CACHE **PCache);
 VOID FuseCacheDelete(FUSE_CACHE *Cache);
+VOID FuseCacheQueryStats(FUSE_CACHE *Cache, FUSE_STATS *Stats);
 VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
     PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime);
 NTSTATUS FuseCacheReferenceGen(FUSE_CACHE *Cache, PVOID *PGen);
 VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen);
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    FUSE_PROTO_ENTRY *Entry, PVOID *PItem, PBOOLEAN PTimesStale);
+BOOLEAN FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
-VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
-VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+PVOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+PVOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName);
+NTSTATUS FuseCacheExportSnapshot(FUSE_CACHE *Cache, PVOID Buffer, ULONG Length, PULONG PSize);
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDereferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item);
+BOOLEAN FuseCacheGetItemParent(FUSE_CACHE *Cache, PVOID Item, PVOID ParentItem,
+    PUINT64 PParentIno, PSTRING Name);
+VOID FuseCacheSetItemAttr(FUSE_CACHE *Cache, PVOID Item,
+    FUSE_PROTO_ATTR *Attr, UINT64 AttrValid, UINT32 AttrValidNsec);
+VOID FuseCacheSetItemSize(FUSE_CACHE *Cache, PVOID Item, UINT64 Size);
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item, FUSE_PROTO_ATTR *Attr);
+VOID FuseCacheCountItemChildren(FUSE_CACHE *Cache, PVOID Item,
+    UINT64 Offset, UINT64 NextOffset, ULONG Count, BOOLEAN EndOfDir);
+VOID FuseCacheAdjustItemChildren(FUSE_CACHE *Cache, PVOID Item, LONG Delta);
+BOOLEAN FuseCacheGetItemChildren(FUSE_CACHE *Cache, PVOID Item, PULONG PCount);
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList);
 BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForgetOne);
+VOID FuseCacheForgetNodeid(FUSE_CACHE *Cache, UINT64 Nodeid);
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, FuseCacheInitialize)
+#pragma alloc_text(PAGE, FuseCacheRebalance)
 #pragma alloc_text(PAGE, FuseCacheCreate)
 #pragma alloc_text(PAGE, FuseCacheDelete)
+#pragma alloc_text(PAGE, FuseCacheQueryStats)
 #pragma alloc_text(PAGE, FuseCacheExpirationRoutine)
 #pragma alloc_text(PAGE, FuseCacheReferenceGen)
 #pragma alloc_text(PAGE, FuseCacheDereferenceGen)
 #pragma alloc_text(PAGE, FuseCacheGetEntry)
 #pragma alloc_text(PAGE, FuseCacheSetEntry)
 #pragma alloc_text(PAGE, FuseCacheRemoveEntry)
+#pragma alloc_text(PAGE, FuseCacheMoveEntry)
+#pragma alloc_text(PAGE, FuseCacheExportSnapshot)
 #pragma alloc_text(PAGE, FuseCacheReferenceItem)
 #pragma alloc_text(PAGE, FuseCacheDereferenceItem)
 #pragma alloc_text(PAGE, FuseCacheQuickExpireItem)
+#pragma alloc_text(PAGE, FuseCacheGetItemParent)
+#pragma alloc_text(PAGE, FuseCacheSetItemAttr)
+#pragma alloc_text(PAGE, FuseCacheSetItemSize)
+#pragma alloc_text(PAGE, FuseCacheGetItemAttr)
+#pragma alloc_text(PAGE, FuseCacheCountItemChildren)
+#pragma alloc_text(PAGE, FuseCacheAdjustItemChildren)
+#pragma alloc_text(PAGE, FuseCacheGetItemChildren)
 #pragma alloc_text(PAGE, FuseCacheDeleteForgotten)
 #pragma alloc_text(PAGE, FuseCacheForgetOne)
+#pragma alloc_text(PAGE, FuseCacheForgetNodeid)
 #endif
 
+#define FUSE_CACHE_LINE_SIZE            64
+#define FUSE_CACHE_BUDGET_INTERVAL      (10 * 10000000ULL)
+                                        /* rebalance capacities every 10 seconds */
+#define FUSE_CACHE_BUDGET_MIN_CAPACITY  64
+#define FUSE_CACHE_BUDGET_MAX_LOAD      4
+                                        /* managed capacity is at most 4 items per bucket */
+#define FUSE_CACHE_BUDGET_MAX_SCORE     0x3fffffff
+
+enum
+{
+    FuseCacheChildrenUnknown = 0,
+    FuseCacheChildrenCounting,
+    FuseCacheChildrenComplete,
+};
+
+typedef struct _FUSE_CACHE_NAME FUSE_CACHE_NAME;
 typedef struct _FUSE_CACHE_ITEM FUSE_CACHE_ITEM;
 
 struct _FUSE_CACHE
@@ -99,56 +143,108 @@ struct _FUSE_CACHE
     ULONG Capacity;
     BOOLEAN CaseInsensitive;
     FAST_MUTEX Mutex;
-    LIST_ENTRY GenList;
+    FUSE_EPOCH *Epoch;
     LIST_ENTRY ItemList;
     LIST_ENTRY ForgetList;
+    ULONG NameBucketCount;
+    PVOID *NameBuckets;
+    /* statistics; protected by Mutex */
+    ULONG NameMemory;
+    UINT64 Lookups, Hits;
+    /* budget manager; Capacity is protected by Mutex, the rest by FuseCacheBudgetMutex */
+    LIST_ENTRY BudgetEntry;
+    ULONG MaxCapacity;
+    ULONG BudgetItemCost;
+    UINT64 BudgetScore;
+    UINT64 BudgetLookups;
     ULONG ItemCount;
     ULONG ItemBucketCount;
     PVOID ItemBuckets[];
 };
 
-struct _FUSE_CACHE_GEN
+/*
+ * Names are interned: every distinct name (as compared by the cache, i.e. case-insensitively
+ * for case-insensitive caches) is stored once per cache and shared by all items with that
+ * name; e.g. the many "src", "include", "Makefile", etc. of a source tree. A lookup first
+ * finds the interned name and then compares item names by pointer. If the name is not
+ * interned there can be no item with that name and the lookup fails without walking the
+ * item chain.
+ *
+ * Interned names are reference counted by the items that are in the hash table and are
+ * protected by the cache mutex. An item releases its name when it leaves the hash table;
+ * after that it is only used to send FORGET, which needs no name.
+ */
+struct _FUSE_CACHE_NAME
 {
-    LIST_ENTRY ListEntry;
-    LONG RefCount;
-    UINT64 InterruptTime;
+    struct _FUSE_CACHE_NAME *DictNext;
+    ULONG Hash;
+    ULONG RefCount;
+    USHORT Length;
+    CHAR Buffer[];
 };
 
 struct _FUSE_CACHE_ITEM
 {
+    /*
+     * Hot fields: everything a hash chain walk looks at. Items are allocated cache line
+     * aligned and these fields fit in the first line, so rejecting (or accepting) a
+     * candidate touches a single line.
+     */
+    UINT64 ParentIno;
+    UINT64 ExpirationTime;
+    ULONG Hash;
+    LONG QuickExpiry;
+    LONG RefCount;
+    BOOLEAN NoForget;
+    FUSE_CACHE_NAME *Name;              /* interned; 0 once the item leaves the hash table */
     struct _FUSE_CACHE_ITEM *DictNext;
+    /* cold fields: only accessed once an item has been found */
     LIST_ENTRY ListEntry;
-    BOOLEAN NoForget;
-    ULONG Hash;
-    UINT64 ParentIno;
-    STRING Name;
     UINT64 NLookup;
-    UINT64 ExpirationTime;
     UINT64 LastUsedTime;
+    ULONG HitCount;                     /* exported as the snapshot frequency */
     FUSE_PROTO_ENTRY Entry;
-    LONG QuickExpiry;
-    LONG RefCount;
-    CHAR NameBuf[];
+    BOOLEAN TimesStale;                 /* written since Entry.attr was received; times unknown */
+    /* directory children (excluding "." and "..") as counted by a complete enumeration */
+    UINT64 ChildOffset;
+    ULONG ChildCount;
+    UINT8 ChildState;
 };
+C_ASSERT(FUSE_CACHE_LINE_SIZE >= FIELD_OFFSET(struct _FUSE_CACHE_ITEM, ListEntry));
+
+static inline VOID FuseCacheReleaseName(FUSE_CACHE *Cache,
+    FUSE_CACHE_NAME *CacheName)
+{
+    if (0 != --CacheName->RefCount)
+        return;
+
+    ULONG HashIndex = CacheName->Hash % Cache->NameBucketCount;
+    for (FUSE_CACHE_NAME **P = (PVOID)&Cache->NameBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+        if (*P == CacheName)
+        {
+            *P = (*P)->DictNext;
+            break;
+        }
+
+    Cache->NameMemory -= FIELD_OFFSET(FUSE_CACHE_NAME, Buffer) + CacheName->Length;
+    FuseFree(CacheName);
+}
 
 static inline UINT64 FuseCacheForgetTime(FUSE_CACHE *Cache, UINT64 InterruptTime)
 {
-    if (!IsListEmpty(&Cache->GenList))
-    {
-        FUSE_CACHE_GEN *Gen = CONTAINING_RECORD(Cache->GenList.Flink, FUSE_CACHE_GEN, ListEntry);
-        if (InterruptTime >= Gen->InterruptTime)
-            InterruptTime = Gen->InterruptTime - 1;
-    }
+    UINT64 OldestTime = FuseEpochAdvance(Cache->Epoch, InterruptTime);
+    if (InterruptTime >= OldestTime)
+        InterruptTime = OldestTime - 1;
     return InterruptTime;
 }
 
 static inline BOOLEAN FuseCacheForgetNextItem(FUSE_CACHE *Cache,
-    UINT64 ExpirationTime, PLIST_ENTRY ForgetList)
+    UINT64 ForgetTime, PLIST_ENTRY ForgetList)
 {
     if (!IsListEmpty(&Cache->ForgetList))
     {
         FUSE_CACHE_ITEM *Item = CONTAINING_RECORD(Cache->ForgetList.Flink, FUSE_CACHE_ITEM, ListEntry);
-        if (FuseCacheForgetTime(Cache, ExpirationTime) >= Item->LastUsedTime)
+        if (ForgetTime >= Item->LastUsedTime)
         {
             RemoveEntryList(&Item->ListEntry);
             InsertTailList(ForgetList, &Item->ListEntry);
@@ -168,6 +264,10 @@ static inline BOOLEAN FuseCacheExpireItem(FUSE_CACHE *Cache,
             *P = (*P)->DictNext;
             RemoveEntryList(&Item->ListEntry);
             Cache->ItemCount--;
+            FuseCacheReleaseName(Cache, Item->Name);
+            Item->Name = 0;
+            /* items held outside the cache must no longer be considered fresh */
+            Item->ExpirationTime = 0;
             if (0 == InterlockedDecrement(&Item->RefCount))
                 InsertTailList(&Cache->ForgetList, &Item->ListEntry);
             return TRUE;
@@ -206,22 +306,77 @@ static inline size_t hash_upper_chars(const char *s, size_t length)
     return h;
 }
 
-static inline ULONG FuseCacheHash(UINT64 ParentIno, PSTRING Name, BOOLEAN CaseInsensitive)
+static inline ULONG FuseCacheNameHash(PSTRING Name, BOOLEAN CaseInsensitive)
+{
+    return (ULONG)(CaseInsensitive ?
+        hash_upper_chars(Name->Buffer, Name->Length) : hash_chars(Name->Buffer, Name->Length));
+}
+
+static inline ULONG FuseCacheHash(UINT64 ParentIno, ULONG NameHash)
 {
-    return (ULONG)FuseHashMix64(ParentIno) ^
-        (0 != Name ? (ULONG)(CaseInsensitive ?
-            hash_upper_chars(Name->Buffer, Name->Length) : hash_chars(Name->Buffer, Name->Length)) : 0);
+    return (ULONG)FuseHashMix64(ParentIno) ^ NameHash;
+}
+
+static inline BOOLEAN FuseCacheNameEqual(FUSE_CACHE *Cache,
+    FUSE_CACHE_NAME *CacheName, PSTRING Name)
+{
+    if (CacheName->Length != Name->Length)
+        return FALSE;
+
+    if (Cache->CaseInsensitive)
+    {
+        for (ULONG I = 0; Name->Length > I; I++)
+            if (RtlUpperChar(CacheName->Buffer[I]) != RtlUpperChar(Name->Buffer[I]))
+                return FALSE;
+        return TRUE;
+    }
+    else
+        return RtlEqualMemory(CacheName->Buffer, Name->Buffer, Name->Length);
+}
+
+static inline FUSE_CACHE_NAME *FuseCacheLookupName(FUSE_CACHE *Cache,
+    ULONG NameHash, PSTRING Name)
+{
+    ULONG HashIndex = NameHash % Cache->NameBucketCount;
+    for (FUSE_CACHE_NAME *CacheName = Cache->NameBuckets[HashIndex];
+        CacheName; CacheName = CacheName->DictNext)
+        if (CacheName->Hash == NameHash &&
+            FuseCacheNameEqual(Cache, CacheName, Name))
+            return CacheName;
+    return 0;
+}
+
+static inline FUSE_CACHE_NAME *FuseCacheNewName(ULONG NameHash, PSTRING Name)
+{
+    FUSE_CACHE_NAME *CacheName = FuseAllocMustSucceed(
+        FIELD_OFFSET(FUSE_CACHE_NAME, Buffer) + Name->Length);
+    RtlZeroMemory(CacheName, sizeof *CacheName);
+    CacheName->Hash = NameHash;
+    CacheName->Length = Name->Length;
+    RtlCopyMemory(CacheName->Buffer, Name->Buffer, Name->Length);
+    return CacheName;
+}
+
+static inline VOID FuseCacheAddName(FUSE_CACHE *Cache,
+    FUSE_CACHE_NAME *CacheName)
+{
+    ULONG HashIndex = CacheName->Hash % Cache->NameBucketCount;
+    CacheName->DictNext = Cache->NameBuckets[HashIndex];
+    Cache->NameBuckets[HashIndex] = CacheName;
+    Cache->NameMemory += FIELD_OFFSET(FUSE_CACHE_NAME, Buffer) + CacheName->Length;
 }
 
 static inline FUSE_CACHE_ITEM *FuseCacheLookupHashedItem(FUSE_CACHE *Cache,
-    ULONG Hash, UINT64 ParentIno, PSTRING Name)
+    ULONG Hash, UINT64 ParentIno, FUSE_CACHE_NAME *CacheName)
 {
     FUSE_CACHE_ITEM *Item = 0;
     ULONG HashIndex = Hash % Cache->ItemBucketCount;
+    if (0 == CacheName)
+        return 0;
     for (FUSE_CACHE_ITEM *ItemX = Cache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
         if (ItemX->Hash == Hash &&
             ItemX->ParentIno == ParentIno &&
-            RtlEqualString(&ItemX->Name, Name, Cache->CaseInsensitive))
+            ItemX->Name == CacheName)
         {
             Item = ItemX;
             break;
@@ -237,11 +392,12 @@ static inline VOID FuseCacheAddItem(FUSE_CACHE *Cache,
     for (FUSE_CACHE_ITEM *ItemX = Cache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
         if (ItemX->Hash == Item->Hash &&
             ItemX->ParentIno == Item->ParentIno &&
-            RtlEqualString(&ItemX->Name, &Item->Name, Cache->CaseInsensitive))
+            ItemX->Name == Item->Name)
         {
             ASSERT(0);
         }
 #endif
+    Item->Name->RefCount++;
     Item->DictNext = Cache->ItemBuckets[HashIndex];
     Cache->ItemBuckets[HashIndex] = Item;
     /* mark as most-recently used */
@@ -249,13 +405,31 @@ static inline VOID FuseCacheAddItem(FUSE_CACHE *Cache,
     Cache->ItemCount++;
 }
 
+static inline BOOLEAN FuseCacheAttrChanged(FUSE_PROTO_ATTR *Attr, FUSE_PROTO_ATTR *NewAttr)
+{
+    return
+        Attr->size != NewAttr->size ||
+        Attr->mtime != NewAttr->mtime || Attr->mtimensec != NewAttr->mtimensec ||
+        Attr->ctime != NewAttr->ctime || Attr->ctimensec != NewAttr->ctimensec;
+}
+
 static inline FUSE_CACHE_ITEM *FuseCacheUpdateHashedItem(FUSE_CACHE *Cache,
-    ULONG Hash, UINT64 ParentIno, PSTRING Name,
-    UINT64 ExpirationTime, UINT64 LastUsedTime, FUSE_PROTO_ENTRY *Entry)
+    ULONG Hash, UINT64 ParentIno, FUSE_CACHE_NAME *CacheName,
+    UINT64 ExpirationTime, UINT64 LastUsedTime, FUSE_PROTO_ENTRY *Entry,
+    PBOOLEAN PAttrChanged)
 {
-    FUSE_CACHE_ITEM *Item = FuseCacheLookupHashedItem(Cache, Hash, ParentIno, Name);
+    FUSE_CACHE_ITEM *Item = FuseCacheLookupHashedItem(Cache, Hash, ParentIno, CacheName);
     if (0 != Item)
     {
+        /*
+         * Quick expiry and stale times are the result of changes made through the
+         * volume; the FSD already knows about those.
+         */
+        if (!InterlockedCompareExchange(&Item->QuickExpiry, 1, 1) &&
+            (Entry->nodeid != Item->Entry.nodeid ||
+                (!Item->TimesStale && FuseCacheAttrChanged(&Item->Entry.attr, &Entry->attr))))
+            *PAttrChanged = TRUE;
+
         if (Entry->nodeid == Item->Entry.nodeid &&
             !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
         {
@@ -263,6 +437,8 @@ static inline FUSE_CACHE_ITEM *FuseCacheUpdateHashedItem(FUSE_CACHE *Cache,
             Item->ExpirationTime = ExpirationTime;
             Item->LastUsedTime = LastUsedTime;
             RtlCopyMemory(&Item->Entry, Entry, sizeof Item->Entry);
+            Item->TimesStale = FALSE;
+            Item->ChildState = FuseCacheChildrenUnknown;
 
             /* mark as most-recently used */
             RemoveEntryList(&Item->ListEntry);
@@ -277,12 +453,117 @@ static inline FUSE_CACHE_ITEM *FuseCacheUpdateHashedItem(FUSE_CACHE *Cache,
     return Item;
 }
 
+static inline UINT64 FuseCacheFixedMemory(FUSE_CACHE *Cache)
+{
+    return
+        FSP_FSCTL_ALIGN_UP(Cache->ItemBucketCount * sizeof Cache->ItemBuckets[0] + sizeof *Cache,
+            PAGE_SIZE) +
+        Cache->NameBucketCount * sizeof Cache->NameBuckets[0];
+}
+
+static inline UINT64 FuseCacheMemory(FUSE_CACHE *Cache)
+{
+    return FuseCacheFixedMemory(Cache) +
+        (UINT64)Cache->ItemCount * sizeof(FUSE_CACHE_ITEM) + Cache->NameMemory;
+}
+
+/*
+ * Cache budget manager
+ *
+ * All caches created with a default capacity are "managed": they share a global memory
+ * budget (FuseCacheMemoryBudget) rather than each having a fixed capacity. Periodically
+ * the budget is divided among the managed caches in proportion to their recent lookups;
+ * caches whose capacity is lowered evict their least recently used items during their
+ * next expiration routine.
+ */
+UINT32 FuseCacheMemoryBudget = 32 * 1024;
+static FAST_MUTEX FuseCacheBudgetMutex;
+static LIST_ENTRY FuseCacheBudgetList;
+static UINT64 FuseCacheBudgetTime;
+
+VOID FuseCacheInitialize(VOID)
+{
+    ExInitializeFastMutex(&FuseCacheBudgetMutex);
+    InitializeListHead(&FuseCacheBudgetList);
+}
+
+static VOID FuseCacheRebalance(UINT64 InterruptTime)
+    /*
+     * Divide the global cache memory budget among the managed caches.
+     *
+     * Every cache is guaranteed FUSE_CACHE_BUDGET_MIN_CAPACITY items and its fixed overhead.
+     * The rest of the budget is divided in proportion to each cache's score: its lookups
+     * during the last interval plus half its previous score. Thus capacity moves toward
+     * busy volumes and away from idle ones, with recent activity weighing the most.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE *Cache;
+    UINT64 Budget = (UINT64)FuseCacheMemoryBudget * 1024, Reserved = 0, Share, Capacity;
+    UINT64 TotalScore = 0;
+    ULONG CacheCount = 0;
+
+    ExAcquireFastMutex(&FuseCacheBudgetMutex);
+
+    if (InterruptTime < FuseCacheBudgetTime)
+        goto exit;
+    FuseCacheBudgetTime = InterruptTime + FUSE_CACHE_BUDGET_INTERVAL;
+
+    for (PLIST_ENTRY Entry = FuseCacheBudgetList.Flink; &FuseCacheBudgetList != Entry;
+        Entry = Entry->Flink)
+    {
+        Cache = CONTAINING_RECORD(Entry, FUSE_CACHE, BudgetEntry);
+
+        ExAcquireFastMutex(&Cache->Mutex);
+        Cache->BudgetScore = Cache->BudgetScore / 2 + (Cache->Lookups - Cache->BudgetLookups);
+        if (FUSE_CACHE_BUDGET_MAX_SCORE < Cache->BudgetScore)
+            Cache->BudgetScore = FUSE_CACHE_BUDGET_MAX_SCORE;
+        Cache->BudgetLookups = Cache->Lookups;
+        Cache->BudgetItemCost = sizeof(FUSE_CACHE_ITEM) +
+            (0 != Cache->ItemCount ? Cache->NameMemory / Cache->ItemCount : 0);
+        ExReleaseFastMutex(&Cache->Mutex);
+
+        Reserved += FuseCacheFixedMemory(Cache) +
+            FUSE_CACHE_BUDGET_MIN_CAPACITY * Cache->BudgetItemCost;
+        TotalScore += Cache->BudgetScore;
+        CacheCount++;
+    }
+
+    if (0 == CacheCount)
+        goto exit;
+
+    Budget = Budget > Reserved ? Budget - Reserved : 0;
+    for (PLIST_ENTRY Entry = FuseCacheBudgetList.Flink; &FuseCacheBudgetList != Entry;
+        Entry = Entry->Flink)
+    {
+        Cache = CONTAINING_RECORD(Entry, FUSE_CACHE, BudgetEntry);
+
+        /* compute in kilobytes: scores are capped, so the product cannot overflow */
+        Share = 0 != TotalScore ?
+            (Budget / 1024) * Cache->BudgetScore / TotalScore * 1024 :
+            Budget / CacheCount;
+        Capacity = FUSE_CACHE_BUDGET_MIN_CAPACITY + Share / Cache->BudgetItemCost;
+        if (Cache->MaxCapacity < Capacity)
+            Capacity = Cache->MaxCapacity;
+
+        ExAcquireFastMutex(&Cache->Mutex);
+        Cache->Capacity = (ULONG)Capacity;
+        ExReleaseFastMutex(&Cache->Mutex);
+    }
+
+exit:
+    ExReleaseFastMutex(&FuseCacheBudgetMutex);
+}
+
 NTSTATUS FuseCacheCreate(ULONG Capacity, BOOLEAN CaseInsensitive, FUSE_CACHE **PCache)
 {
     PAGED_CODE();
 
     FUSE_CACHE *Cache;
     ULONG CacheSize;
+    BOOLEAN Managed = 0 == Capacity && 0 != FuseCacheMemoryBudget;
+    NTSTATUS Result;
 
     *PCache = 0;
 
@@ -301,11 +582,39 @@ NTSTATUS FuseCacheCreate(ULONG Capacity, BOOLEAN CaseInsensitive, FUSE_CACHE **P
     Cache->Capacity = Capacity;
     Cache->CaseInsensitive = CaseInsensitive;
     ExInitializeFastMutex(&Cache->Mutex);
-    InitializeListHead(&Cache->GenList);
     InitializeListHead(&Cache->ItemList);
     InitializeListHead(&Cache->ForgetList);
     Cache->ItemBucketCount = (CacheSize - sizeof *Cache) / sizeof Cache->ItemBuckets[0];
 
+    /* there are never more interned names than items */
+    Cache->NameBucketCount = Cache->ItemBucketCount;
+    Cache->NameBuckets = FuseAlloc(Cache->NameBucketCount * sizeof Cache->NameBuckets[0]);
+    if (0 == Cache->NameBuckets)
+    {
+        FuseFree(Cache);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Cache->NameBuckets, Cache->NameBucketCount * sizeof Cache->NameBuckets[0]);
+
+    Result = FuseEpochCreate(&Cache->Epoch);
+    if (!NT_SUCCESS(Result))
+    {
+        FuseFree(Cache->NameBuckets);
+        FuseFree(Cache);
+        return Result;
+    }
+
+    Cache->MaxCapacity = Managed ?
+        Cache->ItemBucketCount * FUSE_CACHE_BUDGET_MAX_LOAD : Capacity;
+    if (Managed)
+    {
+        ExAcquireFastMutex(&FuseCacheBudgetMutex);
+        InsertTailList(&FuseCacheBudgetList, &Cache->BudgetEntry);
+        ExReleaseFastMutex(&FuseCacheBudgetMutex);
+    }
+    else
+        InitializeListHead(&Cache->BudgetEntry);
+
     *PCache = Cache;
 
     return STATUS_SUCCESS;
@@ -315,34 +624,68 @@ VOID FuseCacheDelete(FUSE_CACHE *Cache)
 {
     PAGED_CODE();
 
-    for (PLIST_ENTRY Entry = Cache->GenList.Flink; &Cache->GenList != Entry;)
+    if (!IsListEmpty(&Cache->BudgetEntry))
     {
-        FUSE_CACHE_GEN *Gen = CONTAINING_RECORD(Entry, FUSE_CACHE_GEN, ListEntry);
-        Entry = Entry->Flink;
-        FuseFree(Gen);
+        ExAcquireFastMutex(&FuseCacheBudgetMutex);
+        RemoveEntryList(&Cache->BudgetEntry);
+        ExReleaseFastMutex(&FuseCacheBudgetMutex);
     }
 
+    FuseEpochDelete(Cache->Epoch);
+
     FuseCacheDeleteForgotten(&Cache->ItemList);
     FuseCacheDeleteForgotten(&Cache->ForgetList);
 
+    for (ULONG HashIndex = 0; Cache->NameBucketCount > HashIndex; HashIndex++)
+        for (FUSE_CACHE_NAME *CacheName = Cache->NameBuckets[HashIndex]; CacheName;)
+        {
+            FUSE_CACHE_NAME *NextName = CacheName->DictNext;
+            FuseFree(CacheName);
+            CacheName = NextName;
+        }
+    FuseFree(Cache->NameBuckets);
+
     FuseFree(Cache);
 }
 
+VOID FuseCacheQueryStats(FUSE_CACHE *Cache, FUSE_STATS *Stats)
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    Stats->CacheCapacity = Cache->Capacity;
+    Stats->CacheItemCount = Cache->ItemCount;
+    Stats->CacheMemory = FuseCacheMemory(Cache);
+    Stats->CacheLookups = Cache->Lookups;
+    Stats->CacheHits = Cache->Hits;
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
 VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
     PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime)
 {
     PAGED_CODE();
 
     LIST_ENTRY ForgetList;
+    UINT64 ForgetTime;
 
     InitializeListHead(&ForgetList);
 
+    if (!IsListEmpty(&Cache->BudgetEntry))
+        FuseCacheRebalance(ExpirationTime);
+
     ExAcquireFastMutex(&Cache->Mutex);
 
+    /* evict down to a capacity that the budget manager may have lowered */
+    while (Cache->ItemCount > Cache->Capacity &&
+        FuseCacheExpireNextItem(Cache, (UINT64)-1LL))
+        ;
+
     while (FuseCacheExpireNextItem(Cache, ExpirationTime))
         ;
 
-    while (FuseCacheForgetNextItem(Cache, ExpirationTime, &ForgetList))
+    ForgetTime = FuseCacheForgetTime(Cache, ExpirationTime);
+    while (FuseCacheForgetNextItem(Cache, ForgetTime, &ForgetList))
         ;
 
     ExReleaseFastMutex(&Cache->Mutex);
@@ -394,102 +737,49 @@ NTSTATUS FuseCacheReferenceGen(FUSE_CACHE *Cache, PVOID *PGen)
 {
     PAGED_CODE();
 
-    UINT64 InterruptTime = KeQueryInterruptTime() / 10000000 * 10000000;
-    FUSE_CACHE_GEN *Gen = 0, *NewGen = 0;
-
-    *PGen = 0;
-
-    ExAcquireFastMutex(&Cache->Mutex);
-
-    if (!IsListEmpty(&Cache->GenList))
-    {
-        Gen = CONTAINING_RECORD(Cache->GenList.Blink, FUSE_CACHE_GEN, ListEntry);
-        if (InterruptTime <= Gen->InterruptTime)
-            Gen->RefCount++;
-        else
-            Gen = 0;
-    }
-
-    ExReleaseFastMutex(&Cache->Mutex);
-
-    if (0 == Gen)
-    {
-        NewGen = FuseAlloc(sizeof *NewGen);
-        if (0 == NewGen)
-            return STATUS_INSUFFICIENT_RESOURCES;
-
-        RtlZeroMemory(NewGen, sizeof *NewGen);
-        NewGen->RefCount = 1;
-        NewGen->InterruptTime = InterruptTime;
-
-        ExAcquireFastMutex(&Cache->Mutex);
-
-        if (!IsListEmpty(&Cache->GenList))
-        {
-            Gen = CONTAINING_RECORD(Cache->GenList.Blink, FUSE_CACHE_GEN, ListEntry);
-            if (InterruptTime <= Gen->InterruptTime)
-                Gen->RefCount++;
-            else
-                Gen = 0;
-        }
-        if (0 == Gen)
-        {
-            InsertTailList(&Cache->GenList, &NewGen->ListEntry);
-
-            Gen = NewGen;
-            NewGen = 0;
-        }
-
-        ExReleaseFastMutex(&Cache->Mutex);
-    }
-
-    *PGen = Gen;
-
-    if (0 != NewGen)
-        FuseFree(NewGen);
+    *PGen = FuseEpochEnter(Cache->Epoch);
 
     return STATUS_SUCCESS;
 }
 
-VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen0)
+VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen)
 {
     PAGED_CODE();
 
-    FUSE_CACHE_GEN *Gen = Gen0;
-    LONG RefCount;
-
-    if (0 == Gen)
-        return;
-
-    ExAcquireFastMutex(&Cache->Mutex);
-    RefCount = --Gen->RefCount;
-    if (0 == RefCount)
-        RemoveEntryList(&Gen->ListEntry);
-    ExReleaseFastMutex(&Cache->Mutex);
-
-    if (0 == RefCount)
-        FuseFree(Gen);
+    FuseEpochLeave(Cache->Epoch, Gen);
 }
 
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem)
+    FUSE_PROTO_ENTRY *Entry, PVOID *PItem, PBOOLEAN PTimesStale)
+    /*
+     * A hit on an item that has been written since its attributes were received still
+     * returns the entry, so that path walks need no LOOKUP; *PTimesStale then tells
+     * callers that pass the attributes on to Windows to refresh them first.
+     */
 {
     PAGED_CODE();
 
     UINT64 InterruptTime = KeQueryInterruptTime();
     FUSE_CACHE_ITEM *Item;
-    ULONG Hash = FuseCacheHash(ParentIno, Name, Cache->CaseInsensitive);
+    ULONG NameHash = FuseCacheNameHash(Name, Cache->CaseInsensitive);
+    ULONG Hash = FuseCacheHash(ParentIno, NameHash);
 
     ExAcquireFastMutex(&Cache->Mutex);
 
-    Item = FuseCacheLookupHashedItem(Cache, Hash, ParentIno, Name);
+    Cache->Lookups++;
+    Item = FuseCacheLookupHashedItem(Cache,
+        Hash, ParentIno, FuseCacheLookupName(Cache, NameHash, Name));
+    *PTimesStale = FALSE;
     if (0 != Item)
     {
         if (InterruptTime < Item->ExpirationTime &&
             !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
         {
+            Cache->Hits++;
+            Item->HitCount++;
             Item->LastUsedTime = InterruptTime;
             RtlCopyMemory(Entry, &Item->Entry, sizeof Item->Entry);
+            *PTimesStale = Item->TimesStale;
 
             /* mark as most-recently used */
             RemoveEntryList(&Item->ListEntry);
@@ -497,7 +787,9 @@ BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
         }
         else
         {
-            FuseCacheExpireItem(Cache, Item);
+            /* keep a timed out item for the LOOKUP to compare against (see FuseCacheSetEntry) */
+            if (InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
+                FuseCacheExpireItem(Cache, Item);
             Item = 0;
         }
     }
@@ -508,8 +800,12 @@ BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     return 0 != Item;
 }
 
-VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+BOOLEAN FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     FUSE_PROTO_ENTRY *Entry, PVOID *PItem)
+    /*
+     * Returns TRUE if the entry replaces one whose file (or size or times) has changed
+     * outside the volume; a timed out item is compared as well (see FuseCacheGetEntry).
+     */
 {
     PAGED_CODE();
 
@@ -519,43 +815,64 @@ VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     UINT64 ExpirationTime = InterruptTime +
         (EntryTimeout < AttrTimeout ? EntryTimeout : AttrTimeout);
     FUSE_CACHE_ITEM *Item = 0, *NewItem = 0;
-    ULONG Hash = FuseCacheHash(ParentIno, Name, Cache->CaseInsensitive);
+    FUSE_CACHE_NAME *CacheName, *NewName = 0;
+    ULONG NameHash = FuseCacheNameHash(Name, Cache->CaseInsensitive);
+    ULONG Hash = FuseCacheHash(ParentIno, NameHash);
+    BOOLEAN AttrChanged = FALSE;
 
     ExAcquireFastMutex(&Cache->Mutex);
 
+    CacheName = FuseCacheLookupName(Cache, NameHash, Name);
     Item = FuseCacheUpdateHashedItem(Cache,
-        Hash, ParentIno, Name, ExpirationTime, InterruptTime, Entry);
+        Hash, ParentIno, CacheName, ExpirationTime, InterruptTime, Entry, &AttrChanged);
 
     ExReleaseFastMutex(&Cache->Mutex);
 
     if (0 == Item)
     {
-        NewItem = FuseAllocMustSucceed(FIELD_OFFSET(FUSE_CACHE_ITEM, NameBuf) + Name->Length);
+        /* allocate outside the mutex; the name is likely still not interned */
+        if (0 == CacheName)
+            NewName = FuseCacheNewName(NameHash, Name);
+
+        NewItem = FuseAllocCacheAlignedMustSucceed(sizeof *NewItem);
 
-        RtlZeroMemory(NewItem, FIELD_OFFSET(FUSE_CACHE_ITEM, NameBuf));
+        RtlZeroMemory(NewItem, sizeof *NewItem);
         NewItem->NoForget =
             /* the root is not LOOKUP'ed; free without FORGET */
             ParentIno == FUSE_PROTO_ROOT_INO && 1 == Name->Length && '/' == Name->Buffer[0];
         NewItem->Hash = Hash;
         NewItem->ParentIno = ParentIno;
-        NewItem->Name.Length = NewItem->Name.MaximumLength = Name->Length;
-        NewItem->Name.Buffer = NewItem->NameBuf;
         NewItem->NLookup = 1;
         NewItem->ExpirationTime = ExpirationTime;
         NewItem->LastUsedTime = InterruptTime;
         NewItem->RefCount = 1;
         RtlCopyMemory(&NewItem->Entry, Entry, sizeof NewItem->Entry);
-        RtlCopyMemory(&NewItem->NameBuf, Name->Buffer, Name->Length);
 
         ExAcquireFastMutex(&Cache->Mutex);
 
         Item = FuseCacheUpdateHashedItem(Cache,
-            Hash, ParentIno, Name, ExpirationTime, InterruptTime, Entry);
+            Hash, ParentIno, FuseCacheLookupName(Cache, NameHash, Name),
+            ExpirationTime, InterruptTime, Entry, &AttrChanged);
         if (0 == Item)
         {
             if (Cache->ItemCount >= Cache->Capacity)
                 FuseCacheExpireNextItem(Cache, (UINT64)-1LL);
 
+            /* look up again: expiring items above may have released the name */
+            CacheName = FuseCacheLookupName(Cache, NameHash, Name);
+            if (0 == CacheName)
+            {
+                if (0 == NewName)
+                    /* rare: paged pool may be allocated while holding a FAST_MUTEX */
+                    NewName = FuseCacheNewName(NameHash, Name);
+
+                FuseCacheAddName(Cache, NewName);
+
+                CacheName = NewName;
+                NewName = 0;
+            }
+
+            NewItem->Name = CacheName;
             FuseCacheAddItem(Cache, NewItem);
 
             Item = NewItem;
@@ -567,24 +884,166 @@ VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
 
     if (0 != NewItem)
         FuseFree(NewItem);
+    if (0 != NewName)
+        FuseFree(NewName);
 
     *PItem = Item;
+    return AttrChanged;
 }
 
-VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name)
+PVOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name)
+    /*
+     * Returns the removed item (or 0). It is not referenced and must not be accessed;
+     * it only identifies the files that reference it (see FuseFileIdleRelease).
+     */
 {
     PAGED_CODE();
 
     FUSE_CACHE_ITEM *Item;
-    ULONG Hash = FuseCacheHash(ParentIno, Name, Cache->CaseInsensitive);
+    ULONG NameHash = FuseCacheNameHash(Name, Cache->CaseInsensitive);
+    ULONG Hash = FuseCacheHash(ParentIno, NameHash);
 
     ExAcquireFastMutex(&Cache->Mutex);
 
-    Item = FuseCacheLookupHashedItem(Cache, Hash, ParentIno, Name);
+    Item = FuseCacheLookupHashedItem(Cache,
+        Hash, ParentIno, FuseCacheLookupName(Cache, NameHash, Name));
     if (0 != Item)
         FuseCacheExpireItem(Cache, Item);
 
     ExReleaseFastMutex(&Cache->Mutex);
+
+    return Item;
+}
+
+PVOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName)
+    /*
+     * Account for a RENAME: the item for ParentIno/Name (if any) becomes the item for
+     * NewParentIno/NewName and any other item for NewParentIno/NewName is removed.
+     * Moving rather than removing the item keeps it valid for the files that reference it.
+     *
+     * Returns the removed item (or 0); see FuseCacheRemoveEntry.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item, *NewItem, *RemovedItem = 0;
+    FUSE_CACHE_NAME *CacheName;
+    ULONG NameHash = FuseCacheNameHash(Name, Cache->CaseInsensitive);
+    ULONG Hash = FuseCacheHash(ParentIno, NameHash);
+    ULONG NewNameHash = FuseCacheNameHash(NewName, Cache->CaseInsensitive);
+    ULONG NewHash = FuseCacheHash(NewParentIno, NewNameHash);
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    Item = FuseCacheLookupHashedItem(Cache,
+        Hash, ParentIno, FuseCacheLookupName(Cache, NameHash, Name));
+    CacheName = FuseCacheLookupName(Cache, NewNameHash, NewName);
+    NewItem = FuseCacheLookupHashedItem(Cache,
+        NewHash, NewParentIno, CacheName);
+
+    if (Item != NewItem)
+    {
+        if (0 != NewItem)
+        {
+            /* may release the name; it is looked up again below */
+            FuseCacheExpireItem(Cache, NewItem);
+            CacheName = 0;
+            RemovedItem = NewItem;
+        }
+
+        if (0 != Item)
+        {
+            ULONG HashIndex = Item->Hash % Cache->ItemBucketCount;
+            for (FUSE_CACHE_ITEM **P = (PVOID)&Cache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+                if (*P == Item)
+                {
+                    *P = (*P)->DictNext;
+                    break;
+                }
+            RemoveEntryList(&Item->ListEntry);
+            Cache->ItemCount--;
+
+            /* reference the new name before releasing the old one; they may be the same */
+            if (0 == CacheName)
+                CacheName = FuseCacheLookupName(Cache, NewNameHash, NewName);
+            if (0 == CacheName)
+            {
+                /* rare: paged pool may be allocated while holding a FAST_MUTEX */
+                CacheName = FuseCacheNewName(NewNameHash, NewName);
+                FuseCacheAddName(Cache, CacheName);
+            }
+            CacheName->RefCount++;
+            FuseCacheReleaseName(Cache, Item->Name);
+
+            Item->Hash = NewHash;
+            Item->ParentIno = NewParentIno;
+            Item->Name = CacheName;
+            FuseCacheAddItem(Cache, Item);
+            CacheName->RefCount--;
+        }
+    }
+    /* else: case-only rename in a case-insensitive cache (or nothing cached); keep the item */
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    return RemovedItem;
+}
+
+NTSTATUS FuseCacheExportSnapshot(FUSE_CACHE *Cache, PVOID Buffer, ULONG Length, PULONG PSize)
+{
+    PAGED_CODE();
+
+    FUSE_SNAPSHOT_ENTRY *Entries;
+    ULONG Count, MaxCount;
+
+    *PSize = 0;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    MaxCount = Cache->ItemCount;
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    /* allocate outside the mutex with some slack for items added in the meantime */
+    MaxCount += MaxCount / 8 + 16;
+    Entries = FuseAlloc(MaxCount * sizeof *Entries);
+    if (0 == Entries)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /*
+     * Only copy the items under the mutex. Names point to interned names, which are
+     * referenced so that they remain valid after the mutex is released; sorting and
+     * building the snapshot happen outside the mutex.
+     */
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    Count = 0;
+    for (PLIST_ENTRY Entry = Cache->ItemList.Flink;
+        &Cache->ItemList != Entry && MaxCount > Count;
+        Entry = Entry->Flink)
+    {
+        FUSE_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FUSE_CACHE_ITEM, ListEntry);
+        Item->Name->RefCount++;
+        Entries[Count].Ino = Item->Entry.nodeid;
+        Entries[Count].ParentIno = Item->ParentIno;
+        Entries[Count].Frequency = Item->HitCount;
+        Entries[Count].Name.Length = Entries[Count].Name.MaximumLength = Item->Name->Length;
+        Entries[Count].Name.Buffer = Item->Name->Buffer;
+        Count++;
+    }
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    *PSize = FuseSnapshotBuild(Entries, Count, Buffer, Length);
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    for (ULONG I = 0; Count > I; I++)
+        FuseCacheReleaseName(Cache,
+            CONTAINING_RECORD(Entries[I].Name.Buffer, FUSE_CACHE_NAME, Buffer));
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    FuseFree(Entries);
+
+    return 0 != *PSize ? STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
 }
 
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item0)
@@ -624,6 +1083,221 @@ VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item0)
     InterlockedExchange(&Item->QuickExpiry, 1);
 }
 
+BOOLEAN FuseCacheGetItemParent(FUSE_CACHE *Cache, PVOID Item0, PVOID ParentItem0,
+    PUINT64 PParentIno, PSTRING Name)
+    /*
+     * Determine whether the item and its parent directory item are still in the cache
+     * and fresh. If so, get the parent inode number and copy the item's name to Name;
+     * Name->MaximumLength must be large enough for it.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0, *ParentItem = ParentItem0;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    BOOLEAN Result;
+
+    if (0 == Item || 0 == ParentItem)
+        return FALSE;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    Result =
+        0 != Item->Name && 0 != ParentItem->Name &&
+        InterruptTime < Item->ExpirationTime &&
+        InterruptTime < ParentItem->ExpirationTime &&
+        !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1) &&
+        !InterlockedCompareExchange(&ParentItem->QuickExpiry, 1, 1) &&
+        ParentItem->Entry.nodeid == Item->ParentIno &&
+        Name->MaximumLength >= Item->Name->Length;
+    if (Result)
+    {
+        *PParentIno = Item->ParentIno;
+        Name->Length = Item->Name->Length;
+        RtlCopyMemory(Name->Buffer, Item->Name->Buffer, Item->Name->Length);
+    }
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    return Result;
+}
+
+VOID FuseCacheSetItemAttr(FUSE_CACHE *Cache, PVOID Item0,
+    FUSE_PROTO_ATTR *Attr, UINT64 AttrValid, UINT32 AttrValidNsec)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    UINT64 ExpirationTime = InterruptTime + AttrValid * 10000000 + AttrValidNsec / 100;
+
+    if (0 == Item)
+        return;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    /*
+     * The entry timeout is not known here (only the combined expiration time is kept),
+     * so the new attribute timeout may shorten the item's lifetime but never extend it.
+     */
+    if (Item->ExpirationTime > ExpirationTime)
+        Item->ExpirationTime = ExpirationTime;
+    Item->Entry.attr_valid = AttrValid;
+    Item->Entry.attr_valid_nsec = AttrValidNsec;
+    RtlCopyMemory(&Item->Entry.attr, Attr, sizeof Item->Entry.attr);
+    Item->TimesStale = FALSE;
+
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
+VOID FuseCacheSetItemSize(FUSE_CACHE *Cache, PVOID Item0, UINT64 Size)
+    /*
+     * Account for a successful WRITE: the size (and allocation) may grow. The times are
+     * set by the file system and are not known here; they are marked stale, so that the
+     * next consumer of the attributes gets them from the file system (path walks keep
+     * using the entry; see FuseCacheGetEntry). The item expiration
+     * time is left unchanged.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    if (Item->Entry.attr.size < Size)
+        Item->Entry.attr.size = Size;
+    if (Item->Entry.attr.blocks < (Item->Entry.attr.size + 511) / 512)
+        Item->Entry.attr.blocks = (Item->Entry.attr.size + 511) / 512;
+    Item->TimesStale = TRUE;
+
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item0, FUSE_PROTO_ATTR *Attr)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    BOOLEAN Result = FALSE;
+
+    if (0 == Item)
+        return FALSE;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    if (!Item->TimesStale &&
+        InterruptTime < Item->ExpirationTime &&
+        !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
+    {
+        RtlCopyMemory(Attr, &Item->Entry.attr, sizeof Item->Entry.attr);
+        Result = TRUE;
+    }
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    return Result;
+}
+
+VOID FuseCacheCountItemChildren(FUSE_CACHE *Cache, PVOID Item0,
+    UINT64 Offset, UINT64 NextOffset, ULONG Count, BOOLEAN EndOfDir)
+    /*
+     * Count directory children from a READDIR reply.
+     *
+     * Offset is the READDIR offset, NextOffset the offset of the last entry in the reply
+     * and Count the number of entries in the reply other than "." and "..". An enumeration
+     * from offset 0 starts counting; it completes if READDIR replies are seen back-to-back
+     * until the end of the directory.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    if (0 == Offset)
+    {
+        Item->ChildState = FuseCacheChildrenCounting;
+        Item->ChildOffset = 0;
+        Item->ChildCount = 0;
+    }
+
+    if (FuseCacheChildrenCounting == Item->ChildState && Offset == Item->ChildOffset)
+    {
+        if (EndOfDir)
+            Item->ChildState = FuseCacheChildrenComplete;
+        else
+        {
+            Item->ChildOffset = NextOffset;
+            Item->ChildCount += Count;
+        }
+    }
+    else if (FuseCacheChildrenComplete != Item->ChildState)
+        Item->ChildState = FuseCacheChildrenUnknown;
+
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
+VOID FuseCacheAdjustItemChildren(FUSE_CACHE *Cache, PVOID Item0, LONG Delta)
+    /*
+     * Account for a child that was added (Delta > 0) or removed (Delta < 0)
+     * through this file system.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    if (FuseCacheChildrenComplete == Item->ChildState &&
+        (0 <= Delta || (ULONG)-Delta <= Item->ChildCount))
+        Item->ChildCount += Delta;
+    else
+        /* a change during an enumeration may or may not be seen by it */
+        Item->ChildState = FuseCacheChildrenUnknown;
+
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
+BOOLEAN FuseCacheGetItemChildren(FUSE_CACHE *Cache, PVOID Item0, PULONG PCount)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    BOOLEAN Result = FALSE;
+
+    if (0 == Item)
+        return FALSE;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    /* the count is only trusted for as long as the item itself */
+    if (FuseCacheChildrenComplete == Item->ChildState &&
+        InterruptTime < Item->ExpirationTime &&
+        !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
+    {
+        *PCount = Item->ChildCount;
+        Result = TRUE;
+    }
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    return Result;
+}
+
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList)
 {
     PAGED_CODE();
@@ -652,3 +1326,26 @@ BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForge
 
     return TRUE;
 }
+
+VOID FuseCacheForgetNodeid(FUSE_CACHE *Cache, UINT64 Nodeid)
+    /*
+     * Forget one lookup of an inode that has no item in the cache (e.g. one looked up
+     * by a request that had already been failed when its reply arrived). The FORGET is
+     * sent along with the forgotten items on the next expiration.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item;
+
+    Item = FuseAllocCacheAlignedMustSucceed(sizeof *Item);
+
+    RtlZeroMemory(Item, sizeof *Item);
+    Item->NLookup = 1;
+    Item->Entry.nodeid = Nodeid;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    /* LastUsedTime is 0; the item is forgotten on the next expiration */
+    InsertHeadList(&Cache->ForgetList, &Item->ListEntry);
+    ExReleaseFastMutex(&Cache->Mutex);
+}
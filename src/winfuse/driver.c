@@ -22,9 +22,11 @@
 #include <winfuse/driver.h>
 
 DRIVER_INITIALIZE DriverEntry;
+static VOID FuseReadParameters(PUNICODE_STRING RegistryPath);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(INIT, FuseReadParameters)
 #endif
 
 NTSTATUS DriverEntry(
@@ -35,5 +37,76 @@ NTSTATUS DriverEntry(
         DbgBreakPoint();
 #endif
 
+    FuseReadParameters(RegistryPath);
+    FuseCacheInitialize();
+
     return FspFsextProviderRegister(&FuseProvider);
 }
+
+static VOID FuseReadParameters(PUNICODE_STRING RegistryPath)
+    /*
+     * Read optional driver settings from the Parameters subkey of the service key:
+     *
+     * MetaTimeout, DataTimeout, BackgroundTimeout (REG_DWORD)
+     *     request deadlines in milliseconds for each deadline class; 0 (the default)
+     *     disables; RELEASE never has a deadline
+     * ContextMemoryBudget (REG_DWORD)
+     *     per-volume limit in kilobytes for contexts and their buffers; 0 disables
+     * CacheMemoryBudget (REG_DWORD)
+     *     limit in kilobytes shared by the entry caches of all volumes; 0 disables
+     * FsdInfoTimeout (REG_DWORD)
+     *     milliseconds that the FSD may cache file, directory, volume and security
+     *     information; timeouts set by the file system take precedence; 0 (the
+     *     default) leaves the volume's timeouts unchanged
+     * HandleCacheTimeout (REG_DWORD)
+     *     milliseconds that a closed read-only file opened with KEEP_CACHE keeps its
+     *     FUSE handle for reuse by a later open; 0 (the default) disables
+     */
+{
+    static const WCHAR Parameters[] = L"\\Parameters";
+    UNICODE_STRING Path;
+    RTL_QUERY_REGISTRY_TABLE QueryTable[8];
+
+    Path.Length = 0;
+    Path.MaximumLength = (USHORT)(RegistryPath->Length + sizeof Parameters);
+    Path.Buffer = FuseAlloc(Path.MaximumLength);
+    if (0 == Path.Buffer)
+        return;
+    RtlCopyUnicodeString(&Path, RegistryPath);
+    RtlAppendUnicodeToString(&Path, Parameters);
+
+    RtlZeroMemory(QueryTable, sizeof QueryTable);
+    QueryTable[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[0].Name = L"MetaTimeout";
+    QueryTable[0].EntryContext = &FuseIoqDeadlineTimeouts[FuseIoqDeadlineMeta];
+    QueryTable[0].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[1].Name = L"DataTimeout";
+    QueryTable[1].EntryContext = &FuseIoqDeadlineTimeouts[FuseIoqDeadlineData];
+    QueryTable[1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[2].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[2].Name = L"BackgroundTimeout";
+    QueryTable[2].EntryContext = &FuseIoqDeadlineTimeouts[FuseIoqDeadlineBackground];
+    QueryTable[2].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[3].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[3].Name = L"ContextMemoryBudget";
+    QueryTable[3].EntryContext = &FuseContextMemoryBudget;
+    QueryTable[3].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[4].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[4].Name = L"CacheMemoryBudget";
+    QueryTable[4].EntryContext = &FuseCacheMemoryBudget;
+    QueryTable[4].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[5].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[5].Name = L"FsdInfoTimeout";
+    QueryTable[5].EntryContext = &FuseFsdInfoTimeout;
+    QueryTable[5].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    QueryTable[6].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    QueryTable[6].Name = L"HandleCacheTimeout";
+    QueryTable[6].EntryContext = &FuseFileHandleCacheTimeout;
+    QueryTable[6].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+
+    /* missing key or values keep the defaults */
+    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, Path.Buffer, QueryTable, 0, 0);
+
+    FuseFree(Path.Buffer);
+}
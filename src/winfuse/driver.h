@@ -33,6 +33,7 @@
 
 #include <winfuse/coro.h>
 #include <winfuse/proto.h>
+#include <winfuse/snapshot.h>
 
 #define DRIVER_NAME                     "WinFuse"
 
@@ -55,6 +56,52 @@ BOOLEAN DebugMemory(PVOID Memory, SIZE_T Size, BOOLEAN Test);
 #define FUSE_FSCTL_TRANSACT             \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'F', METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+/* control codes handled by the driver itself (sent as DeviceIoControl on a volume file) */
+#define FUSE_IOCTL_QUERY_STATS          \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'S', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FUSE_STATS_OPCODE_COUNT         64
+typedef struct _FUSE_STATS
+{
+    UINT32 Size;                        /* sizeof(FUSE_STATS) */
+    UINT32 MaxBackground;               /* background credits */
+    UINT32 CongestionThreshold;
+    UINT32 BackgroundActive;            /* credits in use */
+    UINT32 BackgroundQueued;
+    UINT32 Flags;                       /* FUSE_STATS_* */
+    UINT32 TimeoutCount;                /* requests failed with STATUS_IO_TIMEOUT */
+    UINT32 ZombieCount;                 /* timed out requests still without a reply */
+    UINT64 ContextMemory;               /* bytes held by contexts and their buffers */
+    UINT64 ContextMemoryPeak;
+    UINT64 ContextMemoryBudget;         /* 0 means unlimited */
+    UINT64 ContextMemoryRefused;        /* allocations refused because of the budget */
+    UINT32 CacheCapacity;               /* entry cache capacity (items) */
+    UINT32 CacheItemCount;
+    UINT64 CacheMemory;                 /* bytes held by the entry cache */
+    UINT64 CacheLookups;
+    UINT64 CacheHits;
+    UINT64 RequestCount[FUSE_STATS_OPCODE_COUNT];
+                                        /* requests that expect a reply, by FUSE opcode */
+} FUSE_STATS;
+#define FUSE_STATS_DEGRADED             0x00000001
+                                        /* requests have timed out and are still outstanding */
+#define FUSE_IOCTL_EXPORT_SNAPSHOT      \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'E', METHOD_BUFFERED, FILE_ANY_ACCESS)
+                                        /* output: FUSE_SNAPSHOT of the hot entry cache;
+                                           administrators and the mounting process only */
+#define FUSE_IOCTL_PRIME_SNAPSHOT       \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'P', METHOD_BUFFERED, FILE_ANY_ACCESS)
+                                        /* input: FUSE_SNAPSHOT to LOOKUP in the background;
+                                           administrators and the mounting process only */
+#define FUSE_IOCTL_BULK_STAT            \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'B', METHOD_BUFFERED, FILE_READ_ACCESS)
+                                        /* input: NUL terminated paths, e.g. L"\\a\\b\0\\c\0" */
+typedef struct _FUSE_BULK_STAT
+{
+    UINT32 Status;                      /* NTSTATUS of the path lookup */
+    UINT32 Reserved;
+    FSP_FSCTL_FILE_INFO FileInfo;
+} FUSE_BULK_STAT;                       /* output: one per path, in order, as many as fit */
+
 /* read/write locks */
 #define FUSE_RWLOCK_USE_SEMAPHORE
 //#define FUSE_RWLOCK_USE_ERESOURCE
@@ -157,10 +204,17 @@ typedef struct _FUSE_DEVICE_EXTENSION
     FUSE_RWLOCK OpGuardLock;
     PVOID Ioq;
     PVOID Cache;
+    PVOID SecurityCache;
+    PVOID ScratchLookasideList;
+    LONG64 ContextMemory, ContextMemoryPeak, ContextMemoryRefused;
     KEVENT InitEvent;
     UINT32 VersionMajor, VersionMinor;
+    UINT32 InitFlags;                   /* FUSE_PROTO_INIT_* advertised and known to the file system */
+    UINT32 MountPid;                    /* process that created the volume */
     KSPIN_LOCK FileListLock;
     LIST_ENTRY FileList;
+    LIST_ENTRY IdleFileList;            /* closed files kept open for reuse; protected by FileListLock */
+    ULONG IdleFileCount;
     /*
      * The following bitmap is used to remember which opcodes have returned ENOSYS.
      *
@@ -175,6 +229,7 @@ typedef struct _FUSE_DEVICE_EXTENSION
     UINT32 OpcodeENOSYS[2];
 } FUSE_DEVICE_EXTENSION;
 extern FSP_FSEXT_PROVIDER FuseProvider;
+extern UINT32 FuseFsdInfoTimeout;       /* milliseconds; 0 (the default) leaves the volume's timeouts */
 static inline
 FUSE_DEVICE_EXTENSION *FuseDeviceExtension(PDEVICE_OBJECT DeviceObject)
 {
@@ -198,22 +253,52 @@ VOID FuseOpcodeSetENOSYS(PDEVICE_OBJECT DeviceObject, UINT32 Opcode)
 }
 
 /* FUSE files */
+typedef struct _FUSE_FILE_DIR_CURSOR
+{
+    UINT64 Offset;                      /* directory offset that the cursor continues from */
+    ULONG Length;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[];
+                                        /* undelivered FUSE_PROTO_DIRENT's */
+} FUSE_FILE_DIR_CURSOR;
 typedef struct _FUSE_FILE
 {
     LIST_ENTRY ListEntry;
     UINT64 Ino;
     UINT64 Fh;
     UINT32 OpenFlags;
+    UINT32 OrigUid, OrigGid;            /* credentials of the opener */
     UINT32 IsDirectory:1;
     UINT32 IsReparsePoint:1;
+    UINT32 NoOpen:1;                    /* opened without OPEN/OPENDIR (fh 0); not released */
+    UINT32 Reusable:1;                  /* read-only, KEEP_CACHE and not DIRECT_IO; fh may be reused */
+    UINT32 Privileged:1;                /* opened by an administrator or the mounting process */
     PVOID CacheItem;
+    FUSE_FILE_DIR_CURSOR *DirCursor;
+    struct _FUSE_FILE *ReleaseNext;     /* next file in a background RELEASE batch */
+    PVOID ParentCacheItem;              /* parent directory as of open (or the last rename) */
+    /* handle cache */
+    LIST_ENTRY IdleEntry;
+    UINT64 IdleExpirationTime;
 } FUSE_FILE;
 VOID FuseFileDeviceInit(PDEVICE_OBJECT DeviceObject);
 VOID FuseFileDeviceFini(PDEVICE_OBJECT DeviceObject);
 NTSTATUS FuseFileCreate(PDEVICE_OBJECT DeviceObject, FUSE_FILE **PFile);
 VOID FuseFileDelete(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File);
+VOID FuseFileSetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File, PVOID ParentCacheItem);
+BOOLEAN FuseFileGetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File,
+    PUINT64 PParentIno, PSTRING Name);
+FUSE_FILE *FuseFileIdleExchange(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File);
+FUSE_FILE *FuseFileIdleRemove(PDEVICE_OBJECT DeviceObject, PVOID CacheItem,
+    UINT32 OpenFlags, UINT32 OrigUid, UINT32 OrigGid);
+VOID FuseFileIdleRelease(PDEVICE_OBJECT DeviceObject, PVOID CacheItem);
+VOID FuseFileReleaseOrphan(PDEVICE_OBJECT DeviceObject,
+    UINT64 Ino, UINT64 Fh, UINT32 OpenFlags, BOOLEAN IsDirectory);
+VOID FuseFileExpirationRoutine(PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime);
+extern UINT32 FuseFileHandleCacheTimeout;   /* milliseconds; 0 disables */
 
 /* FUSE processing context */
+#define FUSE_CONTEXT_SCRATCH_SIZE       1024
+#define FUSE_CONTEXT_SCRATCH_CHUNK_SIZE PAGE_SIZE
 typedef struct _FUSE_CONTEXT FUSE_CONTEXT;
 typedef VOID FUSE_CONTEXT_FINI(FUSE_CONTEXT *Context);
 typedef BOOLEAN FUSE_OPERATION_PROC(FUSE_CONTEXT *Context);
@@ -236,11 +321,23 @@ typedef struct _FUSE_CONTEXT_LOOKUP
     UINT64 Ino;
     STRING Name;
     FUSE_PROTO_ATTR Attr;
+    BOOLEAN AttrStale;                  /* Attr size/times may be out of date; see FuseRefreshAttr */
+    BOOLEAN AttrChanged;                /* LOOKUP found a change made outside the volume */
 } FUSE_CONTEXT_LOOKUP;
 typedef struct _FUSE_CONTEXT_FORGET
 {
     LIST_ENTRY ForgetList;
 } FUSE_CONTEXT_FORGET;
+typedef struct _FUSE_CONTEXT_RELEASE
+{
+    FUSE_FILE *FileList;
+    ULONG FileCount;                    /* files added to the batch; see FuseIoqMergeRelease */
+    BOOLEAN Started;                    /* the context has started sending */
+} FUSE_CONTEXT_RELEASE;
+typedef struct _FUSE_CONTEXT_INTERRUPT
+{
+    UINT64 Unique;
+} FUSE_CONTEXT_INTERRUPT;
 typedef struct _FUSE_CONTEXT_SETATTR
 {
     FUSE_PROTO_ATTR Attr;
@@ -259,13 +356,29 @@ struct _FUSE_CONTEXT
     FUSE_PROTO_RSP *FuseResponse;
     ULONG FuseRequestLength;
     INT OpGuardResult;
+    UINT32 BackgroundCredit:1;          /* protected by the Ioq */
+    UINT32 TimedOut:1;                  /* protected by the Ioq */
+    UINT32 Zombie:1;
+    UINT64 Deadline;
+    /* request with the file system; kept to undo a late reply (see FuseProtoUndoLateReply) */
+    UINT32 Opcode, OpenFlags;
+    UINT64 Nodeid;
+    ULONG MemoryCharge;                 /* bytes charged against the context memory budget */
     SHORT CoroState[16];
     UINT32 OrigUid, OrigGid, OrigPid;
+    struct
+    {
+        UINT64 Ino;                     /* 0: empty (never a valid nodeid) */
+        UINT32 Uid, Gid, Mode;
+        UINT32 FileAccess;
+    } AccessMemo;                       /* last access mask computed by FuseAccessCheck */
     FUSE_FILE *File;
     union
     {
         FUSE_CONTEXT_LOOKUP Lookup;
         FUSE_CONTEXT_FORGET Forget;
+        FUSE_CONTEXT_RELEASE Release;
+        FUSE_CONTEXT_INTERRUPT Interrupt;
         struct
         {
             FUSE_CONTEXT_LOOKUP;
@@ -274,15 +387,27 @@ struct _FUSE_CONTEXT
             UINT32 DesiredAccess, GrantedAccess;
             UINT32 UserMode:1;
             UINT32 HasTraversePrivilege:1;
+            UINT32 Privileged:1;        /* caller is an administrator or the mounting process */
             UINT32 DisableCache:1;
             UINT32 Chown:1;
             UINT32 RenameIsNonExistent:1;
             UINT32 RenameIsDirectory:1;
+            UINT32 ParentValid:1;       /* Ino/Attr/CacheItem are those of a missing name's parent */
+            PVOID ParentCacheItem;      /* parent of the last name looked up by FuseLookupPath */
             /* 2 path operations (rename) */
             STRING OrigPath2;
             STRING Name2;
             UINT64 Ino2;
+            PVOID CacheItem2;
+            /* bulk stat (device control) */
+            PSTR BulkPath, BulkPathEnd;
+            ULONG BulkCount, BulkMaxCount;
         } LookupPath;
+        struct
+        {
+            FUSE_CONTEXT_LOOKUP;
+            FUSE_SNAPSHOT_PRIMER *Primer;
+        } Prime;
         FUSE_CONTEXT_SETATTR Setattr;
         struct
         {
@@ -296,10 +421,14 @@ struct _FUSE_CONTEXT
         {
             FUSE_CONTEXT_LOOKUP;
             STRING OrigName;
-            UINT64 NextOffset;
+            UINT64 NextOffset, MarkerOffset;
             UINT32 Length;
             ULONG BytesTransferred;
             PUINT8 Buffer, BufferEndP, BufferP;
+            FUSE_FILE_DIR_CURSOR *Cursor;
+            UNICODE_STRING Pattern;
+            PWSTR WideName;             /* current name as decoded by the pattern match */
+            ULONG WideNameLength;       /* 0 if the current name has not been decoded */
         } QueryDirectory;
         struct
         {
@@ -307,10 +436,20 @@ struct _FUSE_CONTEXT
             PSECURITY_DESCRIPTOR SecurityDescriptor;
         } Security;
     };
+    /*
+     * Scratch arena: memory that lives as long as the context.
+     * Must be last; the ScratchBuf is not zeroed on context creation.
+     */
+    PVOID ScratchChunk;
+    ULONG ScratchUsed;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 ScratchBuf[FUSE_CONTEXT_SCRATCH_SIZE];
 };
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
-    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest);
+    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest, UINT32 Hint);
 VOID FuseContextDelete(FUSE_CONTEXT *Context);
+PVOID FuseContextAlloc(FUSE_CONTEXT *Context, ULONG Size);
+VOID FuseContextQueryStats(PDEVICE_OBJECT DeviceObject, FUSE_STATS *Stats);
+extern UINT32 FuseContextMemoryBudget;  /* kilobytes; 0 means unlimited */
 static inline
 INT FuseOpGuardResult_(BOOLEAN RwlockResult)
 {
@@ -354,9 +493,33 @@ INT FuseOpGuardReleaseShared(FUSE_CONTEXT *Context)
 #define FuseContextToStatus(C)          ((NTSTATUS)(0xC0000000 | (UINT32)(UINT_PTR)(C)))
 #define FuseContextWaitRequest(C)       do { while (0 == (C)->FuseRequest) coro_yield; } while (0,0)
 #define FuseContextWaitResponse(C)      do { coro_yield; } while (0 == (C)->FuseResponse)
+#define FUSE_CONTEXT_HINT_PRIME         0x10000
+                                        /* internal context hint that is not a FUSE opcode */
+/*
+ * Background contexts are internal contexts whose completion no one waits for and that are
+ * subject to the max_background credit limit. FORGET is deliberately not one of them:
+ * FuseProtoPostForget already defers while background work is congested (the cache retries
+ * on its next expiration), so FORGET is throttled at the source. Queueing it behind RELEASE's
+ * as well would only delay dropping inode references in the file system, while the cache
+ * keeps the forgotten items until the FORGET is sent.
+ */
+#define FuseContextIsBackground(C)      \
+    (0 == (C)->InternalRequest &&       \
+        (FUSE_PROTO_OPCODE_RELEASE == (C)->InternalResponse->Hint ||\
+        FUSE_CONTEXT_HINT_PRIME == (C)->InternalResponse->Hint))
 extern FUSE_OPERATION FuseOperations[];
 
 /* FUSE I/O queue */
+enum
+{
+    FuseIoqDeadlineNone = 0,
+    FuseIoqDeadlineMeta,
+    FuseIoqDeadlineData,
+    FuseIoqDeadlineBackground,
+    FuseIoqDeadlineClassCount,
+};
+extern UINT32 FuseIoqDeadlineTimeouts[FuseIoqDeadlineClassCount];
+                                        /* milliseconds; 0 means no deadline */
 typedef struct _FUSE_IOQ FUSE_IOQ;
 NTSTATUS FuseIoqCreate(FUSE_IOQ **PIoq);
 VOID FuseIoqDelete(FUSE_IOQ *Ioq);
@@ -364,26 +527,62 @@ VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqEndProcessing(FUSE_IOQ *Ioq, UINT64 Unique);
 VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq); /* does not block! */
+BOOLEAN FuseIoqMergeRelease(FUSE_IOQ *Ioq, FUSE_FILE *File);
+VOID FuseIoqEndBackground(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
+BOOLEAN FuseIoqIsCongested(FUSE_IOQ *Ioq);
+VOID FuseIoqSetBackgroundLimits(FUSE_IOQ *Ioq, ULONG MaxBackground, ULONG CongestionThreshold);
+VOID FuseIoqQueryStats(FUSE_IOQ *Ioq, FUSE_STATS *Stats);
+VOID FuseIoqExpirationRoutine(FUSE_IOQ *Ioq, UINT64 InterruptTime);
+FUSE_CONTEXT *FuseIoqNextTimedOut(FUSE_IOQ *Ioq);
+VOID FuseIoqPostZombie(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 
 /* FUSE "entry" cache */
 typedef struct _FUSE_CACHE FUSE_CACHE;
-typedef struct _FUSE_CACHE_GEN FUSE_CACHE_GEN;
+VOID FuseCacheInitialize(VOID);
 NTSTATUS FuseCacheCreate(ULONG Capacity, BOOLEAN CaseInsensitive, FUSE_CACHE **PCache);
 VOID FuseCacheDelete(FUSE_CACHE *Cache);
+VOID FuseCacheQueryStats(FUSE_CACHE *Cache, FUSE_STATS *Stats);
 VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
     PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime);
 NTSTATUS FuseCacheReferenceGen(FUSE_CACHE *Cache, PVOID *PGen);
 VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen);
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    FUSE_PROTO_ENTRY *Entry, PVOID *PItem, PBOOLEAN PTimesStale);
+BOOLEAN FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
-VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
-VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+PVOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+PVOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName);
+NTSTATUS FuseCacheExportSnapshot(FUSE_CACHE *Cache, PVOID Buffer, ULONG Length, PULONG PSize);
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDereferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item);
+BOOLEAN FuseCacheGetItemParent(FUSE_CACHE *Cache, PVOID Item, PVOID ParentItem,
+    PUINT64 PParentIno, PSTRING Name);
+VOID FuseCacheSetItemAttr(FUSE_CACHE *Cache, PVOID Item,
+    FUSE_PROTO_ATTR *Attr, UINT64 AttrValid, UINT32 AttrValidNsec);
+VOID FuseCacheSetItemSize(FUSE_CACHE *Cache, PVOID Item, UINT64 Size);
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item, FUSE_PROTO_ATTR *Attr);
+VOID FuseCacheCountItemChildren(FUSE_CACHE *Cache, PVOID Item,
+    UINT64 Offset, UINT64 NextOffset, ULONG Count, BOOLEAN EndOfDir);
+VOID FuseCacheAdjustItemChildren(FUSE_CACHE *Cache, PVOID Item, LONG Delta);
+BOOLEAN FuseCacheGetItemChildren(FUSE_CACHE *Cache, PVOID Item, PULONG PCount);
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList);
 BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForgetOne);
+VOID FuseCacheForgetNodeid(FUSE_CACHE *Cache, UINT64 Nodeid);
+extern UINT32 FuseCacheMemoryBudget;    /* kilobytes shared by all volumes; 0 disables */
+
+/* security descriptor cache */
+typedef struct _FUSE_SECURITY_CACHE FUSE_SECURITY_CACHE;
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PSecurityCache);
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *SecurityCache);
+NTSTATUS FuseSecurityCacheReferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor, PULONG PLength);
+VOID FuseSecurityCacheDereferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    PSECURITY_DESCRIPTOR SecurityDescriptor);
+NTSTATUS FuseSecurityCacheGetTokenCredentials(FUSE_SECURITY_CACHE *SecurityCache,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid);
 
 /* protocol implementation */
 NTSTATUS FuseProtoPostInit(PDEVICE_OBJECT DeviceObject);
@@ -392,6 +591,12 @@ VOID FuseProtoSendLookup(FUSE_CONTEXT *Context);
 NTSTATUS FuseProtoPostForget(PDEVICE_OBJECT DeviceObject, PLIST_ENTRY ForgetList);
 VOID FuseProtoFillForget(FUSE_CONTEXT *Context);
 VOID FuseProtoFillBatchForget(FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostRelease(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File);
+VOID FuseProtoRepostRelease(PDEVICE_OBJECT DeviceObject, FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostPrime(PDEVICE_OBJECT DeviceObject, PVOID Buffer, ULONG Length);
+NTSTATUS FuseProtoPostInterrupt(PDEVICE_OBJECT DeviceObject, UINT64 Unique);
+VOID FuseProtoFillInterrupt(FUSE_CONTEXT *Context);
+VOID FuseProtoUndoLateReply(FUSE_CONTEXT *Context, FUSE_PROTO_RSP *FuseResponse);
 VOID FuseProtoSendStatfs(FUSE_CONTEXT *Context);
 VOID FuseProtoSendGetattr(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFgetattr(FUSE_CONTEXT *Context);
@@ -432,9 +637,20 @@ VOID FuseUnixTimeToFileTime(UINT64 sec, UINT32 nsec, PUINT64 PFileTime)
 }
 NTSTATUS FuseNtStatusFromErrno(INT32 Errno);
 
+/* per-CPU epochs */
+typedef struct _FUSE_EPOCH FUSE_EPOCH;
+NTSTATUS FuseEpochCreate(FUSE_EPOCH **PEpoch);
+VOID FuseEpochDelete(FUSE_EPOCH *Epoch);
+PVOID FuseEpochEnter(FUSE_EPOCH *Epoch);
+VOID FuseEpochLeave(FUSE_EPOCH *Epoch, PVOID Slot);
+UINT64 FuseEpochAdvance(FUSE_EPOCH *Epoch, UINT64 InterruptTime);
+
 /* paths */
 VOID FusePosixPathPrefix(PSTRING Path, PSTRING Prefix, PSTRING Remain);
 VOID FusePosixPathSuffix(PSTRING Path, PSTRING Remain, PSTRING Suffix);
+BOOLEAN FusePosixPathDecodeName(PSTRING Name,
+    PWSTR WideName, ULONG WideNameSize, PULONG PWideNameLength);
+VOID FusePosixPathEncode(PSTR Path, PULONG PLength);
 
 /* utility */
 PVOID FuseAllocatePoolMustSucceed(POOL_TYPE PoolType, SIZE_T Size, ULONG Tag);
@@ -446,6 +662,9 @@ NTSTATUS FuseGetTokenUid(PACCESS_TOKEN Token, TOKEN_INFORMATION_CLASS InfoClass,
 #define FuseAlloc(Size)                 ExAllocatePoolWithTag(PagedPool, Size, FUSE_ALLOC_TAG)
 #define FuseAllocNonPaged(Size)         ExAllocatePoolWithTag(NonPagedPool, Size, FUSE_ALLOC_TAG)
 #define FuseAllocMustSucceed(Size)      FuseAllocatePoolMustSucceed(PagedPool, Size, FUSE_ALLOC_TAG)
+#define FuseAllocCacheAligned(Size)     ExAllocatePoolWithTag(PagedPoolCacheAligned, Size, FUSE_ALLOC_TAG)
+#define FuseAllocCacheAlignedMustSucceed(Size)\
+    FuseAllocatePoolMustSucceed(PagedPoolCacheAligned, Size, FUSE_ALLOC_TAG)
 #define FuseFree(Pointer)               ExFreePoolWithTag(Pointer, FUSE_ALLOC_TAG)
 #define FuseFreeExternal(Pointer)       ExFreePool(Pointer)
 
@@ -0,0 +1,178 @@
+/**
+ * @file winfuse/epoch.c
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfuse/driver.h>
+
+/*
+ * Per-CPU epochs
+ *
+ * An epoch tracks which operations are active, so that the cache can tell when no
+ * operation can still be using an entry that it wants to FORGET. It replaces a list
+ * of mutex protected generations: entering and leaving an epoch take no lock and
+ * allocate no memory.
+ *
+ * There are three epoch slots, which rotate through being current, previous and free.
+ * Each CPU has a cache line with an active operation count per slot. An operation
+ * enters the current epoch by incrementing its CPU's count for the current slot and
+ * leaves it by decrementing the same count (possibly from another CPU); so every count
+ * is non-negative and is non-zero while any operation that incremented it is active.
+ *
+ * FuseEpochAdvance (which must be serialized by the caller) advances the current epoch
+ * when the previous epoch has no active operations. Thus active operations are always
+ * in the current or previous epoch and the free slot can be reused for the next epoch.
+ * It then returns the start time of the oldest epoch with active operations: no active
+ * operation started earlier than that.
+ */
+
+NTSTATUS FuseEpochCreate(FUSE_EPOCH **PEpoch);
+VOID FuseEpochDelete(FUSE_EPOCH *Epoch);
+PVOID FuseEpochEnter(FUSE_EPOCH *Epoch);
+VOID FuseEpochLeave(FUSE_EPOCH *Epoch, PVOID Slot);
+UINT64 FuseEpochAdvance(FUSE_EPOCH *Epoch, UINT64 InterruptTime);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FuseEpochCreate)
+#pragma alloc_text(PAGE, FuseEpochDelete)
+#pragma alloc_text(PAGE, FuseEpochEnter)
+#pragma alloc_text(PAGE, FuseEpochLeave)
+#pragma alloc_text(PAGE, FuseEpochAdvance)
+#endif
+
+#define FUSE_EPOCH_SLOT_COUNT           3
+#define FUSE_EPOCH_LINE_SIZE            64
+
+typedef struct
+{
+    LONG Count[FUSE_EPOCH_SLOT_COUNT];
+    UINT8 Padding[FUSE_EPOCH_LINE_SIZE - FUSE_EPOCH_SLOT_COUNT * sizeof(LONG)];
+} FUSE_EPOCH_CPU;
+C_ASSERT(FUSE_EPOCH_LINE_SIZE == sizeof(FUSE_EPOCH_CPU));
+
+struct _FUSE_EPOCH
+{
+    FUSE_EPOCH_CPU *Cpus;
+    ULONG CpuCount;
+    UINT64 StartTime[FUSE_EPOCH_SLOT_COUNT];
+    volatile LONG CurrentSlot;
+};
+
+static inline LONG FuseEpochActiveCount(FUSE_EPOCH *Epoch, ULONG Slot)
+{
+    LONG Count = 0;
+    for (ULONG I = 0; Epoch->CpuCount > I; I++)
+        Count += InterlockedCompareExchange(&Epoch->Cpus[I].Count[Slot], 0, 0);
+    return Count;
+}
+
+NTSTATUS FuseEpochCreate(FUSE_EPOCH **PEpoch)
+{
+    PAGED_CODE();
+
+    FUSE_EPOCH *Epoch;
+    ULONG CpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    *PEpoch = 0;
+
+    Epoch = FuseAlloc(sizeof *Epoch);
+    if (0 == Epoch)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Epoch, sizeof *Epoch);
+    Epoch->CpuCount = CpuCount;
+    Epoch->Cpus = FuseAllocCacheAligned(CpuCount * sizeof Epoch->Cpus[0]);
+    if (0 == Epoch->Cpus)
+    {
+        FuseFree(Epoch);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Epoch->Cpus, CpuCount * sizeof Epoch->Cpus[0]);
+
+    *PEpoch = Epoch;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FuseEpochDelete(FUSE_EPOCH *Epoch)
+{
+    PAGED_CODE();
+
+    FuseFree(Epoch->Cpus);
+    FuseFree(Epoch);
+}
+
+PVOID FuseEpochEnter(FUSE_EPOCH *Epoch)
+{
+    PAGED_CODE();
+
+    FUSE_EPOCH_CPU *Cpu = &Epoch->Cpus[KeGetCurrentProcessorNumberEx(0) % Epoch->CpuCount];
+    LONG CurrentSlot;
+    PLONG Slot;
+
+    for (;;)
+    {
+        CurrentSlot = Epoch->CurrentSlot;
+        Slot = &Cpu->Count[CurrentSlot];
+        InterlockedIncrement(Slot);
+
+        /*
+         * If the epoch advanced before our increment was visible, FuseEpochAdvance may
+         * not have seen it; retry with the new epoch. A stale increment is harmless:
+         * it can only delay advancing or forgetting.
+         */
+        if (CurrentSlot == Epoch->CurrentSlot)
+            return Slot;
+
+        InterlockedDecrement(Slot);
+    }
+}
+
+VOID FuseEpochLeave(FUSE_EPOCH *Epoch, PVOID Slot)
+{
+    PAGED_CODE();
+
+    if (0 == Slot)
+        return;
+
+    InterlockedDecrement((PLONG)Slot);
+}
+
+UINT64 FuseEpochAdvance(FUSE_EPOCH *Epoch, UINT64 InterruptTime)
+{
+    PAGED_CODE();
+
+    ULONG CurrentSlot = Epoch->CurrentSlot;
+    ULONG PreviousSlot = (CurrentSlot + FUSE_EPOCH_SLOT_COUNT - 1) % FUSE_EPOCH_SLOT_COUNT;
+
+    if (0 == FuseEpochActiveCount(Epoch, PreviousSlot))
+    {
+        /* the next slot is the free slot: it has had no active operations since it was previous */
+        PreviousSlot = CurrentSlot;
+        CurrentSlot = (CurrentSlot + 1) % FUSE_EPOCH_SLOT_COUNT;
+        Epoch->StartTime[CurrentSlot] = InterruptTime;
+        InterlockedExchange(&Epoch->CurrentSlot, CurrentSlot);
+    }
+
+    if (0 != FuseEpochActiveCount(Epoch, PreviousSlot))
+        return Epoch->StartTime[PreviousSlot];
+    if (0 != FuseEpochActiveCount(Epoch, CurrentSlot))
+        return Epoch->StartTime[CurrentSlot];
+    return (UINT64)-1LL;
+}
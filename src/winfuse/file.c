@@ -21,12 +21,27 @@
 
 #include <winfuse/driver.h>
 
+VOID FuseFileSetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File, PVOID ParentCacheItem);
+BOOLEAN FuseFileGetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File,
+    PUINT64 PParentIno, PSTRING Name);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FuseFileSetParent)
+#pragma alloc_text(PAGE, FuseFileGetParent)
+#endif
+
+#define FUSE_FILE_IDLE_MAX              64
+                                        /* maximum number of closed files kept open per volume */
+
+UINT32 FuseFileHandleCacheTimeout = 0;
+
 VOID FuseFileDeviceInit(PDEVICE_OBJECT DeviceObject)
 {
     FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
 
     KeInitializeSpinLock(&DeviceExtension->FileListLock);
     InitializeListHead(&DeviceExtension->FileList);
+    InitializeListHead(&DeviceExtension->IdleFileList);
 }
 
 VOID FuseFileDeviceFini(PDEVICE_OBJECT DeviceObject)
@@ -39,6 +54,9 @@ VOID FuseFileDeviceFini(PDEVICE_OBJECT DeviceObject)
         File = CONTAINING_RECORD(Entry, FUSE_FILE, ListEntry);
         Entry = Entry->Flink;
         FuseCacheDereferenceItem(DeviceExtension->Cache, File->CacheItem);
+        FuseCacheDereferenceItem(DeviceExtension->Cache, File->ParentCacheItem);
+        if (0 != File->DirCursor)
+            FuseFree(File->DirCursor);
         FuseFree(File);
     }
 }
@@ -77,7 +95,235 @@ VOID FuseFileDelete(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File)
     KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
 
     FuseCacheDereferenceItem(DeviceExtension->Cache, File->CacheItem);
+    FuseCacheDereferenceItem(DeviceExtension->Cache, File->ParentCacheItem);
+    if (0 != File->DirCursor)
+        FuseFree(File->DirCursor);
 
     DEBUGFILL(File, sizeof *File);
     FuseFree(File);
 }
+
+VOID FuseFileSetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File, PVOID ParentCacheItem)
+    /*
+     * Record the parent directory of a file, so that delete and rename need not look up
+     * its path again. Its name need not be recorded; it is that of the file's cache item.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+
+    /* reference the new parent before dereferencing the old one; they may be the same */
+    if (0 != ParentCacheItem)
+        FuseCacheReferenceItem(DeviceExtension->Cache, ParentCacheItem);
+    FuseCacheDereferenceItem(DeviceExtension->Cache, File->ParentCacheItem);
+    File->ParentCacheItem = ParentCacheItem;
+}
+
+BOOLEAN FuseFileGetParent(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File,
+    PUINT64 PParentIno, PSTRING Name)
+    /*
+     * Get the parent directory and name of a file (see FuseCacheGetItemParent).
+     *
+     * They are valid for as long as the cache still holds fresh items for both the
+     * parent directory and the file. Renames through the file system move the file's
+     * item (see FuseCacheMoveEntry) so that a stale name is never used.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+
+    return FuseCacheGetItemParent(DeviceExtension->Cache,
+        File->CacheItem, File->ParentCacheItem, PParentIno, Name);
+}
+
+FUSE_FILE *FuseFileIdleExchange(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File)
+    /*
+     * Keep a closed file open for a short time (FuseFileHandleCacheTimeout), so that
+     * an open of the same file with the same flags can reuse its handle without OPEN
+     * (see FuseFileIdleRemove).
+     *
+     * Returns the file that must be released now: the file itself if it cannot be kept,
+     * the least recently closed file if too many files are kept, or 0.
+     */
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    KIRQL Irql;
+    FUSE_FILE *EvictedFile = 0;
+
+    if (0 == FuseFileHandleCacheTimeout || !File->Reusable)
+        return File;
+
+    ASSERT(!File->IsDirectory && !File->IsReparsePoint && !File->NoOpen);
+    ASSERT(0 == File->ReleaseNext);
+
+    File->IdleExpirationTime = KeQueryInterruptTime() + FuseFileHandleCacheTimeout * 10000ULL;
+
+    KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+    InsertTailList(&DeviceExtension->IdleFileList, &File->IdleEntry);
+    if (FUSE_FILE_IDLE_MAX < ++DeviceExtension->IdleFileCount)
+    {
+        EvictedFile = CONTAINING_RECORD(
+            RemoveHeadList(&DeviceExtension->IdleFileList), FUSE_FILE, IdleEntry);
+        DeviceExtension->IdleFileCount--;
+    }
+    KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+
+    return EvictedFile;
+}
+
+FUSE_FILE *FuseFileIdleRemove(PDEVICE_OBJECT DeviceObject, PVOID CacheItem,
+    UINT32 OpenFlags, UINT32 OrigUid, UINT32 OrigGid)
+    /*
+     * Remove and return the most recently closed file that was opened from the same
+     * cache item with the same flags by the same user; the file system may have checked
+     * access or recorded the credentials when it opened the handle. The cache item
+     * stands for the file's entry: once the entry is invalidated (e.g. by unlink, rename
+     * or an expired LOOKUP that found a different inode) a new item is used and the
+     * closed file is no longer found. Unlink and rename release it right away (see
+     * FuseFileIdleRelease); otherwise it is released when it expires.
+     */
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    KIRQL Irql;
+    FUSE_FILE *File = 0;
+
+    if (0 == CacheItem)
+        return 0;
+
+    KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+    for (PLIST_ENTRY Entry = DeviceExtension->IdleFileList.Blink;
+        &DeviceExtension->IdleFileList != Entry;
+        Entry = Entry->Blink)
+    {
+        FUSE_FILE *FileX = CONTAINING_RECORD(Entry, FUSE_FILE, IdleEntry);
+        if (FileX->CacheItem == CacheItem && FileX->OpenFlags == OpenFlags &&
+            FileX->OrigUid == OrigUid && FileX->OrigGid == OrigGid)
+        {
+            RemoveEntryList(&FileX->IdleEntry);
+            DeviceExtension->IdleFileCount--;
+            File = FileX;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+
+    return File;
+}
+
+VOID FuseFileIdleRelease(PDEVICE_OBJECT DeviceObject, PVOID CacheItem)
+    /*
+     * Release the closed files kept for a cache item that has been removed from the cache
+     * (see FuseCacheRemoveEntry). They can no longer be reused, but would keep a possibly
+     * unlinked file open in the file system until they expire. If the Ioq is congested
+     * a file is kept without its cache item and released on the next expiration.
+     */
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    KIRQL Irql;
+    LIST_ENTRY ReleaseList;
+    FUSE_FILE *File;
+
+    if (0 == CacheItem)
+        return;
+
+    InitializeListHead(&ReleaseList);
+
+    KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+    for (PLIST_ENTRY Entry = DeviceExtension->IdleFileList.Flink;
+        &DeviceExtension->IdleFileList != Entry;)
+    {
+        File = CONTAINING_RECORD(Entry, FUSE_FILE, IdleEntry);
+        Entry = Entry->Flink;
+        if (File->CacheItem == CacheItem)
+        {
+            RemoveEntryList(&File->IdleEntry);
+            DeviceExtension->IdleFileCount--;
+            InsertTailList(&ReleaseList, &File->IdleEntry);
+        }
+    }
+    KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+
+    while (!IsListEmpty(&ReleaseList))
+    {
+        File = CONTAINING_RECORD(RemoveHeadList(&ReleaseList), FUSE_FILE, IdleEntry);
+        if (!NT_SUCCESS(FuseProtoPostRelease(DeviceObject, File)))
+        {
+            FuseCacheDereferenceItem(DeviceExtension->Cache, File->CacheItem);
+            File->CacheItem = 0;
+            File->IdleExpirationTime = 0;
+            KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+            InsertHeadList(&DeviceExtension->IdleFileList, &File->IdleEntry);
+            DeviceExtension->IdleFileCount++;
+            KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+        }
+    }
+}
+
+VOID FuseFileReleaseOrphan(PDEVICE_OBJECT DeviceObject,
+    UINT64 Ino, UINT64 Fh, UINT32 OpenFlags, BOOLEAN IsDirectory)
+    /*
+     * Release a handle that the file system opened for a request that had already been
+     * failed when its reply arrived. If the Ioq is congested the file is kept with the
+     * idle files and released on the next expiration; it has no cache item, so it is
+     * never reused.
+     */
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    KIRQL Irql;
+    FUSE_FILE *File;
+
+    if (!NT_SUCCESS(FuseFileCreate(DeviceObject, &File)))
+        return;
+
+    File->Ino = Ino;
+    File->Fh = Fh;
+    File->OpenFlags = OpenFlags;
+    File->IsDirectory = IsDirectory;
+
+    if (!NT_SUCCESS(FuseProtoPostRelease(DeviceObject, File)))
+    {
+        File->IdleExpirationTime = 0;
+        KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+        InsertHeadList(&DeviceExtension->IdleFileList, &File->IdleEntry);
+        DeviceExtension->IdleFileCount++;
+        KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+    }
+}
+
+VOID FuseFileExpirationRoutine(PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime)
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    KIRQL Irql;
+    LIST_ENTRY ExpiredList;
+    FUSE_FILE *File;
+
+    InitializeListHead(&ExpiredList);
+
+    /* files are kept in close order and all use the same timeout */
+    KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+    while (!IsListEmpty(&DeviceExtension->IdleFileList))
+    {
+        File = CONTAINING_RECORD(DeviceExtension->IdleFileList.Flink, FUSE_FILE, IdleEntry);
+        if (ExpirationTime < File->IdleExpirationTime)
+            break;
+        RemoveEntryList(&File->IdleEntry);
+        DeviceExtension->IdleFileCount--;
+        InsertTailList(&ExpiredList, &File->IdleEntry);
+    }
+    KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+
+    while (!IsListEmpty(&ExpiredList))
+    {
+        File = CONTAINING_RECORD(RemoveHeadList(&ExpiredList), FUSE_FILE, IdleEntry);
+        if (!NT_SUCCESS(FuseProtoPostRelease(DeviceObject, File)))
+        {
+            /* the Ioq is congested; retry on the next expiration */
+            KeAcquireSpinLock(&DeviceExtension->FileListLock, &Irql);
+            InsertHeadList(&DeviceExtension->IdleFileList, &File->IdleEntry);
+            DeviceExtension->IdleFileCount++;
+            KeReleaseSpinLock(&DeviceExtension->FileListLock, Irql);
+        }
+    }
+}
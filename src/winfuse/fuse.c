@@ -24,20 +24,88 @@
 static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PARAMS *VolumeParams);
 static VOID FuseDeviceFini(PDEVICE_OBJECT DeviceObject);
 static VOID FuseDeviceExpirationRoutine(PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime);
+static NTSTATUS FuseDeviceTimeout(PDEVICE_OBJECT DeviceObject, PIO_STACK_LOCATION IrpSp,
+    FUSE_CONTEXT *Context);
 static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+static VOID FuseDeviceNotifyChanged(PDEVICE_OBJECT DeviceObject, PIO_STACK_LOCATION IrpSp,
+    FUSE_CONTEXT *Context);
+static NTSTATUS FuseDeviceNotifyCompletion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Notify0);
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
-    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest);
+    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest, UINT32 Hint);
+static VOID FuseContextCleanup(FUSE_CONTEXT *Context, BOOLEAN Zombie);
 VOID FuseContextDelete(FUSE_CONTEXT *Context);
+PVOID FuseContextAlloc(FUSE_CONTEXT *Context, ULONG Size);
+VOID FuseContextQueryStats(PDEVICE_OBJECT DeviceObject, FUSE_STATS *Stats);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FuseDeviceInit)
 #pragma alloc_text(PAGE, FuseDeviceFini)
 #pragma alloc_text(PAGE, FuseDeviceExpirationRoutine)
+#pragma alloc_text(PAGE, FuseDeviceTimeout)
 #pragma alloc_text(PAGE, FuseDeviceTransact)
+#pragma alloc_text(PAGE, FuseDeviceNotifyChanged)
 #pragma alloc_text(PAGE, FuseContextCreate)
+#pragma alloc_text(PAGE, FuseContextCleanup)
 #pragma alloc_text(PAGE, FuseContextDelete)
+#pragma alloc_text(PAGE, FuseContextAlloc)
+#pragma alloc_text(PAGE, FuseContextQueryStats)
 #endif
 
+UINT32 FuseContextMemoryBudget = 64 * 1024;
+UINT32 FuseFsdInfoTimeout = 0;
+
+typedef struct _FUSE_DEVICE_NOTIFY
+{
+    PFILE_OBJECT FileObject;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 NotifyInfoBuf[];
+} FUSE_DEVICE_NOTIFY;
+
+typedef struct _FUSE_CONTEXT_SCRATCH_CHUNK
+{
+    struct _FUSE_CONTEXT_SCRATCH_CHUNK *Next;
+    ULONG Size, Used;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[];
+} FUSE_CONTEXT_SCRATCH_CHUNK;
+
+static inline BOOLEAN FuseContextCharge(FUSE_CONTEXT *Context, ULONG Size, BOOLEAN Background)
+    /*
+     * Charge memory against the per-volume context memory budget.
+     *
+     * Background contexts (FuseContextIsBackground: RELEASE and priming) and their buffers
+     * may only use 3/4 of the budget. This leaves room for foreground requests and
+     * makes the background producers fall back to their deferral paths first.
+     */
+{
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(Context->DeviceObject);
+    UINT64 Budget = (UINT64)FuseContextMemoryBudget * 1024;
+    LONG64 Usage, Peak;
+
+    if (Background)
+        Budget = Budget / 4 * 3;
+
+    Usage = InterlockedAdd64(&DeviceExtension->ContextMemory, Size);
+    if (0 != Budget && Budget < (UINT64)Usage)
+    {
+        InterlockedAdd64(&DeviceExtension->ContextMemory, -(LONG64)Size);
+        InterlockedIncrement64(&DeviceExtension->ContextMemoryRefused);
+        return FALSE;
+    }
+
+    while (Usage > (Peak = DeviceExtension->ContextMemoryPeak) &&
+        Peak != InterlockedCompareExchange64(&DeviceExtension->ContextMemoryPeak, Usage, Peak))
+        ;
+
+    Context->MemoryCharge += Size;
+    return TRUE;
+}
+
+static inline VOID FuseContextUncharge(FUSE_CONTEXT *Context, ULONG Size)
+{
+    ASSERT(Context->MemoryCharge >= Size);
+    Context->MemoryCharge -= Size;
+    InterlockedAdd64(&FuseDeviceExtension(Context->DeviceObject)->ContextMemory, -(LONG64)Size);
+}
+
 static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PARAMS *VolumeParams)
 {
     PAGED_CODE();
@@ -47,6 +115,8 @@ static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PAR
     FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
     FUSE_IOQ *Ioq = 0;
     FUSE_CACHE *Cache = 0;
+    FUSE_SECURITY_CACHE *SecurityCache = 0;
+    PPAGED_LOOKASIDE_LIST ScratchLookasideList = 0;
     NTSTATUS Result;
 
     /* ensure that VolumeParams can be used for FUSE operations */
@@ -58,10 +128,42 @@ static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PAR
     VolumeParams->NamedStreams = 0;
     VolumeParams->ReadOnlyVolume = 0;
     VolumeParams->PostCleanupWhenModifiedOnly = 1;
+    VolumeParams->PassQueryDirectoryPattern = 1;
     VolumeParams->PassQueryDirectoryFileName = 1;
     VolumeParams->DeviceControl = 1;
     VolumeParams->DirectoryMarkerAsNextOffset = 1;
 
+    /*
+     * If configured, let the FSD answer file, directory, volume and security queries
+     * from its own caches. These caches hold the same attributes that FUSE lets the
+     * kernel cache for attr_valid/entry_valid; changes made through the volume update
+     * or invalidate them in the FSD, changes seen in LOOKUP replies are pushed to it
+     * (see FuseDeviceNotifyChanged).
+     *
+     * Timeouts chosen by the file system are kept. FileInfoTimeout has no "valid" flag,
+     * so only a 0 (which cannot be told apart from an unset one) is replaced.
+     */
+    if (0 != FuseFsdInfoTimeout)
+    {
+        if (0 == VolumeParams->FileInfoTimeout)
+            VolumeParams->FileInfoTimeout = FuseFsdInfoTimeout;
+        if (!VolumeParams->VolumeInfoTimeoutValid)
+        {
+            VolumeParams->VolumeInfoTimeoutValid = 1;
+            VolumeParams->VolumeInfoTimeout = FuseFsdInfoTimeout;
+        }
+        if (!VolumeParams->DirInfoTimeoutValid)
+        {
+            VolumeParams->DirInfoTimeoutValid = 1;
+            VolumeParams->DirInfoTimeout = FuseFsdInfoTimeout;
+        }
+        if (!VolumeParams->SecurityTimeoutValid)
+        {
+            VolumeParams->SecurityTimeoutValid = 1;
+            VolumeParams->SecurityTimeout = FuseFsdInfoTimeout;
+        }
+    }
+
     Result = FuseIoqCreate(&Ioq);
     if (!NT_SUCCESS(Result))
         goto fail;
@@ -70,10 +172,28 @@ static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PAR
     if (!NT_SUCCESS(Result))
         goto fail;
 
+    Result = FuseSecurityCacheCreate(0, &SecurityCache);
+    if (!NT_SUCCESS(Result))
+        goto fail;
+
+    ScratchLookasideList = FuseAllocNonPaged(sizeof *ScratchLookasideList);
+        /* lookaside lists must be in non-paged memory */
+    if (0 == ScratchLookasideList)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
+    }
+    ExInitializePagedLookasideList(ScratchLookasideList, 0, 0, 0,
+        FUSE_CONTEXT_SCRATCH_CHUNK_SIZE, FUSE_ALLOC_TAG, 0);
+
     DeviceExtension->VolumeParams = VolumeParams;
     FuseRwlockInitialize(&DeviceExtension->OpGuardLock);
     DeviceExtension->Ioq = Ioq;
     DeviceExtension->Cache = Cache;
+    DeviceExtension->SecurityCache = SecurityCache;
+    DeviceExtension->ScratchLookasideList = ScratchLookasideList;
+    DeviceExtension->MountPid = (UINT32)(UINT_PTR)PsGetCurrentProcessId();
+        /* the volume is created in the context of the file system process */
     KeInitializeEvent(&DeviceExtension->InitEvent, NotificationEvent, FALSE);
 
     FuseFileDeviceInit(DeviceObject);
@@ -87,6 +207,15 @@ static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PAR
     return STATUS_SUCCESS;
 
 fail:
+    if (0 != ScratchLookasideList)
+    {
+        ExDeletePagedLookasideList(ScratchLookasideList);
+        FuseFree(ScratchLookasideList);
+    }
+
+    if (0 != SecurityCache)
+        FuseSecurityCacheDelete(SecurityCache);
+
     if (0 != Cache)
         FuseCacheDelete(Cache);
 
@@ -117,6 +246,9 @@ static VOID FuseDeviceFini(PDEVICE_OBJECT DeviceObject)
      *
      * FuseFileDeviceFini must precede FuseCacheDelete, because some Files may hold
      * CacheItem references.
+     *
+     * FuseIoqDelete must precede ExDeletePagedLookasideList, because the Ioq may contain
+     * Contexts that hold scratch chunks.
      */
 
     FuseIoqDelete(DeviceExtension->Ioq);
@@ -125,6 +257,11 @@ static VOID FuseDeviceFini(PDEVICE_OBJECT DeviceObject)
 
     FuseCacheDelete(DeviceExtension->Cache);
 
+    FuseSecurityCacheDelete(DeviceExtension->SecurityCache);
+
+    ExDeletePagedLookasideList(DeviceExtension->ScratchLookasideList);
+    FuseFree(DeviceExtension->ScratchLookasideList);
+
     FuseRwlockFinalize(&DeviceExtension->OpGuardLock);
 
     KeLeaveCriticalRegion();
@@ -139,10 +276,49 @@ static VOID FuseDeviceExpirationRoutine(PDEVICE_OBJECT DeviceObject, UINT64 Expi
     FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
 
     FuseCacheExpirationRoutine(DeviceExtension->Cache, DeviceObject, ExpirationTime);
+    FuseFileExpirationRoutine(DeviceObject, ExpirationTime);
+    FuseIoqExpirationRoutine(DeviceExtension->Ioq, ExpirationTime);
 
     KeLeaveCriticalRegion();
 }
 
+static NTSTATUS FuseDeviceTimeout(PDEVICE_OBJECT DeviceObject, PIO_STACK_LOCATION IrpSp,
+    FUSE_CONTEXT *Context)
+    /*
+     * Fail a context whose request has passed its deadline and send INTERRUPT for it.
+     *
+     * The context gives up what it holds (background credit, resources released by its
+     * Fini) except for its op guard and is kept as a zombie until the late reply arrives.
+     * RELEASE has no deadline; should a background RELEASE context fail nonetheless,
+     * the files it has not sent yet are released by a new context.
+     */
+{
+    PAGED_CODE();
+
+    UINT64 Unique = (UINT64)(UINT_PTR)Context;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    if (0 != Context->InternalRequest)
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_IO_TIMEOUT;
+        Context->InternalResponse->IoStatus.Information = 0;
+        Result = FspFsextProviderTransact(
+            IrpSp->DeviceObject, IrpSp->FileObject, Context->InternalResponse, 0);
+    }
+
+    if (0 == Context->InternalRequest &&
+        FUSE_PROTO_OPCODE_RELEASE == Context->InternalResponse->Hint)
+        FuseProtoRepostRelease(DeviceObject, Context);
+
+    FuseContextCleanup(Context, TRUE);
+    FuseIoqPostZombie(FuseDeviceExtension(DeviceObject)->Ioq, Context);
+
+    /* best effort; the zombie keeps Unique valid until the reply arrives */
+    FuseProtoPostInterrupt(DeviceObject, Unique);
+
+    return Result;
+}
+
 static inline BOOLEAN FuseContextProcess(FUSE_CONTEXT *Context,
     FUSE_PROTO_RSP *FuseResponse, FUSE_PROTO_REQ *FuseRequest, ULONG FuseRequestLength)
 {
@@ -217,11 +393,26 @@ static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     BOOLEAN Continue;
     NTSTATUS Result;
 
+    /* fail contexts that have passed their deadline; this needs the IrpSp->FileObject */
+    while (0 != (Context = FuseIoqNextTimedOut(DeviceExtension->Ioq)))
+    {
+        Result = FuseDeviceTimeout(DeviceObject, IrpSp, Context);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
     if (0 != FuseResponse)
     {
         Context = FuseIoqEndProcessing(DeviceExtension->Ioq, FuseResponse->unique);
         if (0 == Context)
             goto request;
+        if (Context->Zombie)
+        {
+            /* late reply for a request that has already been failed; this drops its op guard */
+            FuseProtoUndoLateReply(Context, FuseResponse);
+            FuseContextDelete(Context);
+            goto request;
+        }
 
         Continue = FuseContextProcess(Context, FuseResponse, 0, 0);
 
@@ -235,6 +426,8 @@ static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
             Result = FspFsextProviderTransact(
                 IrpSp->DeviceObject, IrpSp->FileObject, Context->InternalResponse, 0);
+            if (NT_SUCCESS(Result))
+                FuseDeviceNotifyChanged(DeviceObject, IrpSp, Context);
             FuseContextDelete(Context);
             if (!NT_SUCCESS(Result))
                 goto exit;
@@ -283,7 +476,7 @@ request:
 
             ASSERT(FspFsctlTransactReservedKind != InternalRequest->Kind);
 
-            FuseContextCreate(&Context, DeviceObject, InternalRequest);
+            FuseContextCreate(&Context, DeviceObject, InternalRequest, 0);
             ASSERT(0 != Context);
 
             Continue = FALSE;
@@ -328,12 +521,17 @@ request:
                 else
                     FuseContextDelete(Context);
                 break;
+            default:
+                FuseContextDelete(Context);
+                break;
             }
         }
         else
         {
             Result = FspFsextProviderTransact(
                 IrpSp->DeviceObject, IrpSp->FileObject, Context->InternalResponse, 0);
+            if (NT_SUCCESS(Result))
+                FuseDeviceNotifyChanged(DeviceObject, IrpSp, Context);
             FuseContextDelete(Context);
             if (!NT_SUCCESS(Result))
                 goto exit;
@@ -351,6 +549,85 @@ exit:
     return Result;
 }
 
+static VOID FuseDeviceNotifyChanged(PDEVICE_OBJECT DeviceObject, PIO_STACK_LOCATION IrpSp,
+    FUSE_CONTEXT *Context)
+    /*
+     * Push a change that a LOOKUP found for the file a Create opened to the FSD, so that
+     * it drops the file and directory information it caches (see FuseDeviceInit). This is
+     * the FSCTL that user mode file systems use (FspFsctlNotify) sent to the volume; it is
+     * not waited for, because the FSD may need this thread to answer requests first.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    FSP_FSCTL_TRANSACT_REQ *InternalRequest = Context->InternalRequest;
+    FUSE_DEVICE_NOTIFY *Notify;
+    FSP_FSCTL_NOTIFY_INFO *NotifyInfo;
+    ULONG FileNameLength, NotifyInfoSize;
+    PDEVICE_OBJECT FsctlDeviceObject;
+    PIO_STACK_LOCATION NextIrpSp;
+    PIRP Irp;
+
+    if (FspFsctlTransactCreateKind != InternalRequest->Kind ||
+        STATUS_SUCCESS != Context->InternalResponse->IoStatus.Status ||
+        FILE_OPENED != Context->InternalResponse->IoStatus.Information ||
+        !Context->LookupPath.AttrChanged ||
+        (0 == DeviceExtension->VolumeParams->FileInfoTimeout &&
+            0 == DeviceExtension->VolumeParams->DirInfoTimeout))
+        return;
+
+    FileNameLength = InternalRequest->FileName.Size - sizeof(WCHAR);
+    NotifyInfoSize = FIELD_OFFSET(FSP_FSCTL_NOTIFY_INFO, FileNameBuf) + FileNameLength;
+
+    /* best effort: the FSD caches time out on their own */
+    Notify = FuseAllocNonPaged(sizeof *Notify + NotifyInfoSize);
+    if (0 == Notify)
+        return;
+    FsctlDeviceObject = IrpSp->DeviceObject;
+    Irp = IoAllocateIrp(FsctlDeviceObject->StackSize, FALSE);
+    if (0 == Irp)
+    {
+        FuseFree(Notify);
+        return;
+    }
+
+    NotifyInfo = (PVOID)Notify->NotifyInfoBuf;
+    NotifyInfo->Size = (UINT16)NotifyInfoSize;
+    NotifyInfo->Filter = FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+    NotifyInfo->Action = FILE_ACTION_MODIFIED;
+    RtlCopyMemory(NotifyInfo->FileNameBuf,
+        InternalRequest->Buffer + InternalRequest->FileName.Offset, FileNameLength);
+
+    Notify->FileObject = IrpSp->FileObject;
+    ObReferenceObject(Notify->FileObject);
+
+    Irp->RequestorMode = KernelMode;
+    Irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    Irp->Tail.Overlay.OriginalFileObject = Notify->FileObject;
+    NextIrpSp = IoGetNextIrpStackLocation(Irp);
+    NextIrpSp->MajorFunction = IRP_MJ_FILE_SYSTEM_CONTROL;
+    NextIrpSp->MinorFunction = IRP_MN_USER_FS_REQUEST;
+    NextIrpSp->FileObject = Notify->FileObject;
+    NextIrpSp->Parameters.FileSystemControl.FsControlCode = FSP_FSCTL_NOTIFY;
+    NextIrpSp->Parameters.FileSystemControl.InputBufferLength = NotifyInfoSize;
+    NextIrpSp->Parameters.FileSystemControl.Type3InputBuffer = NotifyInfo;
+    IoSetCompletionRoutine(Irp, FuseDeviceNotifyCompletion, Notify, TRUE, TRUE, TRUE);
+
+    IoCallDriver(FsctlDeviceObject, Irp);
+}
+
+static NTSTATUS FuseDeviceNotifyCompletion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Notify0)
+{
+    FUSE_DEVICE_NOTIFY *Notify = Notify0;
+
+    ObDereferenceObject(Notify->FileObject);
+    FuseFree(Notify);
+    IoFreeIrp(Irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
 FSP_FSEXT_PROVIDER FuseProvider =
 {
     /* Version */
@@ -376,7 +653,12 @@ FSP_FSEXT_PROVIDER FuseProvider =
 };
 
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
-    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest)
+    PDEVICE_OBJECT DeviceObject, FSP_FSCTL_TRANSACT_REQ *InternalRequest, UINT32 Hint)
+    /*
+     * Hint is the hint of a reserved context (0 == InternalRequest), which identifies
+     * its work; it is set before anything is charged, so that background contexts are
+     * charged as such from the start. The hint of other contexts is that of InternalRequest.
+     */
 {
     PAGED_CODE();
 
@@ -398,34 +680,173 @@ VOID FuseContextCreate(FUSE_CONTEXT **PContext,
         return;
     }
 
-    RtlZeroMemory(Context, sizeof *Context);
+    RtlZeroMemory(Context, FIELD_OFFSET(FUSE_CONTEXT, ScratchBuf));
     Context->DeviceObject = DeviceObject;
     Context->InternalRequest = InternalRequest;
     Context->InternalResponse = (PVOID)&Context->InternalResponseBuf;
     Context->InternalResponse->Size = sizeof(FSP_FSCTL_TRANSACT_RSP);
     Context->InternalResponse->Kind = Kind;
-    Context->InternalResponse->Hint = 0 != InternalRequest ? InternalRequest->Hint : 0;
+    Context->InternalResponse->Hint = 0 != InternalRequest ? InternalRequest->Hint : Hint;
+    if (!FuseContextCharge(Context,
+        sizeof *Context + (0 != InternalRequest ? InternalRequest->Size : 0),
+        FuseContextIsBackground(Context)))
+    {
+        FuseFree(Context);
+        *PContext = FuseContextStatus(STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
     *PContext = Context;
 }
 
-VOID FuseContextDelete(FUSE_CONTEXT *Context)
+static VOID FuseContextCleanup(FUSE_CONTEXT *Context, BOOLEAN Zombie)
+    /*
+     * Release everything a context holds except for its own memory.
+     *
+     * A context that becomes a zombie keeps its op guard, as well as its internal request
+     * which the guard needs to be released; both are released when the zombie is deleted.
+     */
 {
     PAGED_CODE();
 
-    if (FuseOpGuardTrue == Context->OpGuardResult)
+    BOOLEAN KeepGuard = Zombie && FuseOpGuardTrue == Context->OpGuardResult;
+
+    if (Context->BackgroundCredit)
+        FuseIoqEndBackground(FuseDeviceExtension(Context->DeviceObject)->Ioq, Context);
+
+    if (!KeepGuard && FuseOpGuardTrue == Context->OpGuardResult)
     {
         UINT32 Kind = 0 == Context->InternalRequest ?
             FspFsctlTransactReservedKind : Context->InternalRequest->Kind;
         FuseOperations[Kind].Guard(Context, FALSE);
+        Context->OpGuardResult = FuseOpGuardFalse;
     }
 
     if (0 != Context->Fini)
         Context->Fini(Context);
-    if (0 != Context->InternalRequest)
+    Context->Fini = 0;
+    if (!KeepGuard && 0 != Context->InternalRequest)
+    {
         FuseFree(Context->InternalRequest);
-    if ((PVOID)&Context->InternalResponseBuf != Context->InternalResponse)
-        FuseFree(Context->InternalResponse);
+        Context->InternalRequest = 0;
+    }
+
+    for (FUSE_CONTEXT_SCRATCH_CHUNK *Chunk = Context->ScratchChunk, *NextChunk; Chunk; Chunk = NextChunk)
+    {
+        NextChunk = Chunk->Next;
+        if (FUSE_CONTEXT_SCRATCH_CHUNK_SIZE == FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) + Chunk->Size)
+            ExFreeToPagedLookasideList(
+                FuseDeviceExtension(Context->DeviceObject)->ScratchLookasideList, Chunk);
+        else
+            FuseFree(Chunk);
+    }
+    Context->ScratchChunk = 0;
+    Context->InternalResponse = (PVOID)&Context->InternalResponseBuf;
+
+    /* a zombie keeps only the context itself (and any internal request it keeps) charged */
+    FuseContextUncharge(Context, Context->MemoryCharge - sizeof *Context -
+        (0 != Context->InternalRequest ? Context->InternalRequest->Size : 0));
+}
+
+VOID FuseContextDelete(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FuseContextCleanup(Context, FALSE);
+    FuseContextUncharge(Context, sizeof *Context);
 
     DEBUGFILL(Context, sizeof *Context);
     FuseFree(Context);
 }
+
+PVOID FuseContextAlloc(FUSE_CONTEXT *Context, ULONG Size)
+    /*
+     * Allocate memory from the context's scratch arena.
+     *
+     * The memory remains valid until the context is deleted; it cannot be freed
+     * individually. Small allocations are satisfied from the context's inline buffer.
+     * Once that is exhausted, allocations spill into pooled chunks.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT_SCRATCH_CHUNK *Chunk;
+    PVOID Result;
+
+    Size = FSP_FSCTL_DEFAULT_ALIGN_UP(Size);
+
+    if (sizeof Context->ScratchBuf - Context->ScratchUsed >= Size)
+    {
+        Result = Context->ScratchBuf + Context->ScratchUsed;
+        Context->ScratchUsed += Size;
+        return Result;
+    }
+
+    Chunk = Context->ScratchChunk;
+    if (0 != Chunk && Chunk->Size - Chunk->Used >= Size)
+    {
+        Result = Chunk->Buffer + Chunk->Used;
+        Chunk->Used += Size;
+        return Result;
+    }
+
+    BOOLEAN Background = FuseContextIsBackground(Context);
+    if (FUSE_CONTEXT_SCRATCH_CHUNK_SIZE - FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) >= Size)
+    {
+        if (!FuseContextCharge(Context, FUSE_CONTEXT_SCRATCH_CHUNK_SIZE, Background))
+            return 0;
+        Chunk = ExAllocateFromPagedLookasideList(
+            FuseDeviceExtension(Context->DeviceObject)->ScratchLookasideList);
+        if (0 == Chunk)
+        {
+            FuseContextUncharge(Context, FUSE_CONTEXT_SCRATCH_CHUNK_SIZE);
+            return 0;
+        }
+        Chunk->Size = FUSE_CONTEXT_SCRATCH_CHUNK_SIZE - FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer);
+    }
+    else
+    {
+        if (MAXULONG - FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) < Size)
+            return 0;
+        if (!FuseContextCharge(Context, FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) + Size, Background))
+            return 0;
+        Chunk = FuseAlloc(FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) + Size);
+        if (0 == Chunk)
+        {
+            FuseContextUncharge(Context, FIELD_OFFSET(FUSE_CONTEXT_SCRATCH_CHUNK, Buffer) + Size);
+            return 0;
+        }
+        Chunk->Size = Size;
+    }
+    Chunk->Used = Size;
+
+    /*
+     * Insert the new chunk at the list head, unless the current head chunk
+     * has more space left; that one remains the chunk we allocate from.
+     */
+    if (0 == Context->ScratchChunk ||
+        Chunk->Size - Chunk->Used >= ((FUSE_CONTEXT_SCRATCH_CHUNK *)Context->ScratchChunk)->Size -
+            ((FUSE_CONTEXT_SCRATCH_CHUNK *)Context->ScratchChunk)->Used)
+    {
+        Chunk->Next = Context->ScratchChunk;
+        Context->ScratchChunk = Chunk;
+    }
+    else
+    {
+        Chunk->Next = ((FUSE_CONTEXT_SCRATCH_CHUNK *)Context->ScratchChunk)->Next;
+        ((FUSE_CONTEXT_SCRATCH_CHUNK *)Context->ScratchChunk)->Next = Chunk;
+    }
+
+    return Chunk->Buffer;
+}
+
+VOID FuseContextQueryStats(PDEVICE_OBJECT DeviceObject, FUSE_STATS *Stats)
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+
+    Stats->ContextMemory = DeviceExtension->ContextMemory;
+    Stats->ContextMemoryPeak = DeviceExtension->ContextMemoryPeak;
+    Stats->ContextMemoryBudget = (UINT64)FuseContextMemoryBudget * 1024;
+    Stats->ContextMemoryRefused = DeviceExtension->ContextMemoryRefused;
+}
@@ -24,12 +24,18 @@
 static BOOLEAN FuseOpReserved_Init(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved_Destroy(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved_Forget(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Release(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Interrupt(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Prime(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context);
 static VOID FuseLookup(FUSE_CONTEXT *Context);
-static NTSTATUS FuseAccessCheck(
-    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
-    UINT32 OrigUid, UINT32 OrigGid, UINT32 DesiredAccess,
-    PUINT32 PGrantedAccess);
+static VOID FuseRefreshAttr(FUSE_CONTEXT *Context);
+static NTSTATUS FuseAccessCheck(FUSE_CONTEXT *Context,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess);
+static NTSTATUS FuseMapWindowsToPosixPathN(FUSE_CONTEXT *Context,
+    PWSTR WindowsPath, ULONG WindowsLength, PSTR *PPosixPath, PULONG PPosixLength);
+static NTSTATUS FuseMapWindowsToPosixPath(FUSE_CONTEXT *Context,
+    PWSTR WindowsPath, PSTR *PPosixPath);
 static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context);
 static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context);
 static VOID FusePrepareLookupPath_ContextFini(FUSE_CONTEXT *Context);
@@ -41,6 +47,8 @@ static VOID FuseOpenTargetDirectoryCheck(FUSE_CONTEXT *Context);
 static VOID FuseRenameCheck(FUSE_CONTEXT *Context);
 static VOID FuseCreate(FUSE_CONTEXT *Context);
 static VOID FuseOpen(FUSE_CONTEXT *Context);
+static BOOLEAN FuseGetFileParent(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpenNoOpen(FUSE_CONTEXT *Context, UINT32 Opcode);
 static VOID FuseOpCreate_FileCreate(FUSE_CONTEXT *Context);
 static VOID FuseOpCreate_FileOpen(FUSE_CONTEXT *Context);
 static VOID FuseOpCreate_FileOpenIf(FUSE_CONTEXT *Context);
@@ -69,15 +77,22 @@ static BOOLEAN FuseOpSetEa(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpFlushBuffers(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpQueryVolumeInformation(FUSE_CONTEXT *Context);
 static BOOLEAN FuseAddDirInfo(FUSE_CONTEXT *Context,
-    PSTRING Name, UINT64 NextOffset, FUSE_PROTO_ATTR *Attr,
+    PSTRING Name, PWSTR WideName, ULONG WideNameLength,
+    UINT64 NextOffset, FUSE_PROTO_ATTR *Attr,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
+static BOOLEAN FuseOpQueryDirectory_MatchPattern(FUSE_CONTEXT *Context, PSTRING Name);
 static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context);
 static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpQueryDirectory(FUSE_CONTEXT *Context);
 static VOID FuseOpQueryDirectory_ContextFini(FUSE_CONTEXT *Context);
 static INT FuseOgQueryDirectory(FUSE_CONTEXT *Context, BOOLEAN Acquire);
 static BOOLEAN FuseOpFileSystemControl(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_QueryStats(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_ExportSnapshot(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_PrimeSnapshot(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpDeviceControl_BulkStat(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpDeviceControl(FUSE_CONTEXT *Context);
+static INT FuseOgDeviceControl(FUSE_CONTEXT *Context, BOOLEAN Acquire);
 static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpSetSecurity(FUSE_CONTEXT *Context);
 static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
@@ -86,9 +101,15 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOpReserved_Init)
 #pragma alloc_text(PAGE, FuseOpReserved_Destroy)
 #pragma alloc_text(PAGE, FuseOpReserved_Forget)
+#pragma alloc_text(PAGE, FuseOpReserved_Release)
+#pragma alloc_text(PAGE, FuseOpReserved_Prime)
+#pragma alloc_text(PAGE, FuseOpReserved_Interrupt)
 #pragma alloc_text(PAGE, FuseOpReserved)
 #pragma alloc_text(PAGE, FuseLookup)
+#pragma alloc_text(PAGE, FuseRefreshAttr)
 #pragma alloc_text(PAGE, FuseAccessCheck)
+#pragma alloc_text(PAGE, FuseMapWindowsToPosixPathN)
+#pragma alloc_text(PAGE, FuseMapWindowsToPosixPath)
 #pragma alloc_text(PAGE, FusePrepareLookupPath)
 #pragma alloc_text(PAGE, FusePrepareLookupPath2)
 #pragma alloc_text(PAGE, FusePrepareLookupPath_ContextFini)
@@ -100,6 +121,8 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseRenameCheck)
 #pragma alloc_text(PAGE, FuseCreate)
 #pragma alloc_text(PAGE, FuseOpen)
+#pragma alloc_text(PAGE, FuseGetFileParent)
+#pragma alloc_text(PAGE, FuseOpenNoOpen)
 #pragma alloc_text(PAGE, FuseOpCreate_FileCreate)
 #pragma alloc_text(PAGE, FuseOpCreate_FileOpen)
 #pragma alloc_text(PAGE, FuseOpCreate_FileOpenIf)
@@ -127,13 +150,19 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOpFlushBuffers)
 #pragma alloc_text(PAGE, FuseOpQueryVolumeInformation)
 #pragma alloc_text(PAGE, FuseAddDirInfo)
+#pragma alloc_text(PAGE, FuseOpQueryDirectory_MatchPattern)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_GetDirInfoByName)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_ReadDirectory)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_ContextFini)
 #pragma alloc_text(PAGE, FuseOgQueryDirectory)
 #pragma alloc_text(PAGE, FuseOpFileSystemControl)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_QueryStats)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_ExportSnapshot)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_PrimeSnapshot)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_BulkStat)
 #pragma alloc_text(PAGE, FuseOpDeviceControl)
+#pragma alloc_text(PAGE, FuseOgDeviceControl)
 #pragma alloc_text(PAGE, FuseOpQuerySecurity)
 #pragma alloc_text(PAGE, FuseOpSetSecurity)
 #pragma alloc_text(PAGE, FuseSecurity_ContextFini)
@@ -161,6 +190,15 @@ static BOOLEAN FuseOpReserved_Init(FUSE_CONTEXT *Context)
 
         DeviceExtension->VersionMajor = Context->FuseResponse->rsp.init.major;
         DeviceExtension->VersionMinor = Context->FuseResponse->rsp.init.minor;
+        /* file systems do not echo these flags; they know of them from minor 23 and 29 */
+        if (23 <= DeviceExtension->VersionMinor)
+            DeviceExtension->InitFlags |= FUSE_PROTO_INIT_NO_OPEN_SUPPORT;
+        if (29 <= DeviceExtension->VersionMinor)
+            DeviceExtension->InitFlags |= FUSE_PROTO_INIT_NO_OPENDIR_SUPPORT;
+        if (13 <= DeviceExtension->VersionMinor)
+            FuseIoqSetBackgroundLimits(DeviceExtension->Ioq,
+                Context->FuseResponse->rsp.init.max_background,
+                Context->FuseResponse->rsp.init.congestion_threshold);
         // !!!: REVISIT
         KeSetEvent(&DeviceExtension->InitEvent, 1, FALSE);
 
@@ -194,6 +232,71 @@ static BOOLEAN FuseOpReserved_Forget(FUSE_CONTEXT *Context)
     return FALSE;
 }
 
+static BOOLEAN FuseOpReserved_Release(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        /* the reply carries no useful information; errors are ignored */
+
+        Context->Release.Started = TRUE;
+        while (0 != Context->Release.FileList)
+        {
+            Context->File = Context->Release.FileList;
+            Context->Release.FileList = Context->File->ReleaseNext;
+            Context->File->ReleaseNext = 0;
+
+            if (Context->File->IsDirectory)
+                coro_await (FuseProtoSendReleasedir(Context));
+            else
+                coro_await (FuseProtoSendRelease(Context));
+
+            FuseFileDelete(Context->DeviceObject, Context->File);
+            Context->File = 0;
+        }
+    }
+
+    return coro_active();
+}
+
+static BOOLEAN FuseOpReserved_Interrupt(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FuseProtoFillInterrupt(Context);
+
+    return FALSE;
+}
+
+static BOOLEAN FuseOpReserved_Prime(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE *Cache = FuseDeviceExtension(Context->DeviceObject)->Cache;
+
+    coro_block (Context->CoroState)
+    {
+        /* failed LOOKUP's only mean that the entry (and its children) are skipped */
+
+        while (FuseSnapshotPrimerNext(Context->Prime.Primer,
+            &Context->Prime.Ino, &Context->Prime.Name))
+        {
+            FuseCacheReferenceGen(Cache, &Context->Prime.CacheGen);
+
+            coro_await (FuseLookup(Context));
+
+            if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                FuseSnapshotPrimerSetIno(Context->Prime.Primer, Context->Prime.Ino);
+
+            FuseCacheDereferenceGen(Cache, Context->Prime.CacheGen);
+            Context->Prime.CacheGen = 0;
+        }
+    }
+
+    return coro_active();
+}
+
 static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -207,6 +310,12 @@ static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context)
     case FUSE_PROTO_OPCODE_FORGET:
     case FUSE_PROTO_OPCODE_BATCH_FORGET:
         return FuseOpReserved_Forget(Context);
+    case FUSE_PROTO_OPCODE_RELEASE:
+        return FuseOpReserved_Release(Context);
+    case FUSE_PROTO_OPCODE_INTERRUPT:
+        return FuseOpReserved_Interrupt(Context);
+    case FUSE_CONTEXT_HINT_PRIME:
+        return FuseOpReserved_Prime(Context);
     default:
         return FALSE;
     }
@@ -218,11 +327,12 @@ static VOID FuseLookup(FUSE_CONTEXT *Context)
 
     FUSE_PROTO_ENTRY EntryBuf, *Entry = &EntryBuf;
     PVOID CacheItem;
+    BOOLEAN AttrStale;
 
     coro_block (Context->CoroState)
     {
         if (!FuseCacheGetEntry(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->Lookup.Ino, &Context->Lookup.Name, Entry, &CacheItem))
+            Context->Lookup.Ino, &Context->Lookup.Name, Entry, &CacheItem, &AttrStale))
         {
             if (FUSE_PROTO_ROOT_INO == Context->Lookup.Ino &&
                 1 == Context->Lookup.Name.Length && '/' == Context->Lookup.Name.Buffer[0])
@@ -248,14 +358,51 @@ static VOID FuseLookup(FUSE_CONTEXT *Context)
                 Entry = &Context->FuseResponse->rsp.lookup.entry;
             }
 
-            FuseCacheSetEntry(
+            Context->Lookup.AttrChanged = FuseCacheSetEntry(
                 FuseDeviceExtension(Context->DeviceObject)->Cache,
                 Context->Lookup.Ino, &Context->Lookup.Name, Entry, &CacheItem);
+            AttrStale = FALSE;
         }
+        else
+            Context->Lookup.AttrChanged = FALSE;
 
         Context->Lookup.CacheItem = CacheItem;
         Context->Lookup.Ino = Entry->nodeid;
         Context->Lookup.Attr = Entry->attr;
+        Context->Lookup.AttrStale = AttrStale;
+
+        Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+    }
+}
+
+static VOID FuseRefreshAttr(FUSE_CONTEXT *Context)
+    /*
+     * Context->Lookup.Ino, CacheItem, Attr
+     *
+     * Refresh attributes that FuseLookup found stale before they reach a FileInfo. The
+     * size of a file written through the volume is known, but not its times. Path walks
+     * and access checks use stale attributes as is; a WRITE changes neither the mode
+     * nor the owner.
+     */
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        if (Context->Lookup.AttrStale)
+        {
+            coro_await (FuseProtoSendGetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
+
+            Context->Lookup.Attr = Context->FuseResponse->rsp.getattr.attr;
+            Context->Lookup.AttrStale = FALSE;
+            FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->Lookup.CacheItem,
+                &Context->FuseResponse->rsp.getattr.attr,
+                Context->FuseResponse->rsp.getattr.attr_valid,
+                Context->FuseResponse->rsp.getattr.attr_valid_nsec);
+        }
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
     }
@@ -275,24 +422,53 @@ static inline ACCESS_MASK FusePosixMapPermissionToAccessMask(UINT32 Mode, UINT32
         ((Perm & 1) ? FILE_EXECUTE : 0);
 }
 
-static NTSTATUS FuseAccessCheck(
-    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
-    UINT32 OrigUid, UINT32 OrigGid, UINT32 DesiredAccess,
-    PUINT32 PGrantedAccess)
+static inline ACCESS_MASK FusePosixMapAttrToAccessMask(FUSE_PROTO_ATTR *Attr,
+    UINT32 OrigUid, UINT32 OrigGid)
 {
-    PAGED_CODE();
-
-    UINT32 FileAccess, RequiredAccess;
+    UINT32 FileMode = Attr->mode;
 
-    if (OrigUid == FileUid)
-        FileAccess = FusePosixOwnerDefaultPerm |
+    if (OrigUid == Attr->uid)
+        return FusePosixOwnerDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode & ~001000, (FileMode & 0700) >> 6);
-    else if (OrigGid == FileGid)
-        FileAccess = FusePosixDefaultPerm |
+    else if (OrigGid == Attr->gid)
+        return FusePosixDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode, (FileMode & 0070) >> 3);
     else
-        FileAccess = FusePosixDefaultPerm |
+        return FusePosixDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode, (FileMode & 0007));
+}
+
+static NTSTATUS FuseAccessCheck(FUSE_CONTEXT *Context,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess)
+    /*
+     * Context->Lookup.Ino, Attr
+     *
+     * The access mask of the last node checked is memoized in the context, keyed on the
+     * node and its owner and mode (the caller's credentials do not change during the
+     * lifetime of a context). A path walk checks the same node more than once, e.g. the
+     * parent directory for traversal and then for adding or deleting a child; the memo
+     * is private to the context and needs no lock.
+     */
+{
+    PAGED_CODE();
+
+    UINT32 FileAccess, RequiredAccess;
+
+    if (Context->AccessMemo.Ino == Context->Lookup.Ino &&
+        Context->AccessMemo.Uid == Context->Lookup.Attr.uid &&
+        Context->AccessMemo.Gid == Context->Lookup.Attr.gid &&
+        Context->AccessMemo.Mode == Context->Lookup.Attr.mode)
+        FileAccess = Context->AccessMemo.FileAccess;
+    else
+    {
+        FileAccess = FusePosixMapAttrToAccessMask(&Context->Lookup.Attr,
+            Context->OrigUid, Context->OrigGid);
+        Context->AccessMemo.Ino = Context->Lookup.Ino;
+        Context->AccessMemo.Uid = Context->Lookup.Attr.uid;
+        Context->AccessMemo.Gid = Context->Lookup.Attr.gid;
+        Context->AccessMemo.Mode = Context->Lookup.Attr.mode;
+        Context->AccessMemo.FileAccess = FileAccess;
+    }
 
     RequiredAccess = DesiredAccess & (STANDARD_RIGHTS_ALL | SPECIFIC_RIGHTS_ALL);
 
@@ -310,6 +486,66 @@ static NTSTATUS FuseAccessCheck(
     }
 }
 
+static NTSTATUS FuseMapWindowsToPosixPathN(FUSE_CONTEXT *Context,
+    PWSTR WindowsPath, ULONG WindowsLength, PSTR *PPosixPath, PULONG PPosixLength)
+    /*
+     * Map WindowsLength characters of a Windows path to a POSIX path allocated from
+     * the context scratch arena. The POSIX path is always NUL terminated; embedded
+     * NUL's are preserved.
+     *
+     * Backslashes are translated to slashes and characters in the U+F000 private use
+     * range that encode ASCII characters invalid on Windows are translated back (see
+     * FusePosixPathEncode).
+     */
+{
+    PAGED_CODE();
+
+    ULONG PosixLength;
+    PSTR PosixPath;
+    NTSTATUS Result;
+
+    *PPosixPath = 0;
+    if (0 != PPosixLength)
+        *PPosixLength = 0;
+
+    if (MAXULONG / 3 - 1 < WindowsLength)
+        return STATUS_OBJECT_NAME_INVALID;
+
+    /* a UTF-16 code unit requires at most 3 UTF-8 bytes (surrogate pairs 4 for 2 units) */
+    PosixPath = FuseContextAlloc(Context, WindowsLength * 3 + 1);
+    if (0 == PosixPath)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Result = RtlUnicodeToUTF8N(PosixPath, WindowsLength * 3, &PosixLength,
+        WindowsPath, WindowsLength * sizeof(WCHAR));
+    if (STATUS_SOME_NOT_MAPPED == Result)
+        Result = STATUS_SUCCESS;
+            /* invalid UTF-16 is mapped to U+FFFD */
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    FusePosixPathEncode(PosixPath, &PosixLength);
+    PosixPath[PosixLength] = '\0';
+
+    *PPosixPath = PosixPath;
+    if (0 != PPosixLength)
+        *PPosixLength = PosixLength;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS FuseMapWindowsToPosixPath(FUSE_CONTEXT *Context,
+    PWSTR WindowsPath, PSTR *PPosixPath)
+    /*
+     * Map a Windows path to a POSIX path allocated from the context scratch arena.
+     */
+{
+    PAGED_CODE();
+
+    return FuseMapWindowsToPosixPathN(Context,
+        WindowsPath, (ULONG)wcslen(WindowsPath), PPosixPath, 0);
+}
+
 static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -322,6 +558,7 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
     PACCESS_TOKEN AccessTokenObject = 0;
     UINT32 IsUserMode = 1;
     UINT32 HasTraversePrivilege = 0;
+    UINT32 IsPrivileged = 0;
 
     switch (Context->InternalRequest->Kind)
     {
@@ -359,8 +596,8 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
 
-        Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-            FileName, &PosixPath, TRUE);
+        Context->InternalResponse->IoStatus.Status = FuseMapWindowsToPosixPath(Context,
+            FileName, &PosixPath);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
     }
@@ -377,19 +614,16 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
 
-        Context->InternalResponse->IoStatus.Status = FuseGetTokenUid(
-            AccessTokenObject, TokenUser, &Uid);
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            goto exit;
+        Pid = FSP_FSCTL_TRANSACT_REQ_TOKEN_PID(AccessToken);
+        IsPrivileged = SeTokenIsAdmin(AccessTokenObject) ||
+            FuseDeviceExtension(Context->DeviceObject)->MountPid == Pid;
 
-        Context->InternalResponse->IoStatus.Status = FuseGetTokenUid(
-            AccessTokenObject, TokenPrimaryGroup, &Gid);
+        Context->InternalResponse->IoStatus.Status = FuseSecurityCacheGetTokenCredentials(
+            FuseDeviceExtension(Context->DeviceObject)->SecurityCache,
+            AccessTokenObject, &Uid, &Gid);
+        ObDereferenceObject(AccessTokenObject);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
-
-        ObDereferenceObject(AccessTokenObject);
-
-        Pid = FSP_FSCTL_TRANSACT_REQ_TOKEN_PID(AccessToken);
     }
 
     Context->OrigUid = Uid;
@@ -401,6 +635,7 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
     Context->LookupPath.CacheGen = CacheGen;
     Context->LookupPath.UserMode = IsUserMode;
     Context->LookupPath.HasTraversePrivilege = HasTraversePrivilege;
+    Context->LookupPath.Privileged = IsPrivileged;
 
     Context->Fini = FusePrepareLookupPath_ContextFini;
 
@@ -409,8 +644,6 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
 exit:
     if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
     {
-        FspPosixDeletePath(PosixPath);
-            /* handles NULL paths */
         FuseCacheDereferenceGen(FuseDeviceExtension(Context->DeviceObject)->Cache, CacheGen);
             /* handles NULL gens */
     }
@@ -433,15 +666,15 @@ static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context)
     default:
         ASSERT(FALSE);
         Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
-        goto exit;
+        return;
     }
 
     if (0 != FileName)
     {
-        Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-            FileName, &PosixPath, TRUE);
+        Context->InternalResponse->IoStatus.Status = FuseMapWindowsToPosixPath(Context,
+            FileName, &PosixPath);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            goto exit;
+            return;
     }
 
     ASSERT(0 == Context->LookupPath.OrigPath.Buffer);
@@ -449,13 +682,6 @@ static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context)
     RtlInitString(&Context->LookupPath.OrigPath, PosixPath);
 
     Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
-
-exit:
-    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-    {
-        FspPosixDeletePath(PosixPath);
-            /* handles NULL paths */
-    }
 }
 
 static VOID FusePrepareLookupPath_ContextFini(FUSE_CONTEXT *Context)
@@ -466,10 +692,7 @@ static VOID FusePrepareLookupPath_ContextFini(FUSE_CONTEXT *Context)
         0 != Context->File)
         FuseFileDelete(Context->DeviceObject, Context->File);
 
-    FspPosixDeletePath(Context->LookupPath.OrigPath2.Buffer);
-        /* handles NULL paths */
-    FspPosixDeletePath(Context->LookupPath.OrigPath.Buffer);
-        /* handles NULL paths */
+    /* OrigPath and OrigPath2 are allocated from the context scratch arena */
     FuseCacheDereferenceGen(FuseDeviceExtension(Context->DeviceObject)->Cache, Context->LookupPath.CacheGen);
         /* handles NULL gens */
 }
@@ -486,6 +709,9 @@ static VOID FuseLookupPath(FUSE_CONTEXT *Context)
     coro_block (Context->CoroState)
     {
         Context->LookupPath.Ino = FUSE_PROTO_ROOT_INO;
+        Context->LookupPath.CacheItem = 0;
+        Context->LookupPath.ParentValid = 0;
+        Context->LookupPath.AttrStale = FALSE;
         DEBUGFILL(&Context->Lookup.Attr, sizeof Context->Lookup.Attr);
         while (1) /* for (;;) produces "warning C4702: unreachable code" */
         {
@@ -513,33 +739,38 @@ static VOID FuseLookupPath(FUSE_CONTEXT *Context)
              */
             if (!RootName || LastName || (UserMode && !TravPriv))
             {
+                Context->LookupPath.ParentCacheItem = Context->LookupPath.CacheItem;
                 coro_await (FuseLookup(Context));
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                {
+                    /*
+                     * If only the last name is missing, Ino/Attr/CacheItem still describe
+                     * its (looked up and traverse checked) parent. Let CreateCheck use it.
+                     */
+                    Context->LookupPath.ParentValid = Context->LookupPath.ParentValid && LastName &&
+                        STATUS_OBJECT_NAME_NOT_FOUND == Context->InternalResponse->IoStatus.Status;
                     coro_break;
+                }
 
                 if (UserMode)
                 {
                     if (!LastName && !TravPriv)
                     {
-                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(
-                            Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
-                            Context->LookupPath.Attr.mode,
-                            Context->OrigUid, Context->OrigGid,
+                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(Context,
                             FILE_TRAVERSE, 0);
                         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                             coro_break;
                     }
                     else if (LastName)
                     {
-                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(
-                            Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
-                            Context->LookupPath.Attr.mode,
-                            Context->OrigUid, Context->OrigGid,
+                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(Context,
                             Context->LookupPath.DesiredAccess, &Context->LookupPath.GrantedAccess);
                         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                             coro_break;
                     }
                 }
+
+                Context->LookupPath.ParentValid = 1;
             }
 
             if (LastName)
@@ -569,6 +800,9 @@ static VOID FuseCreateCheck(FUSE_CONTEXT *Context)
      *
      * If the access check succeeds and MAXIMUM_ALLOWED has been requested
      * then we go ahead and grant all access to the creator.
+     *
+     * If a preceding OpenCheck found only the last name missing, it has already
+     * walked to the parent directory; in this case we only redo its access check.
      */
 
     coro_block (Context->CoroState)
@@ -587,8 +821,19 @@ static VOID FuseCreateCheck(FUSE_CONTEXT *Context)
         else
             Context->LookupPath.DesiredAccess = FILE_ADD_FILE;
 
-        FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
-        coro_await (FuseLookupPath(Context));
+        if (Context->LookupPath.ParentValid)
+        {
+            Context->LookupPath.ParentValid = 0;
+            Context->InternalResponse->IoStatus.Status = Context->LookupPath.UserMode ?
+                FuseAccessCheck(Context,
+                    Context->LookupPath.DesiredAccess, &Context->LookupPath.GrantedAccess) :
+                STATUS_SUCCESS;
+        }
+        else
+        {
+            FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
+            coro_await (FuseLookupPath(Context));
+        }
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
@@ -732,6 +977,7 @@ static VOID FuseRenameCheck(FUSE_CONTEXT *Context)
             coro_break;
 
         Context->LookupPath.Ino2 = Context->LookupPath.Ino;
+        Context->LookupPath.CacheItem2 = Context->LookupPath.CacheItem;
 
         FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
         coro_await (FuseLookup(Context));
@@ -739,10 +985,7 @@ static VOID FuseRenameCheck(FUSE_CONTEXT *Context)
         {
             if (0 != Context->InternalRequest->Req.SetInformation.Info.Rename.AccessToken)
             {
-                Context->InternalResponse->IoStatus.Status = FuseAccessCheck(
-                    Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
-                    Context->LookupPath.Attr.mode,
-                    Context->OrigUid, Context->OrigGid,
+                Context->InternalResponse->IoStatus.Status = FuseAccessCheck(Context,
                     DELETE, &Context->LookupPath.GrantedAccess);
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                     coro_break;
@@ -772,8 +1015,15 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
+        Context->File->OrigUid = Context->OrigUid;
+        Context->File->OrigGid = Context->OrigGid;
+        Context->File->Privileged = Context->LookupPath.Privileged;
+
         Context->File->OpenFlags = 0x0100 | 0x0400 | 2 /*O_CREAT|O_EXCL|O_RDWR*/;
 
+        /* LookupPath.Ino and CacheItem are still the parent directory */
+        FuseFileSetParent(Context->DeviceObject, Context->File, Context->LookupPath.CacheItem);
+
         Context->LookupPath.Attr.rdev = 0;
         Context->LookupPath.Attr.mode = 0777;
         if (0 != Context->InternalRequest->Req.Create.SecurityDescriptor.Offset)
@@ -799,6 +1049,10 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
 
+            /* LookupPath.CacheItem is still the parent directory item */
+            FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->LookupPath.CacheItem, +1);
+
             FuseCacheSetEntry(
                 FuseDeviceExtension(Context->DeviceObject)->Cache,
                 Context->LookupPath.Ino, &Context->LookupPath.Name,
@@ -809,14 +1063,17 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
             Context->LookupPath.Attr = Context->FuseResponse->rsp.mkdir.entry.attr;
 
             coro_await (FuseProtoSendOpendir(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                !FuseOpenNoOpen(Context, FUSE_PROTO_OPCODE_OPENDIR))
                 coro_break;
 
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
-
+            if (!Context->File->NoOpen)
+            {
+                Context->LookupPath.DisableCache =
+                    BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+                Context->File->Fh = Context->FuseResponse->rsp.open.fh;
+            }
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
             Context->File->IsDirectory = TRUE;
             Context->File->CacheItem = Context->LookupPath.CacheItem;
             FuseCacheReferenceItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
@@ -827,6 +1084,9 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
             coro_await (FuseProtoSendCreate(Context));
             if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             {
+                FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->LookupPath.CacheItem, +1);
+
                 FuseCacheSetEntry(
                     FuseDeviceExtension(Context->DeviceObject)->Cache,
                     Context->LookupPath.Ino, &Context->LookupPath.Name,
@@ -853,6 +1113,9 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                     coro_break;
 
+                FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->LookupPath.CacheItem, +1);
+
                 FuseCacheSetEntry(
                     FuseDeviceExtension(Context->DeviceObject)->Cache,
                     Context->LookupPath.Ino, &Context->LookupPath.Name,
@@ -863,14 +1126,17 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
                 Context->LookupPath.Attr = Context->FuseResponse->rsp.mknod.entry.attr;
 
                 coro_await (FuseProtoSendOpen(Context));
-                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                    !FuseOpenNoOpen(Context, FUSE_PROTO_OPCODE_OPEN))
                     coro_break;
 
-                Context->LookupPath.DisableCache =
-                    BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
-
+                if (!Context->File->NoOpen)
+                {
+                    Context->LookupPath.DisableCache =
+                        BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+                    Context->File->Fh = Context->FuseResponse->rsp.open.fh;
+                }
                 Context->File->Ino = Context->LookupPath.Ino;
-                Context->File->Fh = Context->FuseResponse->rsp.open.fh;
                 Context->File->CacheItem = Context->LookupPath.CacheItem;
                 FuseCacheReferenceItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
                     Context->File->CacheItem);
@@ -917,7 +1183,9 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
         coro_break;
 
     cleanup:
-        if (Context->File->IsDirectory)
+        if (Context->File->NoOpen)
+            /* not opened; nothing to release */;
+        else if (Context->File->IsDirectory)
             coro_await (FuseProtoSendReleasedir(Context));
         else
             coro_await (FuseProtoSendRelease(Context));
@@ -928,12 +1196,24 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    FUSE_FILE *IdleFile;
+
     coro_block (Context->CoroState)
     {
+        coro_await (FuseRefreshAttr(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         Context->InternalResponse->IoStatus.Status = FuseFileCreate(Context->DeviceObject, &Context->File);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
+        Context->File->OrigUid = Context->OrigUid;
+        Context->File->OrigGid = Context->OrigGid;
+        Context->File->Privileged = Context->LookupPath.Privileged;
+
+        FuseFileSetParent(Context->DeviceObject, Context->File, Context->LookupPath.ParentCacheItem);
+
         UINT32 GrantedAccess = Context->InternalResponse->Rsp.Create.Opened.GrantedAccess;
         switch (GrantedAccess & (FILE_READ_DATA | FILE_WRITE_DATA))
         {
@@ -965,14 +1245,17 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
         if (0040000/* S_IFDIR  */ == Type)
         {
             coro_await (FuseProtoSendOpendir(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                !FuseOpenNoOpen(Context, FUSE_PROTO_OPCODE_OPENDIR))
                 coro_break;
 
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
-
+            if (!Context->File->NoOpen)
+            {
+                Context->LookupPath.DisableCache =
+                    BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+                Context->File->Fh = Context->FuseResponse->rsp.open.fh;
+            }
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
             Context->File->IsDirectory = TRUE;
         }
         else
@@ -991,15 +1274,35 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
                 Context->File->OpenFlags |= 8/*O_APPEND*/;
             }
 
-            coro_await (FuseProtoSendOpen(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
-
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+            IdleFile = FuseFileIdleRemove(Context->DeviceObject,
+                Context->LookupPath.CacheItem, Context->File->OpenFlags,
+                Context->File->OrigUid, Context->File->OrigGid);
+            if (0 != IdleFile)
+            {
+                /* reuse the handle of a recently closed file (see FuseFileIdleExchange) */
+                Context->File->Fh = IdleFile->Fh;
+                Context->File->Reusable = TRUE;
+                FuseFileDelete(Context->DeviceObject, IdleFile);
+            }
+            else
+            {
+                coro_await (FuseProtoSendOpen(Context));
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                    !FuseOpenNoOpen(Context, FUSE_PROTO_OPCODE_OPEN))
+                    coro_break;
 
+                if (!Context->File->NoOpen)
+                {
+                    Context->LookupPath.DisableCache =
+                        BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+                    Context->File->Fh = Context->FuseResponse->rsp.open.fh;
+                    Context->File->Reusable =
+                        0/*O_RDONLY*/ == Context->File->OpenFlags &&
+                        FUSE_PROTO_OPEN_KEEP_CACHE == (Context->FuseResponse->rsp.open.open_flags &
+                            (FUSE_PROTO_OPEN_KEEP_CACHE | FUSE_PROTO_OPEN_DIRECT_IO));
+                }
+            }
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
         }
 
         Context->File->CacheItem = Context->LookupPath.CacheItem;
@@ -1021,6 +1324,58 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
     }
 }
 
+static BOOLEAN FuseGetFileParent(FUSE_CONTEXT *Context)
+    /*
+     * Context->File
+     *
+     * Set Context->Lookup.Ino, CacheItem and Name to the parent directory and name of
+     * the file, if they are still valid (see FuseFileGetParent). The name is copied to
+     * the context scratch arena; a name of up to 255 UTF-16 chars needs at most 3 bytes
+     * per char in UTF-8.
+     */
+{
+    PAGED_CODE();
+
+    Context->Lookup.Name.Length = 0;
+    Context->Lookup.Name.MaximumLength = 255 * 3;
+    Context->Lookup.Name.Buffer = FuseContextAlloc(Context, Context->Lookup.Name.MaximumLength);
+    if (0 == Context->Lookup.Name.Buffer ||
+        !FuseFileGetParent(Context->DeviceObject, Context->File,
+            &Context->Lookup.Ino, &Context->Lookup.Name))
+    {
+        RtlZeroMemory(&Context->Lookup.Name, sizeof Context->Lookup.Name);
+        return FALSE;
+    }
+
+    Context->Lookup.CacheItem = Context->File->ParentCacheItem;
+
+    return TRUE;
+}
+
+static BOOLEAN FuseOpenNoOpen(FUSE_CONTEXT *Context, UINT32 Opcode)
+    /*
+     * Determine whether a failed OPEN/OPENDIR means that the file system does not
+     * support the opcode (ENOSYS). In this case open the file without a handle (fh 0)
+     * and never RELEASE it; this is the FUSE "no open" convention for file systems
+     * that keep no per-open state. It only applies if it was negotiated in INIT
+     * (FUSE_PROTO_INIT_NO_OPEN_SUPPORT/NO_OPENDIR_SUPPORT).
+     */
+{
+    PAGED_CODE();
+
+    UINT32 InitFlag = FUSE_PROTO_OPCODE_OPENDIR == Opcode ?
+        FUSE_PROTO_INIT_NO_OPENDIR_SUPPORT : FUSE_PROTO_INIT_NO_OPEN_SUPPORT;
+
+    if (STATUS_INVALID_DEVICE_REQUEST != Context->InternalResponse->IoStatus.Status ||
+        !FlagOn(FuseDeviceExtension(Context->DeviceObject)->InitFlags, InitFlag) ||
+        !FuseOpcodeENOSYS(Context->DeviceObject, Opcode))
+        return FALSE;
+
+    Context->File->NoOpen = TRUE;
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+    return TRUE;
+}
+
 static VOID FuseOpCreate_FileCreate(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -1241,14 +1596,13 @@ static BOOLEAN FuseOpOverwrite(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
-
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem,
+            &Context->FuseResponse->rsp.setattr.attr,
+            Context->FuseResponse->rsp.setattr.attr_valid,
+            Context->FuseResponse->rsp.setattr.attr_valid_nsec);
 
-        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.getattr.attr,
+        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.setattr.attr,
             &Context->InternalResponse->Rsp.Overwrite.FileInfo);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1269,24 +1623,36 @@ static BOOLEAN FuseOpCleanup(FUSE_CONTEXT *Context)
 
             Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Cleanup.UserContext2;
 
-            FusePrepareLookupPath(Context);
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
+            if (!FuseGetFileParent(Context))
+            {
+                FusePrepareLookupPath(Context);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
 
-            FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
-            coro_await (FuseLookupPath(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
+                FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
+                coro_await (FuseLookupPath(Context));
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
+            }
 
-            FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
             if (Context->File->IsDirectory)
                 coro_await (FuseProtoSendRmdir(Context));
             else
                 coro_await (FuseProtoSendUnlink(Context));
 
-            FuseCacheRemoveEntry(
-                FuseDeviceExtension(Context->DeviceObject)->Cache,
-                Context->Lookup.Ino, &Context->Lookup.Name);
+            /* Lookup.CacheItem is the parent directory item */
+            if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->Lookup.CacheItem, -1);
+
+            /* release the handles kept for the entry and do not keep this one on CLOSE */
+            Context->File->Reusable = FALSE;
+            FuseFileIdleRelease(Context->DeviceObject,
+                FuseCacheRemoveEntry(
+                    FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->Lookup.Ino, &Context->Lookup.Name));
 
             Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
         }
@@ -1326,8 +1692,13 @@ static BOOLEAN FuseOpClose(FUSE_CONTEXT *Context)
         Context->Fini = FuseOpClose_ContextFini;
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Close.UserContext2;
 
-        if (Context->File->IsReparsePoint)
-            /* reparse points are not opened; ignore */;
+        if (Context->File->IsReparsePoint || Context->File->NoOpen)
+            /* reparse points and files opened without OPEN are not released; ignore */;
+        else if (0 == (Context->File = FuseFileIdleExchange(Context->DeviceObject, Context->File)))
+            /* the file is kept open for reuse and nothing was evicted */;
+        else if (NT_SUCCESS(FuseProtoPostRelease(Context->DeviceObject, Context->File)))
+            /* the background RELEASE now owns the file; complete the CLOSE immediately */
+            Context->File = 0;
         else if (Context->File->IsDirectory)
             coro_await (FuseProtoSendReleasedir(Context));
         else
@@ -1460,15 +1831,27 @@ static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
                 (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Write.Address + Context->Write.Offset,
                 Context->Write.Length);
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            {
+                if (0 != Context->Write.Offset)
+                    FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                        Context->File->CacheItem);
                 coro_break;
+            }
 
             coro_await (FuseProtoSendWrite(Context));
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            {
+                /* the file may have been partially written; its attributes are unknown */
+                FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->File->CacheItem);
                 coro_break;
+            }
 
             UINT32 BytesTransferred = Context->FuseResponse->rsp.write.size;
             if (Context->Write.Length < BytesTransferred)
             {
+                FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                    Context->File->CacheItem);
                 Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
                 coro_break;
             }
@@ -1482,9 +1865,12 @@ static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
 
         if (Context->Write.Attr.size < Context->Write.StartOffset + Context->Write.Offset)
             Context->Write.Attr.size = Context->Write.StartOffset + Context->Write.Offset;
+        if (Context->Write.Attr.blocks < (Context->Write.Attr.size + 511) / 512)
+            Context->Write.Attr.blocks = (Context->Write.Attr.size + 511) / 512;
 
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        if (0 != Context->Write.Offset)
+            FuseCacheSetItemSize(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->File->CacheItem, Context->Write.Attr.size);
 
         FuseAttrToFileInfo(Context->DeviceObject, &Context->Write.Attr,
             &Context->InternalResponse->Rsp.Write.FileInfo);
@@ -1543,15 +1929,21 @@ static BOOLEAN FuseOpSetInformation_SetBasicInfo(FUSE_CONTEXT *Context)
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
         }
+        else
+        {
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
+        }
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
-
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        /* SETATTR and GETATTR replies have the same layout */
+        FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem,
+            &Context->FuseResponse->rsp.setattr.attr,
+            Context->FuseResponse->rsp.setattr.attr_valid,
+            Context->FuseResponse->rsp.setattr.attr_valid_nsec);
 
-        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.getattr.attr,
+        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.setattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1580,16 +1972,16 @@ static BOOLEAN FuseOpSetInformation_SetAllocationSize(FUSE_CONTEXT *Context)
             coro_await (FuseProtoSendFtruncate(Context));
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
-
-            coro_await (FuseProtoSendFgetattr(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
         }
 
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        /* SETATTR and GETATTR replies have the same layout */
+        FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem,
+            &Context->FuseResponse->rsp.setattr.attr,
+            Context->FuseResponse->rsp.setattr.attr_valid,
+            Context->FuseResponse->rsp.setattr.attr_valid_nsec);
 
-        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.getattr.attr,
+        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.setattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1612,14 +2004,13 @@ static BOOLEAN FuseOpSetInformation_SetFileSize(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
-
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem,
+            &Context->FuseResponse->rsp.setattr.attr,
+            Context->FuseResponse->rsp.setattr.attr_valid,
+            Context->FuseResponse->rsp.setattr.attr_valid_nsec);
 
-        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.getattr.attr,
+        FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.setattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1639,6 +2030,21 @@ static BOOLEAN FuseOpSetInformation_SetDelete(FUSE_CONTEXT *Context)
         if (Context->InternalRequest->Req.SetInformation.Info.Disposition.Delete &&
             Context->File->IsDirectory && !Context->File->IsReparsePoint)
         {
+            /*
+             * If a recent enumeration has counted the directory children, avoid the READDIR.
+             * The count is trusted only while the cache item is fresh. A child added by another
+             * client since then is still caught: the RMDIR sent during CLEANUP fails with
+             * ENOTEMPTY and the directory is not deleted.
+             */
+            ULONG ChildCount;
+            if (FuseCacheGetItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->File->CacheItem, &ChildCount))
+            {
+                Context->InternalResponse->IoStatus.Status = 0 == ChildCount ?
+                    STATUS_SUCCESS : (UINT32)STATUS_DIRECTORY_NOT_EMPTY;
+                coro_break;
+            }
+
             Context->QueryDirectory.NextOffset = 0;
             Context->QueryDirectory.Length =
                 FSP_FSCTL_ALIGN_UP(sizeof(FUSE_PROTO_DIRENT) + 1, 8) +
@@ -1710,16 +2116,20 @@ static BOOLEAN FuseOpSetInformation_Rename(FUSE_CONTEXT *Context)
         else
             coro_break;
 
-        FusePrepareLookupPath2(Context);
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+        /* FuseGetFileParent sets LookupPath.Ino/CacheItem/Name (through Lookup) */
+        if (!FuseGetFileParent(Context))
+        {
+            FusePrepareLookupPath2(Context);
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
 
-        FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
-        coro_await (FuseLookupPath(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+            FusePosixPathSuffix(&Context->LookupPath.OrigPath, &Context->LookupPath.Remain, 0);
+            coro_await (FuseLookupPath(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
 
-        FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
+            FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
+        }
 
         if (!Context->LookupPath.RenameIsNonExistent &&
             (FuseDeviceExtension(Context->DeviceObject)->VolumeParams->CaseSensitiveSearch ||
@@ -1743,13 +2153,21 @@ static BOOLEAN FuseOpSetInformation_Rename(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        FuseCacheRemoveEntry(
-            FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->LookupPath.Ino, &Context->LookupPath.Name);
+        /* LookupPath.CacheItem is the source parent item, CacheItem2 the target parent item */
+        FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->LookupPath.CacheItem, -1);
+        if (Context->LookupPath.RenameIsNonExistent)
+            FuseCacheAdjustItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->LookupPath.CacheItem2, +1);
 
-        FuseCacheRemoveEntry(
-            FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->LookupPath.Ino2, &Context->LookupPath.Name2);
+        /* files kept for the moved item remain valid; those for a replaced target do not */
+        FuseFileIdleRelease(Context->DeviceObject,
+            FuseCacheMoveEntry(
+                FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->LookupPath.Ino, &Context->LookupPath.Name,
+                Context->LookupPath.Ino2, &Context->LookupPath.Name2));
+
+        FuseFileSetParent(Context->DeviceObject, Context->File, Context->LookupPath.CacheItem2);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
     }
@@ -1846,8 +2264,11 @@ static BOOLEAN FuseOpFlushBuffers(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        FuseCacheQuickExpireItem(FuseDeviceExtension(Context->DeviceObject)->Cache,
-            Context->File->CacheItem);
+        FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem,
+            &Context->FuseResponse->rsp.getattr.attr,
+            Context->FuseResponse->rsp.getattr.attr_valid,
+            Context->FuseResponse->rsp.getattr.attr_valid_nsec);
 
         FuseAttrToFileInfo(Context->DeviceObject, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.FlushBuffers.FileInfo);
@@ -1882,44 +2303,57 @@ static BOOLEAN FuseOpQueryVolumeInformation(FUSE_CONTEXT *Context)
 }
 
 static BOOLEAN FuseAddDirInfo(FUSE_CONTEXT *Context,
-    PSTRING Name, UINT64 NextOffset, FUSE_PROTO_ATTR *Attr,
+    PSTRING Name, PWSTR WideName, ULONG WideNameLength,
+    UINT64 NextOffset, FUSE_PROTO_ATTR *Attr,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+    /*
+     * If WideNameLength is not 0, WideName holds Name already decoded.
+     */
 {
     PAGED_CODE();
 
     try
     {
-        NTSTATUS Result;
         PVOID BufferEnd = (PUINT8)Buffer + Length;
         FSP_FSCTL_DIR_INFO *DirInfo;
-        ULONG WideNameLength, DirInfoSize, AlignedSize;
-        WCHAR WideName[255];
+        ULONG WideNameSize, DirInfoSize, AlignedSize;
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
 
         if (0 != Name)
         {
-            Result = RtlUTF8ToUnicodeN(
-                WideName, sizeof WideName, &WideNameLength,
-                Name->Buffer, Name->Length);
-            if (STATUS_SOME_NOT_MAPPED == Result)
-                Result = STATUS_SUCCESS;
-            else if (!NT_SUCCESS(Result))
-                return TRUE; /* return SUCCESS but IGNORE */
-            FspPosixDecodeWindowsPath(WideName, WideNameLength / sizeof(WCHAR));
+            Buffer = (PVOID)((PUINT8)Buffer + *PBytesTransferred);
+            if ((PUINT8)Buffer + sizeof(FSP_FSCTL_DIR_INFO) > (PUINT8)BufferEnd)
+                return FALSE;
+
+            /* decode the name directly into the output buffer */
+            DirInfo = Buffer;
+            WideNameSize = (ULONG)((PUINT8)BufferEnd - (PUINT8)DirInfo->FileNameBuf);
+            if (255 * sizeof(WCHAR) < WideNameSize)
+                WideNameSize = 255 * sizeof(WCHAR);
+            if (0 != WideNameLength)
+            {
+                if (WideNameSize < WideNameLength)
+                    return FALSE;
+                RtlCopyMemory(DirInfo->FileNameBuf, WideName, WideNameLength);
+            }
+            else if (!FusePosixPathDecodeName(Name,
+                DirInfo->FileNameBuf, WideNameSize, &WideNameLength))
+            {
+                if (255 * sizeof(WCHAR) == WideNameSize)
+                    return TRUE; /* name too long: return SUCCESS but IGNORE */
+                return FALSE;
+            }
 
             DirInfoSize = sizeof(FSP_FSCTL_DIR_INFO) + WideNameLength;
             AlignedSize = FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize);
 
-            Buffer = (PVOID)((PUINT8)Buffer + *PBytesTransferred);
             if ((PUINT8)Buffer + AlignedSize > (PUINT8)BufferEnd)
                 return FALSE;
 
-            DirInfo = Buffer;
             DirInfo->Size = (UINT16)DirInfoSize;
             FuseAttrToFileInfo(Context->DeviceObject, Attr, &DirInfo->FileInfo);
             DirInfo->NextOffset = NextOffset;
-            RtlCopyMemory(DirInfo->FileNameBuf, WideName, WideNameLength);
         }
         else
         {
@@ -1947,6 +2381,39 @@ static BOOLEAN FuseAddDirInfo(FUSE_CONTEXT *Context,
     }
 }
 
+static BOOLEAN FuseOpQueryDirectory_MatchPattern(FUSE_CONTEXT *Context, PSTRING Name)
+    /*
+     * Context->QueryDirectory.Pattern
+     * Context->QueryDirectory.WideName
+     * Context->QueryDirectory.WideNameLength
+     *
+     * The decoded name is kept in the context, so that FuseAddDirInfo need not decode it again.
+     */
+{
+    PAGED_CODE();
+
+    UNICODE_STRING WideName;
+    ULONG WideNameLength;
+
+    Context->QueryDirectory.WideNameLength = 0;
+
+    if (0 == Context->QueryDirectory.Pattern.Length)
+        return TRUE;
+
+    if (!FusePosixPathDecodeName(Name,
+        Context->QueryDirectory.WideName, 255 * sizeof(WCHAR), &WideNameLength))
+        return TRUE; /* let FuseAddDirInfo deal with it */
+
+    Context->QueryDirectory.WideNameLength = WideNameLength;
+
+    WideName.Length = WideName.MaximumLength = (USHORT)WideNameLength;
+    WideName.Buffer = Context->QueryDirectory.WideName;
+
+    return FsRtlIsNameInExpression(
+        &Context->QueryDirectory.Pattern, &WideName,
+        !Context->InternalRequest->Req.QueryDirectory.CaseSensitive, 0);
+}
+
 static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -1957,8 +2424,8 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
             PWSTR FileName = (PWSTR)(Context->InternalRequest->Buffer +
                 Context->InternalRequest->Req.QueryDirectory.Pattern.Offset);
             PSTR PosixName;
-            Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-                FileName, &PosixName, TRUE);
+            Context->InternalResponse->IoStatus.Status = FuseMapWindowsToPosixPath(Context,
+                FileName, &PosixName);
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
             RtlInitString(&Context->QueryDirectory.OrigName, PosixName);
@@ -1967,6 +2434,10 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
         Context->QueryDirectory.Ino = Context->File->Ino;
         Context->QueryDirectory.Name = Context->QueryDirectory.OrigName;
         coro_await (FuseLookup(Context));
+        if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+        {
+            coro_await (FuseRefreshAttr(Context));
+        }
 
         BOOLEAN AddDirInfoEnd = FALSE;
         if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
@@ -1974,6 +2445,8 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
                 Context,
                 &Context->QueryDirectory.Name,
                 0,
+                0,
+                0,
                 &Context->QueryDirectory.Attr,
                 (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
                 Context->InternalRequest->Req.QueryDirectory.Length,
@@ -1987,6 +2460,8 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
                 0,
                 0,
                 0,
+                0,
+                0,
                 (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
                 Context->InternalRequest->Req.QueryDirectory.Length,
                 &Context->QueryDirectory.BytesTransferred);
@@ -2009,116 +2484,269 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
                 *(PUINT64)(Context->InternalRequest->Buffer +
                     Context->InternalRequest->Req.QueryDirectory.Marker.Offset) :
                 0;
+        Context->QueryDirectory.MarkerOffset = Context->QueryDirectory.NextOffset;
 
         /*
-         * The FSD has sent us a buffer of QueryDirectory.Length size that holds FSP_FSCTL_DIR_INFO
-         * entries. Assuming that the average file name length is 24 we approximate how many entries
-         * (N) we can fit in that buffer:
-         *
-         * N = QueryDirectory.Length / (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)))
-         *
-         * We now approximate the FUSE READDIR buffer size required to fit N entries:
-         *
-         * read.size = FUSE_PROTO_RSP_HEADER_SIZE + N * (sizeof(FUSE_PROTO_DIRENT) + 24)
+         * If there is a wildcard pattern, filter entries by name prior to looking them up,
+         * so that only matching entries pay for attribute resolution. The FSD filters the
+         * entries that we return as well, so this is purely an optimization.
          */
-        UINT32 N = Context->InternalRequest->Req.QueryDirectory.Length /
-            (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)));
-        Context->QueryDirectory.Length = N * (sizeof(FUSE_PROTO_DIRENT) + 24);
+        if (sizeof(WCHAR) < Context->InternalRequest->Req.QueryDirectory.Pattern.Size)
+        {
+            UNICODE_STRING Pattern;
+            Pattern.Length = Pattern.MaximumLength =
+                Context->InternalRequest->Req.QueryDirectory.Pattern.Size - sizeof(WCHAR);
+            Pattern.Buffer = (PWSTR)(Context->InternalRequest->Buffer +
+                Context->InternalRequest->Req.QueryDirectory.Pattern.Offset);
+            if (!(sizeof(WCHAR) == Pattern.Length && L'*' == Pattern.Buffer[0]))
+            {
+                if (!Context->InternalRequest->Req.QueryDirectory.CaseSensitive)
+                {
+                    /* FsRtlIsNameInExpression requires an upcased expression when ignoring case */
+                    Context->QueryDirectory.Pattern.Length = 0;
+                    Context->QueryDirectory.Pattern.MaximumLength = Pattern.Length;
+                    Context->QueryDirectory.Pattern.Buffer = FuseContextAlloc(Context, Pattern.Length);
+                    if (0 != Context->QueryDirectory.Pattern.Buffer &&
+                        !NT_SUCCESS(RtlUpcaseUnicodeString(&Context->QueryDirectory.Pattern, &Pattern, FALSE)))
+                        Context->QueryDirectory.Pattern.Length = 0;
+                }
+                else
+                    Context->QueryDirectory.Pattern = Pattern;
 
-        coro_await (FuseProtoSendReaddir(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+                if (0 != Context->QueryDirectory.Pattern.Length)
+                {
+                    Context->QueryDirectory.WideName = FuseContextAlloc(Context, 255 * sizeof(WCHAR));
+                    if (0 == Context->QueryDirectory.WideName)
+                        Context->QueryDirectory.Pattern.Length = 0;
+                }
+            }
+        }
 
-        if (FUSE_PROTO_RSP_HEADER_SIZE + Context->QueryDirectory.Length < Context->FuseResponse->len)
+        /*
+         * Directory entries that did not fit in the buffer of the previous QueryDirectory
+         * on this handle are kept in the handle's enumeration cursor. If the cursor continues
+         * from our marker we deliver its entries before issuing a new READDIR. A restart scan
+         * (no marker) always reads the directory afresh.
+         */
+        Context->QueryDirectory.Cursor = InterlockedExchangePointer(
+            (PVOID *)&Context->File->DirCursor, 0);
+        if (0 != Context->QueryDirectory.Cursor &&
+            (0 == Context->QueryDirectory.MarkerOffset ||
+                Context->QueryDirectory.Cursor->Offset != Context->QueryDirectory.MarkerOffset))
         {
-            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
-            coro_break;
+            FuseFree(Context->QueryDirectory.Cursor);
+            Context->QueryDirectory.Cursor = 0;
         }
 
-        if (FUSE_PROTO_RSP_HEADER_SIZE < Context->FuseResponse->len)
+        for (;;)
         {
-            Context->QueryDirectory.Buffer = FuseAlloc(Context->FuseResponse->len);
-            if (0 == Context->QueryDirectory.Buffer)
+            if (0 != Context->QueryDirectory.Cursor)
             {
-                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
-                coro_break;
+                Context->QueryDirectory.BufferP = Context->QueryDirectory.Cursor->Buffer;
+                Context->QueryDirectory.BufferEndP =
+                    Context->QueryDirectory.Cursor->Buffer + Context->QueryDirectory.Cursor->Length;
             }
+            else
+            {
+                /*
+                 * The FSD has sent us a buffer of QueryDirectory.Length size that holds FSP_FSCTL_DIR_INFO
+                 * entries. Assuming that the average file name length is 24 we approximate how many entries
+                 * (N) we can fit in that buffer:
+                 *
+                 * N = QueryDirectory.Length / (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)))
+                 *
+                 * We now approximate the FUSE READDIR buffer size required to fit N entries:
+                 *
+                 * read.size = FUSE_PROTO_RSP_HEADER_SIZE + N * (sizeof(FUSE_PROTO_DIRENT) + 24)
+                 */
+                UINT32 N = Context->InternalRequest->Req.QueryDirectory.Length /
+                    (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)));
+                Context->QueryDirectory.Length = N * (sizeof(FUSE_PROTO_DIRENT) + 24);
 
-            RtlCopyMemory(Context->QueryDirectory.Buffer, Context->FuseResponse, Context->FuseResponse->len);
-        }
+                coro_await (FuseProtoSendReaddir(Context));
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
 
-        Context->QueryDirectory.BufferEndP = Context->QueryDirectory.Buffer + Context->FuseResponse->len;
-        Context->QueryDirectory.BufferP = Context->QueryDirectory.Buffer + FUSE_PROTO_RSP_HEADER_SIZE;
+                if (FUSE_PROTO_RSP_HEADER_SIZE + Context->QueryDirectory.Length < Context->FuseResponse->len)
+                {
+                    Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
+                    coro_break;
+                }
 
-        for (;;)
-        {
-            if (Context->QueryDirectory.BufferEndP <
-                    Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) ||
-                Context->QueryDirectory.BufferEndP <
-                    Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
-                        ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen)
-                break;
+                /* allocate once; the buffer is reused if we need to READDIR again */
+                if (0 == Context->QueryDirectory.Buffer)
+                {
+                    Context->QueryDirectory.Buffer = FuseContextAlloc(Context,
+                        FUSE_PROTO_RSP_HEADER_SIZE + Context->QueryDirectory.Length);
+                    if (0 == Context->QueryDirectory.Buffer)
+                    {
+                        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+                        coro_break;
+                    }
+                }
 
-            Context->QueryDirectory.Name.Length = Context->QueryDirectory.Name.MaximumLength = (USHORT)
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen;
-            Context->QueryDirectory.Name.Buffer =
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->name;
+                RtlCopyMemory(Context->QueryDirectory.Buffer, Context->FuseResponse, Context->FuseResponse->len);
 
-            if ((1 == Context->QueryDirectory.Name.Length &&
-                '.' == Context->QueryDirectory.Name.Buffer[0]) ||
-                (2 == Context->QueryDirectory.Name.Length &&
-                '.' == Context->QueryDirectory.Name.Buffer[0] &&
-                '.' == Context->QueryDirectory.Name.Buffer[1]))
+                Context->QueryDirectory.BufferEndP = Context->QueryDirectory.Buffer + Context->FuseResponse->len;
+                Context->QueryDirectory.BufferP = Context->QueryDirectory.Buffer + FUSE_PROTO_RSP_HEADER_SIZE;
+
+                /* count the directory children; this allows for quick emptiness checks on delete */
+                {
+                    PUINT8 BufferP = Context->QueryDirectory.BufferP;
+                    UINT64 NextOffset = Context->QueryDirectory.NextOffset;
+                    ULONG Count = 0;
+                    while (Context->QueryDirectory.BufferEndP >=
+                            BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) &&
+                        Context->QueryDirectory.BufferEndP >=
+                            BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
+                                ((FUSE_PROTO_DIRENT *)BufferP)->namelen)
+                    {
+                        FUSE_PROTO_DIRENT *Dirent = (FUSE_PROTO_DIRENT *)BufferP;
+                        if (!((1 == Dirent->namelen && '.' == Dirent->name[0]) ||
+                            (2 == Dirent->namelen && '.' == Dirent->name[0] && '.' == Dirent->name[1])))
+                            Count++;
+                        NextOffset = Dirent->off;
+                        BufferP += FSP_FSCTL_ALIGN_UP(
+                            FIELD_OFFSET(FUSE_PROTO_DIRENT, name) + Dirent->namelen, 8);
+                    }
+                    FuseCacheCountItemChildren(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                        Context->File->CacheItem,
+                        Context->QueryDirectory.NextOffset, NextOffset, Count,
+                        Context->QueryDirectory.BufferP == BufferP);
+                }
+            }
+
+            for (;;)
             {
-                /*
-                 * If the file system gave us a real inode number try getattr on it.
-                 * Otherwise try with the inode number from the file descriptor (this
-                 * is obviously incorrect for the parent "..", but we are doing the
-                 * best we can).
-                 */
-                Context->QueryDirectory.Ino =
-                    FUSE_PROTO_UNKNOWN_INO != ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino ?
-                        ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino :
-                        Context->File->Ino;
-                coro_await (FuseProtoSendGetattr(Context));
+                if (Context->QueryDirectory.BufferEndP <
+                        Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) ||
+                    Context->QueryDirectory.BufferEndP <
+                        Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
+                            ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen)
+                {
+                    /* discard any partial entry */
+                    Context->QueryDirectory.BufferEndP = Context->QueryDirectory.BufferP;
+                    break;
+                }
+
+                Context->QueryDirectory.Name.Length = Context->QueryDirectory.Name.MaximumLength = (USHORT)
+                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen;
+                Context->QueryDirectory.Name.Buffer =
+                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->name;
+
+                if (!FuseOpQueryDirectory_MatchPattern(Context, &Context->QueryDirectory.Name))
+                {
+                    Context->QueryDirectory.NextOffset = ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->off;
+                    Context->QueryDirectory.BufferP += FSP_FSCTL_ALIGN_UP(
+                        FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
+                            ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen,
+                        8);
+                    continue;
+                }
+
+                if ((1 == Context->QueryDirectory.Name.Length &&
+                    '.' == Context->QueryDirectory.Name.Buffer[0]) ||
+                    (2 == Context->QueryDirectory.Name.Length &&
+                    '.' == Context->QueryDirectory.Name.Buffer[0] &&
+                    '.' == Context->QueryDirectory.Name.Buffer[1]))
+                {
+                    /*
+                     * If the file system gave us a real inode number try getattr on it.
+                     * Otherwise try with the inode number from the file descriptor (this
+                     * is obviously incorrect for the parent "..", but we are doing the
+                     * best we can).
+                     */
+                    Context->QueryDirectory.Ino =
+                        FUSE_PROTO_UNKNOWN_INO != ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino ?
+                            ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino :
+                            Context->File->Ino;
+                    coro_await (FuseProtoSendGetattr(Context));
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                        coro_break;
+                    Context->Lookup.Attr = Context->FuseResponse->rsp.getattr.attr;
+                }
+                else
+                {
+                    Context->QueryDirectory.Ino = Context->File->Ino;
+                    coro_await (FuseLookup(Context));
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                        coro_break;
+                    coro_await (FuseRefreshAttr(Context));
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                        coro_break;
+                }
+
+                BOOLEAN Added = FuseAddDirInfo(
+                    Context,
+                    &Context->QueryDirectory.Name,
+                    Context->QueryDirectory.WideName,
+                    Context->QueryDirectory.WideNameLength,
+                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->off,
+                    &Context->QueryDirectory.Attr,
+                    (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
+                    Context->InternalRequest->Req.QueryDirectory.Length,
+                    &Context->QueryDirectory.BytesTransferred);
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                     coro_break;
-                Context->Lookup.Attr = Context->FuseResponse->rsp.getattr.attr;
+                if (!Added)
+                    break;
+
+                Context->QueryDirectory.MarkerOffset = Context->QueryDirectory.NextOffset =
+                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->off;
+                Context->QueryDirectory.BufferP += FSP_FSCTL_ALIGN_UP(
+                    FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
+                        ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen,
+                    8);
             }
-            else
+
+            if (Context->QueryDirectory.BufferEndP > Context->QueryDirectory.BufferP)
             {
-                Context->QueryDirectory.Ino = Context->File->Ino;
-                coro_await (FuseLookup(Context));
-                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                    coro_break;
+                /* the buffer is full; keep the undelivered entries in the enumeration cursor */
+                ULONG Length = (ULONG)(Context->QueryDirectory.BufferEndP - Context->QueryDirectory.BufferP);
+                FUSE_FILE_DIR_CURSOR *Cursor = Context->QueryDirectory.Cursor;
+                if (0 != Cursor)
+                    RtlMoveMemory(Cursor->Buffer, Context->QueryDirectory.BufferP, Length);
+                else
+                {
+                    Cursor = FuseAlloc(FIELD_OFFSET(FUSE_FILE_DIR_CURSOR, Buffer) + Length);
+                    if (0 != Cursor)
+                        RtlCopyMemory(Cursor->Buffer, Context->QueryDirectory.BufferP, Length);
+                }
+                if (0 != Cursor)
+                {
+                    Cursor->Offset = Context->QueryDirectory.MarkerOffset;
+                    Cursor->Length = Length;
+                    Context->QueryDirectory.Cursor = 0;
+                    Cursor = InterlockedExchangePointer((PVOID *)&Context->File->DirCursor, Cursor);
+                    if (0 != Cursor)
+                        FuseFree(Cursor);
+                }
+                break;
             }
 
-            BOOLEAN Added = FuseAddDirInfo(
-                Context,
-                &Context->QueryDirectory.Name,
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->off,
-                &Context->QueryDirectory.Attr,
-                (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
-                Context->InternalRequest->Req.QueryDirectory.Length,
-                &Context->QueryDirectory.BytesTransferred);
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
-            if (!Added)
+            if (0 != Context->QueryDirectory.Cursor)
+            {
+                /* the cursor has been drained; continue with a READDIR where it left off */
+                FuseFree(Context->QueryDirectory.Cursor);
+                Context->QueryDirectory.Cursor = 0;
+                continue;
+            }
+
+            if (Context->QueryDirectory.BufferP == Context->QueryDirectory.Buffer + FUSE_PROTO_RSP_HEADER_SIZE)
+            {
+                /* empty readdir response signifies end of dir; add WinFsp end-of-dir marker */
+                FuseAddDirInfo(Context, 0, 0, 0, 0, 0,
+                    (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
+                    Context->InternalRequest->Req.QueryDirectory.Length,
+                    &Context->QueryDirectory.BytesTransferred);
                 break;
+            }
 
-            Context->QueryDirectory.BufferP += FSP_FSCTL_ALIGN_UP(
-                FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
-                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen,
-                8);
+            /* if the pattern filtered out all entries, read on rather than return nothing */
+            if (0 != Context->QueryDirectory.BytesTransferred)
+                break;
         }
 
-        /* empty readdir response signifies end of dir; add WinFsp end-of-dir marker */
-        if (Context->QueryDirectory.BufferP == Context->QueryDirectory.Buffer + FUSE_PROTO_RSP_HEADER_SIZE)
-            FuseAddDirInfo(Context, 0, 0, 0,
-                (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
-                Context->InternalRequest->Req.QueryDirectory.Length,
-                &Context->QueryDirectory.BytesTransferred);
-
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
         Context->InternalResponse->IoStatus.Information = Context->QueryDirectory.BytesTransferred;
     }
@@ -2152,11 +2780,10 @@ static VOID FuseOpQueryDirectory_ContextFini(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
-    if (0 != Context->QueryDirectory.Buffer)
-        FuseFree(Context->QueryDirectory.Buffer);
+    if (0 != Context->QueryDirectory.Cursor)
+        FuseFree(Context->QueryDirectory.Cursor);
 
-    FspPosixDeletePath(Context->QueryDirectory.OrigName.Buffer);
-        /* handles NULL paths */
+    /* Buffer and OrigName are allocated from the context scratch arena */
     FuseCacheDereferenceGen(FuseDeviceExtension(Context->DeviceObject)->Cache, Context->QueryDirectory.CacheGen);
         /* handles NULL gens */
 }
@@ -2178,44 +2805,307 @@ static BOOLEAN FuseOpFileSystemControl(FUSE_CONTEXT *Context)
     return FALSE;
 }
 
+static VOID FuseOpDeviceControl_QueryStats(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FUSE_STATS *Stats;
+
+    if (sizeof *Stats > Context->InternalRequest->Req.DeviceControl.OutputLength)
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+        return;
+    }
+
+    PVOID InternalResponse = FuseContextAlloc(Context, sizeof *Context->InternalResponse + sizeof *Stats);
+    if (0 == InternalResponse)
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+        return;
+    }
+    RtlZeroMemory(InternalResponse, sizeof *Context->InternalResponse + sizeof *Stats);
+
+    Context->InternalResponse = InternalResponse;
+    Context->InternalResponse->Size = (UINT16)(sizeof *Context->InternalResponse + sizeof *Stats);
+    Context->InternalResponse->Kind = Context->InternalRequest->Kind;
+    Context->InternalResponse->Hint = Context->InternalRequest->Hint;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Offset = 0;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Size = sizeof *Stats;
+
+    Stats = (PVOID)Context->InternalResponse->Buffer;
+    Stats->Size = sizeof *Stats;
+    FuseIoqQueryStats(FuseDeviceExtension(Context->DeviceObject)->Ioq, Stats);
+    FuseContextQueryStats(Context->DeviceObject, Stats);
+    FuseCacheQueryStats(FuseDeviceExtension(Context->DeviceObject)->Cache, Stats);
+
+    Context->InternalResponse->IoStatus.Information = sizeof *Stats;
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+}
+
+static VOID FuseOpDeviceControl_ExportSnapshot(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    ULONG Length = Context->InternalRequest->Req.DeviceControl.OutputLength;
+    ULONG Size;
+    NTSTATUS Result;
+
+    /* the response size is a UINT16 */
+    if (0xffff - sizeof *Context->InternalResponse < Length)
+        Length = 0xffff - sizeof *Context->InternalResponse;
+    Length &= ~3;
+    if (sizeof(FUSE_SNAPSHOT) > Length)
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+        return;
+    }
+
+    PVOID InternalResponse = FuseContextAlloc(Context, sizeof *Context->InternalResponse + Length);
+    if (0 == InternalResponse)
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+        return;
+    }
+    RtlZeroMemory(InternalResponse, sizeof *Context->InternalResponse);
+
+    Result = FuseCacheExportSnapshot(FuseDeviceExtension(Context->DeviceObject)->Cache,
+        ((FSP_FSCTL_TRANSACT_RSP *)InternalResponse)->Buffer, Length, &Size);
+    if (!NT_SUCCESS(Result))
+    {
+        Context->InternalResponse->IoStatus.Status = (UINT32)Result;
+        return;
+    }
+
+    Context->InternalResponse = InternalResponse;
+    Context->InternalResponse->Size = (UINT16)(sizeof *Context->InternalResponse + Size);
+    Context->InternalResponse->Kind = Context->InternalRequest->Kind;
+    Context->InternalResponse->Hint = Context->InternalRequest->Hint;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Offset = 0;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Size = (UINT16)Size;
+
+    Context->InternalResponse->IoStatus.Information = Size;
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+}
+
+static VOID FuseOpDeviceControl_PrimeSnapshot(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    Context->InternalResponse->IoStatus.Status = FuseProtoPostPrime(Context->DeviceObject,
+        Context->InternalRequest->Buffer + Context->InternalRequest->Req.DeviceControl.Buffer.Offset,
+        Context->InternalRequest->Req.DeviceControl.Buffer.Size);
+}
+
+static BOOLEAN FuseOpDeviceControl_BulkStat(FUSE_CONTEXT *Context)
+    /*
+     * Look up many paths in one request, e.g. for a build system that checks
+     * thousands of known files. Each path is resolved by FuseLookupPath against
+     * the entry cache; only misses are sent to the file system.
+     *
+     * Lookups are done as for a user mode open for FILE_READ_ATTRIBUTES with the
+     * credentials of the process that opened the file that the IOCTL is issued on;
+     * every directory along a path is traverse checked.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_FILE *File;
+    PVOID InternalResponse;
+    FUSE_BULK_STAT *BulkStat;
+    ULONG Length, PosixLength;
+
+    coro_block (Context->CoroState)
+    {
+        File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.DeviceControl.UserContext2;
+        if (0 == File)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_ACCESS_DENIED;
+            coro_break;
+        }
+        Context->OrigUid = File->OrigUid;
+        Context->OrigGid = File->OrigGid;
+        Context->LookupPath.DesiredAccess = FILE_READ_ATTRIBUTES;
+        Context->LookupPath.UserMode = 1;
+        Context->LookupPath.HasTraversePrivilege = 0;
+
+        Length = Context->InternalRequest->Req.DeviceControl.OutputLength;
+        if (0xffff - sizeof *Context->InternalResponse < Length)
+            Length = 0xffff - sizeof *Context->InternalResponse;
+        Context->LookupPath.BulkMaxCount = Length / sizeof *BulkStat;
+        if (0 == Context->LookupPath.BulkMaxCount)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+            coro_break;
+        }
+        Length = Context->LookupPath.BulkMaxCount * sizeof *BulkStat;
+
+        InternalResponse = FuseContextAlloc(Context, sizeof *Context->InternalResponse + Length);
+        if (0 == InternalResponse)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+            coro_break;
+        }
+        RtlZeroMemory(InternalResponse, sizeof *Context->InternalResponse + Length);
+
+        Context->InternalResponse->IoStatus.Status = FuseMapWindowsToPosixPathN(Context,
+            (PWSTR)(Context->InternalRequest->Buffer +
+                Context->InternalRequest->Req.DeviceControl.Buffer.Offset),
+            Context->InternalRequest->Req.DeviceControl.Buffer.Size / sizeof(WCHAR),
+            &Context->LookupPath.BulkPath, &PosixLength);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+        Context->LookupPath.BulkPathEnd = Context->LookupPath.BulkPath + PosixLength;
+
+        Context->InternalResponse->IoStatus.Status = FuseCacheReferenceGen(
+            FuseDeviceExtension(Context->DeviceObject)->Cache, &Context->LookupPath.CacheGen);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+        Context->Fini = FusePrepareLookupPath_ContextFini;
+
+        Context->InternalResponse = InternalResponse;
+        Context->InternalResponse->Kind = Context->InternalRequest->Kind;
+        Context->InternalResponse->Hint = Context->InternalRequest->Hint;
+
+        /* an empty path (or the end of the input) ends the list */
+        while (Context->LookupPath.BulkPathEnd > Context->LookupPath.BulkPath &&
+            '\0' != Context->LookupPath.BulkPath[0] &&
+            Context->LookupPath.BulkMaxCount > Context->LookupPath.BulkCount)
+        {
+            /* a STRING cannot describe a longer path; RtlInitString would truncate it */
+            PosixLength = (ULONG)strlen(Context->LookupPath.BulkPath);
+            RtlInitString(&Context->LookupPath.OrigPath,
+                MAXUSHORT > PosixLength ? Context->LookupPath.BulkPath : 0);
+            Context->LookupPath.BulkPath += PosixLength + 1;
+            Context->LookupPath.BulkCount++;
+
+            if (0 == Context->LookupPath.OrigPath.Buffer ||
+                '/' != Context->LookupPath.OrigPath.Buffer[0])
+                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_OBJECT_NAME_INVALID;
+            else
+            {
+                Context->LookupPath.Remain = Context->LookupPath.OrigPath;
+                coro_await (FuseLookupPath(Context));
+                if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                {
+                    coro_await (FuseRefreshAttr(Context));
+                }
+            }
+
+            BulkStat = (FUSE_BULK_STAT *)Context->InternalResponse->Buffer +
+                Context->LookupPath.BulkCount - 1;
+            BulkStat->Status = Context->InternalResponse->IoStatus.Status;
+            if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                FuseAttrToFileInfo(Context->DeviceObject, &Context->LookupPath.Attr,
+                    &BulkStat->FileInfo);
+        }
+
+        Length = Context->LookupPath.BulkCount * sizeof *BulkStat;
+        Context->InternalResponse->Size = (UINT16)(sizeof *Context->InternalResponse + Length);
+        Context->InternalResponse->Rsp.DeviceControl.Buffer.Offset = 0;
+        Context->InternalResponse->Rsp.DeviceControl.Buffer.Size = (UINT16)Length;
+
+        Context->InternalResponse->IoStatus.Information = Length;
+        Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+    }
+
+    return coro_active();
+}
+
 static BOOLEAN FuseOpDeviceControl(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    FUSE_FILE *File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.DeviceControl.UserContext2;
+
+    /* only driver control codes are handled; FUSE_IOCTL is not forwarded to user mode */
+    switch (Context->InternalRequest->Req.DeviceControl.IoControlCode)
+    {
+    case FUSE_IOCTL_QUERY_STATS:
+        FuseOpDeviceControl_QueryStats(Context);
+        break;
+    case FUSE_IOCTL_EXPORT_SNAPSHOT:
+    case FUSE_IOCTL_PRIME_SNAPSHOT:
+        /* snapshots expose (and steer lookups of) the whole namespace regardless of access */
+        if (0 == File || !File->Privileged)
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_ACCESS_DENIED;
+        else if (FUSE_IOCTL_EXPORT_SNAPSHOT == Context->InternalRequest->Req.DeviceControl.IoControlCode)
+            FuseOpDeviceControl_ExportSnapshot(Context);
+        else
+            FuseOpDeviceControl_PrimeSnapshot(Context);
+        break;
+    case FUSE_IOCTL_BULK_STAT:
+        return FuseOpDeviceControl_BulkStat(Context);
+    default:
+        Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
     return FALSE;
 }
 
+static INT FuseOgDeviceControl(FUSE_CONTEXT *Context, BOOLEAN Acquire)
+{
+    PAGED_CODE();
+
+    /* path lookups must not race with renames */
+    if (FUSE_IOCTL_BULK_STAT != Context->InternalRequest->Req.DeviceControl.IoControlCode)
+        return FuseOpGuardFalse;
+
+    if (Acquire)
+        return FuseOpGuardAcquireShared(Context);
+    else
+        return FuseOpGuardReleaseShared(Context);
+}
+
 static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
     coro_block (Context->CoroState)
     {
-        Context->Fini = FuseSecurity_ContextFini;
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.QuerySecurity.UserContext2;
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+        if (!FuseCacheGetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+            Context->File->CacheItem, &Context->Security.Attr))
+        {
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
 
-        Context->InternalResponse->IoStatus.Status = FspPosixMapPermissionsToSecurityDescriptor(
-            Context->FuseResponse->rsp.getattr.attr.uid,
-            Context->FuseResponse->rsp.getattr.attr.gid,
-            Context->FuseResponse->rsp.getattr.attr.mode,
-            &Context->Security.SecurityDescriptor);
+            FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->File->CacheItem,
+                &Context->FuseResponse->rsp.getattr.attr,
+                Context->FuseResponse->rsp.getattr.attr_valid,
+                Context->FuseResponse->rsp.getattr.attr_valid_nsec);
+
+            Context->Security.Attr = Context->FuseResponse->rsp.getattr.attr;
+        }
+
+        PSECURITY_DESCRIPTOR SecurityDescriptor;
+        ULONG Length;
+        Context->InternalResponse->IoStatus.Status = FuseSecurityCacheReferenceDescriptor(
+            FuseDeviceExtension(Context->DeviceObject)->SecurityCache,
+            Context->Security.Attr.uid,
+            Context->Security.Attr.gid,
+            Context->Security.Attr.mode,
+            &SecurityDescriptor,
+            &Length);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        ULONG Length = RtlLengthSecurityDescriptor(Context->Security.SecurityDescriptor);
         if (FSP_FSCTL_TRANSACT_RSP_BUFFER_SIZEMAX < Length)
         {
+            FuseSecurityCacheDereferenceDescriptor(
+                FuseDeviceExtension(Context->DeviceObject)->SecurityCache, SecurityDescriptor);
             Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_SECURITY_DESCR;
             coro_break;
         }
 
-        PVOID InternalResponse = FuseAlloc(sizeof *Context->InternalResponse + Length);
+        PVOID InternalResponse = FuseContextAlloc(Context, sizeof *Context->InternalResponse + Length);
         if (0 == InternalResponse)
         {
+            FuseSecurityCacheDereferenceDescriptor(
+                FuseDeviceExtension(Context->DeviceObject)->SecurityCache, SecurityDescriptor);
             Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
             coro_break;
         }
@@ -2230,7 +3120,10 @@ static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context)
 
         /* RtlCopyMemory is safe here, because all buffers are in-kernel */
         RtlCopyMemory(
-            Context->InternalResponse->Buffer, Context->Security.SecurityDescriptor, Length);
+            Context->InternalResponse->Buffer, SecurityDescriptor, Length);
+
+        FuseSecurityCacheDereferenceDescriptor(
+            FuseDeviceExtension(Context->DeviceObject)->SecurityCache, SecurityDescriptor);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
     }
@@ -2311,6 +3204,12 @@ static BOOLEAN FuseOpSetSecurity(FUSE_CONTEXT *Context)
             coro_await (FuseProtoSendSetattr(Context));
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
+
+            FuseCacheSetItemAttr(FuseDeviceExtension(Context->DeviceObject)->Cache,
+                Context->File->CacheItem,
+                &Context->FuseResponse->rsp.setattr.attr,
+                Context->FuseResponse->rsp.setattr.attr_valid,
+                Context->FuseResponse->rsp.setattr.attr_valid_nsec);
         }
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -2378,7 +3277,7 @@ FUSE_OPERATION FuseOperations[FspFsctlTransactKindCount] =
     { 0 },
 
     /* FspFsctlTransactDeviceControlKind */
-    { 0 },
+    { FuseOpDeviceControl, FuseOgDeviceControl },
 
     /* FspFsctlTransactShutdownKind */
     { 0 },
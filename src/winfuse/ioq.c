@@ -27,6 +27,15 @@ VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqEndProcessing(FUSE_IOQ *Ioq, UINT64 Unique);
 VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq);
+BOOLEAN FuseIoqMergeRelease(FUSE_IOQ *Ioq, FUSE_FILE *File);
+VOID FuseIoqEndBackground(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
+BOOLEAN FuseIoqIsCongested(FUSE_IOQ *Ioq);
+VOID FuseIoqSetBackgroundLimits(FUSE_IOQ *Ioq, ULONG MaxBackground, ULONG CongestionThreshold);
+VOID FuseIoqQueryStats(FUSE_IOQ *Ioq, FUSE_STATS *Stats);
+static UINT32 FuseIoqDeadlineClass(UINT32 Opcode);
+VOID FuseIoqExpirationRoutine(FUSE_IOQ *Ioq, UINT64 InterruptTime);
+FUSE_CONTEXT *FuseIoqNextTimedOut(FUSE_IOQ *Ioq);
+VOID FuseIoqPostZombie(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FuseIoqCreate)
@@ -35,14 +44,47 @@ FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq);
 #pragma alloc_text(PAGE, FuseIoqEndProcessing)
 #pragma alloc_text(PAGE, FuseIoqPostPending)
 #pragma alloc_text(PAGE, FuseIoqNextPending)
+#pragma alloc_text(PAGE, FuseIoqMergeRelease)
+#pragma alloc_text(PAGE, FuseIoqEndBackground)
+#pragma alloc_text(PAGE, FuseIoqIsCongested)
+#pragma alloc_text(PAGE, FuseIoqSetBackgroundLimits)
+#pragma alloc_text(PAGE, FuseIoqQueryStats)
+#pragma alloc_text(PAGE, FuseIoqDeadlineClass)
+#pragma alloc_text(PAGE, FuseIoqExpirationRoutine)
+#pragma alloc_text(PAGE, FuseIoqNextTimedOut)
+#pragma alloc_text(PAGE, FuseIoqPostZombie)
 #endif
 
-#define FUSE_IOQ_SIZE                   1024
+#define FUSE_IOQ_SIZE                   2048
+#define FUSE_IOQ_BACKGROUND_RATIO       16
+                                        /* pending contexts served before a background one */
+#define FUSE_IOQ_BACKGROUND_MAX         12  /* default max_background (same as Linux) */
+#define FUSE_IOQ_RELEASE_BATCH_MAX      64  /* files per background RELEASE context */
+
+UINT32 FuseIoqDeadlineTimeouts[FuseIoqDeadlineClassCount] =
+{
+    0,                                  /* FuseIoqDeadlineNone */
+    0,                                  /* FuseIoqDeadlineMeta */
+    0,                                  /* FuseIoqDeadlineData */
+    0,                                  /* FuseIoqDeadlineBackground */
+};                                      /* deadlines are opt-in (see FuseReadParameters) */
 
 struct _FUSE_IOQ
 {
     FAST_MUTEX Mutex;
-    LIST_ENTRY PendingList, ProcessList;
+    LIST_ENTRY PendingList, BackgroundList;
+    /*
+     * Contexts with the user mode file system are kept in one list per deadline class.
+     * All contexts in a class have the same timeout, so each list is ordered by deadline
+     * and expiration only needs to look at list heads.
+     */
+    LIST_ENTRY ProcessList[FuseIoqDeadlineClassCount];
+    LIST_ENTRY TimeoutList, ZombieList;
+    ULONG TimeoutCount, ZombieCount;
+    ULONG PendingRun;
+    ULONG BackgroundMax, BackgroundCongestion;
+    ULONG BackgroundActive, BackgroundQueued;
+    UINT64 RequestCount[FUSE_STATS_OPCODE_COUNT];
     ULONG ProcessBucketCount;
     FUSE_CONTEXT *ProcessBuckets[];
 };
@@ -62,8 +104,13 @@ NTSTATUS FuseIoqCreate(FUSE_IOQ **PIoq)
 
     ExInitializeFastMutex(&Ioq->Mutex);
     InitializeListHead(&Ioq->PendingList);
-    InitializeListHead(&Ioq->ProcessList);
+    InitializeListHead(&Ioq->BackgroundList);
+    for (ULONG I = 0; FuseIoqDeadlineClassCount > I; I++)
+        InitializeListHead(&Ioq->ProcessList[I]);
+    InitializeListHead(&Ioq->TimeoutList);
+    InitializeListHead(&Ioq->ZombieList);
     Ioq->ProcessBucketCount = BucketCount;
+    FuseIoqSetBackgroundLimits(Ioq, 0, 0);
 
     *PIoq = Ioq;
 
@@ -80,7 +127,26 @@ VOID FuseIoqDelete(FUSE_IOQ *Ioq)
         Entry = Entry->Flink;
         FuseContextDelete(Context);
     }
-    for (PLIST_ENTRY Entry = Ioq->ProcessList.Flink; &Ioq->ProcessList != Entry;)
+    for (PLIST_ENTRY Entry = Ioq->BackgroundList.Flink; &Ioq->BackgroundList != Entry;)
+    {
+        FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
+        Entry = Entry->Flink;
+        FuseContextDelete(Context);
+    }
+    for (ULONG I = 0; FuseIoqDeadlineClassCount > I; I++)
+        for (PLIST_ENTRY Entry = Ioq->ProcessList[I].Flink; &Ioq->ProcessList[I] != Entry;)
+        {
+            FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
+            Entry = Entry->Flink;
+            FuseContextDelete(Context);
+        }
+    for (PLIST_ENTRY Entry = Ioq->TimeoutList.Flink; &Ioq->TimeoutList != Entry;)
+    {
+        FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
+        Entry = Entry->Flink;
+        FuseContextDelete(Context);
+    }
+    for (PLIST_ENTRY Entry = Ioq->ZombieList.Flink; &Ioq->ZombieList != Entry;)
     {
         FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
         Entry = Entry->Flink;
@@ -89,14 +155,8 @@ VOID FuseIoqDelete(FUSE_IOQ *Ioq)
     FuseFree(Ioq);
 }
 
-VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
+static inline VOID FuseIoqInsertProcessBucket(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
 {
-    PAGED_CODE();
-
-    ExAcquireFastMutex(&Ioq->Mutex);
-
-    InsertTailList(&Ioq->ProcessList, &Context->ListEntry);
-
     ULONG Index = FuseHashMixPointer(Context) % Ioq->ProcessBucketCount;
 #if DBG
     for (FUSE_CONTEXT *ContextX = Ioq->ProcessBuckets[Index]; ContextX; ContextX = ContextX->DictNext)
@@ -105,6 +165,62 @@ VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
     ASSERT(0 == Context->DictNext);
     Context->DictNext = Ioq->ProcessBuckets[Index];
     Ioq->ProcessBuckets[Index] = Context;
+}
+
+static inline BOOLEAN FuseIoqRemoveProcessBucket(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
+{
+    ULONG Index = FuseHashMixPointer(Context) % Ioq->ProcessBucketCount;
+    for (FUSE_CONTEXT **PContext = &Ioq->ProcessBuckets[Index]; *PContext; PContext = &(*PContext)->DictNext)
+    {
+        if (*PContext == Context)
+        {
+            *PContext = Context->DictNext;
+            Context->DictNext = 0;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
+    /*
+     * Context->FuseRequest must still point to the request that was just sent;
+     * its opcode determines the deadline, except that requests of background contexts
+     * that have one use the background deadline. The parts of the request needed to undo
+     * a late reply are kept in the context.
+     */
+{
+    PAGED_CODE();
+
+    UINT32 DeadlineClass = FuseIoqDeadlineClass(Context->FuseRequest->opcode);
+    if (FuseIoqDeadlineNone != DeadlineClass && FuseContextIsBackground(Context))
+        DeadlineClass = FuseIoqDeadlineBackground;
+    UINT32 Timeout = FuseIoqDeadlineTimeouts[DeadlineClass];
+    if (0 == Timeout)
+        DeadlineClass = FuseIoqDeadlineNone;
+
+    Context->Opcode = Context->FuseRequest->opcode;
+    Context->Nodeid = Context->FuseRequest->nodeid;
+    switch (Context->Opcode)
+    {
+    case FUSE_PROTO_OPCODE_OPEN:
+    case FUSE_PROTO_OPCODE_OPENDIR:
+        Context->OpenFlags = Context->FuseRequest->req.open.flags;
+        break;
+    case FUSE_PROTO_OPCODE_CREATE:
+        Context->OpenFlags = Context->FuseRequest->req.create.flags;
+        break;
+    }
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    /* take the time under the mutex to keep each deadline list ordered */
+    Context->Deadline = 0 != Timeout ?
+        KeQueryInterruptTime() + Timeout * 10000ULL : (UINT64)-1LL;
+    InsertTailList(&Ioq->ProcessList[DeadlineClass], &Context->ListEntry);
+    FuseIoqInsertProcessBucket(Ioq, Context);
+    if (FUSE_STATS_OPCODE_COUNT > Context->Opcode)
+        Ioq->RequestCount[Context->Opcode]++;
 
     ExReleaseFastMutex(&Ioq->Mutex);
 }
@@ -116,21 +232,21 @@ FUSE_CONTEXT *FuseIoqEndProcessing(FUSE_IOQ *Ioq, UINT64 Unique)
     FUSE_CONTEXT *ContextHint = (PVOID)(UINT_PTR)Unique;
     FUSE_CONTEXT *Context = 0;
 
+    /* reply to an INTERRUPT; its context is gone (see FuseProtoFillInterrupt) */
+    if (0 != (Unique & FUSE_PROTO_UNIQUE_INT_BIT))
+        return 0;
+
     ExAcquireFastMutex(&Ioq->Mutex);
 
-    ULONG Index = FuseHashMixPointer(ContextHint) % Ioq->ProcessBucketCount;
-    for (FUSE_CONTEXT **PContext = &Ioq->ProcessBuckets[Index]; *PContext; PContext = &(*PContext)->DictNext)
+    if (FuseIoqRemoveProcessBucket(Ioq, ContextHint))
     {
-        if (*PContext == ContextHint)
-        {
-            *PContext = ContextHint->DictNext;
-            ContextHint->DictNext = 0;
-
-            Context = ContextHint;
-            RemoveEntryList(&Context->ListEntry);
+        Context = ContextHint;
+        RemoveEntryList(&Context->ListEntry);
 
-            break;
-        }
+        /* a timed out context that has not been failed yet is processed normally */
+        Context->TimedOut = 0;
+        if (Context->Zombie)
+            Ioq->ZombieCount--;
     }
 
     ExReleaseFastMutex(&Ioq->Mutex);
@@ -144,7 +260,19 @@ VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
 
     ExAcquireFastMutex(&Ioq->Mutex);
 
-    InsertTailList(&Ioq->PendingList, &Context->ListEntry);
+    if (FuseContextIsBackground(Context))
+    {
+        InsertTailList(&Ioq->BackgroundList, &Context->ListEntry);
+        Ioq->BackgroundQueued++;
+        if (Context->BackgroundCredit)
+        {
+            /* a requeued background context gives up its credit until it is served again */
+            Context->BackgroundCredit = 0;
+            Ioq->BackgroundActive--;
+        }
+    }
+    else
+        InsertTailList(&Ioq->PendingList, &Context->ListEntry);
 
     ExReleaseFastMutex(&Ioq->Mutex);
 }
@@ -155,14 +283,271 @@ FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq)
 
     ExAcquireFastMutex(&Ioq->Mutex);
 
+    /*
+     * Background contexts (e.g. RELEASE) are served only when there are no pending contexts,
+     * or when FUSE_IOQ_BACKGROUND_RATIO pending contexts have been served in a row while
+     * background contexts were waiting; the latter keeps them from starving.
+     *
+     * A background context is served only if it can get a credit: no more than BackgroundMax
+     * background contexts may be with the user mode file system at any time.
+     */
     PLIST_ENTRY Entry = Ioq->PendingList.Flink;
-    FUSE_CONTEXT *Context = &Ioq->PendingList != Entry ?
+    BOOLEAN Background = FALSE;
+    if (&Ioq->BackgroundList != Ioq->BackgroundList.Flink &&
+        Ioq->BackgroundMax > Ioq->BackgroundActive)
+    {
+        if (&Ioq->PendingList == Entry || FUSE_IOQ_BACKGROUND_RATIO <= Ioq->PendingRun)
+        {
+            Entry = Ioq->BackgroundList.Flink;
+            Ioq->PendingRun = 0;
+            Background = TRUE;
+        }
+        else
+            Ioq->PendingRun++;
+    }
+    FUSE_CONTEXT *Context = &Ioq->PendingList != Entry && &Ioq->BackgroundList != Entry ?
         CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry) : 0;
 
     if (0 != Context)
+    {
         RemoveEntryList(&Context->ListEntry);
+        if (Background)
+        {
+            ASSERT(!Context->BackgroundCredit);
+            Context->BackgroundCredit = 1;
+            Ioq->BackgroundQueued--;
+            Ioq->BackgroundActive++;
+        }
+    }
 
     ExReleaseFastMutex(&Ioq->Mutex);
 
     return Context;
 }
+
+BOOLEAN FuseIoqMergeRelease(FUSE_IOQ *Ioq, FUSE_FILE *File)
+    /*
+     * Add a file to the background RELEASE context at the tail of the background list.
+     * Returns FALSE if there is no such context; the caller must then post a new one.
+     *
+     * Only contexts that wait in the background list are merged into, because these are
+     * not owned by any thread. A context that has started sending (and was requeued) or
+     * that already holds FUSE_IOQ_RELEASE_BATCH_MAX files is not merged into either, so
+     * that a burst of closes is spread over as many contexts as there are credits.
+     */
+{
+    PAGED_CODE();
+
+    BOOLEAN Result = FALSE;
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    PLIST_ENTRY Entry = Ioq->BackgroundList.Blink;
+    if (&Ioq->BackgroundList != Entry)
+    {
+        FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
+        ASSERT(FuseContextIsBackground(Context));
+        if (FUSE_PROTO_OPCODE_RELEASE == Context->InternalResponse->Hint &&
+            !Context->Release.Started &&
+            FUSE_IOQ_RELEASE_BATCH_MAX > Context->Release.FileCount)
+        {
+            File->ReleaseNext = Context->Release.FileList;
+            Context->Release.FileList = File;
+            Context->Release.FileCount++;
+            Result = TRUE;
+        }
+    }
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+
+    return Result;
+}
+
+VOID FuseIoqEndBackground(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
+    /*
+     * Return the credit of a background context that is done.
+     */
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    if (Context->BackgroundCredit)
+    {
+        Context->BackgroundCredit = 0;
+        Ioq->BackgroundActive--;
+    }
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
+
+BOOLEAN FuseIoqIsCongested(FUSE_IOQ *Ioq)
+    /*
+     * Determine whether new background work should be deferred. This is the case when the
+     * number of queued and active background contexts has reached the congestion threshold.
+     */
+{
+    PAGED_CODE();
+
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    Result = Ioq->BackgroundCongestion <= Ioq->BackgroundQueued + Ioq->BackgroundActive;
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+
+    return Result;
+}
+
+VOID FuseIoqSetBackgroundLimits(FUSE_IOQ *Ioq, ULONG MaxBackground, ULONG CongestionThreshold)
+    /*
+     * Set the background limits. These normally come from the INIT reply (max_background,
+     * congestion_threshold); a value of 0 selects the default.
+     */
+{
+    PAGED_CODE();
+
+    if (0 == MaxBackground)
+        MaxBackground = FUSE_IOQ_BACKGROUND_MAX;
+    if (0 == CongestionThreshold || MaxBackground < CongestionThreshold)
+        CongestionThreshold = MaxBackground * 3 / 4;
+    if (0 == CongestionThreshold)
+        CongestionThreshold = 1;
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    Ioq->BackgroundMax = MaxBackground;
+    Ioq->BackgroundCongestion = CongestionThreshold;
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
+
+VOID FuseIoqQueryStats(FUSE_IOQ *Ioq, FUSE_STATS *Stats)
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    Stats->MaxBackground = Ioq->BackgroundMax;
+    Stats->CongestionThreshold = Ioq->BackgroundCongestion;
+    Stats->BackgroundActive = Ioq->BackgroundActive;
+    Stats->BackgroundQueued = Ioq->BackgroundQueued;
+    Stats->TimeoutCount = Ioq->TimeoutCount;
+    Stats->ZombieCount = Ioq->ZombieCount;
+    RtlCopyMemory(Stats->RequestCount, Ioq->RequestCount, sizeof Stats->RequestCount);
+    if (0 != Ioq->ZombieCount || !IsListEmpty(&Ioq->TimeoutList))
+        Stats->Flags |= FUSE_STATS_DEGRADED;
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
+
+static UINT32 FuseIoqDeadlineClass(UINT32 Opcode)
+{
+    PAGED_CODE();
+
+    switch (Opcode)
+    {
+    case FUSE_PROTO_OPCODE_INIT:
+    case FUSE_PROTO_OPCODE_DESTROY:
+    case FUSE_PROTO_OPCODE_FORGET:
+    case FUSE_PROTO_OPCODE_BATCH_FORGET:
+    case FUSE_PROTO_OPCODE_INTERRUPT:
+        /* failing RELEASE would leak the handle in the file system */
+    case FUSE_PROTO_OPCODE_RELEASE:
+    case FUSE_PROTO_OPCODE_RELEASEDIR:
+        return FuseIoqDeadlineNone;
+    case FUSE_PROTO_OPCODE_READ:
+    case FUSE_PROTO_OPCODE_WRITE:
+    case FUSE_PROTO_OPCODE_FSYNC:
+    case FUSE_PROTO_OPCODE_FSYNCDIR:
+    case FUSE_PROTO_OPCODE_FLUSH:
+    case FUSE_PROTO_OPCODE_READDIR:
+    case FUSE_PROTO_OPCODE_READDIRPLUS:
+    case FUSE_PROTO_OPCODE_FALLOCATE:
+    case FUSE_PROTO_OPCODE_COPY_FILE_RANGE:
+        return FuseIoqDeadlineData;
+    default:
+        return FuseIoqDeadlineMeta;
+    }
+}
+
+VOID FuseIoqExpirationRoutine(FUSE_IOQ *Ioq, UINT64 InterruptTime)
+    /*
+     * Move contexts whose deadline has passed to the timeout list. They remain in the
+     * process buckets, so that a reply that arrives before they are failed is still
+     * processed normally.
+     */
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    for (ULONG I = FuseIoqDeadlineNone + 1; FuseIoqDeadlineClassCount > I; I++)
+        while (&Ioq->ProcessList[I] != Ioq->ProcessList[I].Flink)
+        {
+            FUSE_CONTEXT *Context = CONTAINING_RECORD(Ioq->ProcessList[I].Flink, FUSE_CONTEXT, ListEntry);
+            if (InterruptTime < Context->Deadline)
+                break;
+
+            RemoveEntryList(&Context->ListEntry);
+            InsertTailList(&Ioq->TimeoutList, &Context->ListEntry);
+            Context->TimedOut = 1;
+            Ioq->TimeoutCount++;
+        }
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
+
+FUSE_CONTEXT *FuseIoqNextTimedOut(FUSE_IOQ *Ioq)
+    /*
+     * Get the next timed out context. The context is removed from the Ioq and is owned
+     * by the caller, which fails it and then must return it with FuseIoqPostZombie.
+     *
+     * This is called on every transact; the deadlines are checked by the expiration
+     * routine, so that here the mutex is only taken when there are timed out contexts.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *Context = 0;
+
+    /* unlocked peek; a context timed out concurrently is found on the next transact */
+    if (&Ioq->TimeoutList == *(PLIST_ENTRY volatile *)&Ioq->TimeoutList.Flink)
+        return 0;
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    if (&Ioq->TimeoutList != Ioq->TimeoutList.Flink)
+    {
+        Context = CONTAINING_RECORD(Ioq->TimeoutList.Flink, FUSE_CONTEXT, ListEntry);
+        RemoveEntryList(&Context->ListEntry);
+        FuseIoqRemoveProcessBucket(Ioq, Context);
+    }
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+
+    return Context;
+}
+
+VOID FuseIoqPostZombie(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
+    /*
+     * Keep a failed context until its late reply arrives (or the Ioq is deleted).
+     *
+     * The FUSE unique of a request is the address of its context. Freeing the context
+     * early would let a new context at the same address receive the late reply. The
+     * context also keeps its op guard: the file system may still be carrying out the
+     * operation, so conflicting operations must wait for the late reply.
+     */
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+
+    Context->Zombie = 1;
+    InsertTailList(&Ioq->ZombieList, &Context->ListEntry);
+    FuseIoqInsertProcessBucket(Ioq, Context);
+    Ioq->ZombieCount++;
+
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
@@ -23,12 +23,41 @@
 
 VOID FusePosixPathPrefix(PSTRING Path, PSTRING Prefix, PSTRING Remain);
 VOID FusePosixPathSuffix(PSTRING Path, PSTRING Remain, PSTRING Suffix);
+BOOLEAN FusePosixPathDecodeName(PSTRING Name,
+    PWSTR WideName, ULONG WideNameSize, PULONG PWideNameLength);
+VOID FusePosixPathEncode(PSTR Path, PULONG PLength);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FusePosixPathPrefix)
 #pragma alloc_text(PAGE, FusePosixPathSuffix)
+#pragma alloc_text(PAGE, FusePosixPathDecodeName)
+#pragma alloc_text(PAGE, FusePosixPathEncode)
 #endif
 
+/*
+ * ASCII to Windows character map: '/' becomes '\\' and characters that are invalid
+ * in Windows file names are moved to the private use area (see FspPosixDecodeWindowsPath).
+ */
+static const WCHAR FusePosixPathDecodeMap[128] =
+{
+    0x0000, 0xf001, 0xf002, 0xf003, 0xf004, 0xf005, 0xf006, 0xf007,
+    0xf008, 0xf009, 0xf00a, 0xf00b, 0xf00c, 0xf00d, 0xf00e, 0xf00f,
+    0xf010, 0xf011, 0xf012, 0xf013, 0xf014, 0xf015, 0xf016, 0xf017,
+    0xf018, 0xf019, 0xf01a, 0xf01b, 0xf01c, 0xf01d, 0xf01e, 0xf01f,
+    0x0020, 0x0021, 0xf022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0xf02a, 0x002b, 0x002c, 0x002d, 0x002e, 0x005c,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0xf03a, 0x003b, 0xf03c, 0x003d, 0xf03e, 0xf03f,
+    0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005a, 0x005b, 0xf05c, 0x005d, 0x005e, 0x005f,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007a, 0x007b, 0xf07c, 0x007d, 0x007e, 0x007f,
+};
+
 VOID FusePosixPathPrefix(PSTRING Path, PSTRING Prefix, PSTRING Remain)
 {
     PAGED_CODE();
@@ -106,3 +135,130 @@ VOID FusePosixPathSuffix(PSTRING Path, PSTRING Remain, PSTRING Suffix)
     Remain->MaximumLength = Remain->Length;
     Suffix->MaximumLength = Suffix->Length;
 }
+
+BOOLEAN FusePosixPathDecodeName(PSTRING Name,
+    PWSTR WideName, ULONG WideNameSize, PULONG PWideNameLength)
+    /*
+     * Convert a POSIX (UTF-8) file name to a Windows (UTF-16) file name.
+     *
+     * This is equivalent to RtlUTF8ToUnicodeN followed by FspPosixDecodeWindowsPath,
+     * but done in a single pass. Runs of ASCII characters are detected and converted
+     * 16 bytes at a time. Invalid UTF-8 sequences are replaced by U+FFFD.
+     *
+     * Returns FALSE if the WideName buffer is too small.
+     */
+{
+    PAGED_CODE();
+
+    PUINT8 P = (PUINT8)Name->Buffer, EndP = P + Name->Length;
+    PWSTR Q = WideName, EndQ = Q + WideNameSize / sizeof(WCHAR);
+    UINT64 W0, W1;
+    UINT32 C, Min;
+    ULONG I, N;
+
+    while (EndP > P)
+    {
+        /* ASCII fast path: check 16 bytes for set high bits using two 64-bit words */
+        while (16 <= EndP - P && 16 <= EndQ - Q)
+        {
+            RtlCopyMemory(&W0, P, sizeof W0);
+            RtlCopyMemory(&W1, P + 8, sizeof W1);
+            if (0 != ((W0 | W1) & 0x8080808080808080ULL))
+                break;
+
+            for (I = 0; 16 > I; I++)
+                Q[I] = FusePosixPathDecodeMap[P[I]];
+            P += 16;
+            Q += 16;
+        }
+
+        if (EndP <= P)
+            break;
+
+        C = *P;
+        if (0x80 > C)
+        {
+            if (EndQ <= Q)
+                return FALSE;
+            *Q++ = FusePosixPathDecodeMap[C];
+            P++;
+            continue;
+        }
+
+        if (0xc2 <= C && 0xdf >= C)
+            N = 1, C &= 0x1f, Min = 0x80;
+        else if (0xe0 <= C && 0xef >= C)
+            N = 2, C &= 0x0f, Min = 0x800;
+        else if (0xf0 <= C && 0xf4 >= C)
+            N = 3, C &= 0x07, Min = 0x10000;
+        else
+            N = 0, Min = 0;
+
+        for (I = 1; N >= I && EndP - P > (LONG_PTR)I && 0x80 == (P[I] & 0xc0); I++)
+            C = (C << 6) | (P[I] & 0x3f);
+
+        if (0 == N || N + 1 != I ||
+            Min > C || 0x10ffff < C || (0xd800 <= C && 0xdfff >= C))
+        {
+            /* invalid sequence: replace its first byte and resynchronize */
+            C = 0xfffd;
+            I = 1;
+        }
+
+        if (0x10000 <= C)
+        {
+            if (2 > EndQ - Q)
+                return FALSE;
+            C -= 0x10000;
+            *Q++ = (WCHAR)(0xd800 + (C >> 10));
+            *Q++ = (WCHAR)(0xdc00 + (C & 0x3ff));
+        }
+        else
+        {
+            if (EndQ <= Q)
+                return FALSE;
+            *Q++ = (WCHAR)C;
+        }
+        P += I;
+    }
+
+    *PWideNameLength = (ULONG)((PUINT8)Q - (PUINT8)WideName);
+
+    return TRUE;
+}
+
+VOID FusePosixPathEncode(PSTR Path, PULONG PLength)
+    /*
+     * Convert a Windows path that has been converted to UTF-8 to a POSIX path in place.
+     *
+     * This is the inverse of the FusePosixPathDecodeMap: backslashes become slashes and
+     * U+F0xx characters that FusePosixPathDecodeMap produces for ASCII characters invalid
+     * on Windows become those characters again. Other private use characters (including
+     * U+F000 and U+F02F, which no ASCII character maps to) are left unchanged.
+     */
+{
+    PAGED_CODE();
+
+    PUINT8 P, Q, EndP;
+    UINT8 C;
+
+    for (P = Q = (PUINT8)Path, EndP = P + *PLength; EndP > P; P++, Q++)
+    {
+        C = *P;
+        if ('\\' == C)
+            C = '/';
+        else if (0xef == C && EndP - P >= 3 && 0x80 == (P[1] & 0xfe) && 0x80 == (P[2] & 0xc0))
+        {
+            /* U+F000 - U+F07F: EF 80 80 - EF 81 BF */
+            UINT8 D = (UINT8)(((P[1] & 0x01) << 6) | (P[2] & 0x3f));
+            if ((0xf000 | D) == FusePosixPathDecodeMap[D])
+            {
+                C = D;
+                P += 2;
+            }
+        }
+        *Q = C;
+    }
+
+    *PLength = (ULONG)(Q - (PUINT8)Path);
+}
@@ -28,6 +28,9 @@ NTSTATUS FuseProtoPostForget(PDEVICE_OBJECT DeviceObject, PLIST_ENTRY ForgetList
 static VOID FuseProtoPostForget_ContextFini(FUSE_CONTEXT *Context);
 VOID FuseProtoFillForget(FUSE_CONTEXT *Context);
 VOID FuseProtoFillBatchForget(FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostInterrupt(PDEVICE_OBJECT DeviceObject, UINT64 Unique);
+VOID FuseProtoFillInterrupt(FUSE_CONTEXT *Context);
+VOID FuseProtoUndoLateReply(FUSE_CONTEXT *Context, FUSE_PROTO_RSP *FuseResponse);
 VOID FuseProtoSendStatfs(FUSE_CONTEXT *Context);
 VOID FuseProtoSendGetattr(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFgetattr(FUSE_CONTEXT *Context);
@@ -43,6 +46,11 @@ VOID FuseProtoSendRename(FUSE_CONTEXT *Context);
 VOID FuseProtoSendCreate(FUSE_CONTEXT *Context);
 VOID FuseProtoSendOpendir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendOpen(FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostRelease(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File);
+static VOID FuseProtoPostRelease_ContextFini(FUSE_CONTEXT *Context);
+VOID FuseProtoRepostRelease(PDEVICE_OBJECT DeviceObject, FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostPrime(PDEVICE_OBJECT DeviceObject, PVOID Buffer, ULONG Length);
+static VOID FuseProtoPostPrime_ContextFini(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendRelease(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReaddir(FUSE_CONTEXT *Context);
@@ -62,6 +70,9 @@ NTSTATUS FuseNtStatusFromErrno(INT32 Errno);
 #pragma alloc_text(PAGE, FuseProtoPostForget_ContextFini)
 #pragma alloc_text(PAGE, FuseProtoFillForget)
 #pragma alloc_text(PAGE, FuseProtoFillBatchForget)
+#pragma alloc_text(PAGE, FuseProtoPostInterrupt)
+#pragma alloc_text(PAGE, FuseProtoFillInterrupt)
+#pragma alloc_text(PAGE, FuseProtoUndoLateReply)
 #pragma alloc_text(PAGE, FuseProtoSendStatfs)
 #pragma alloc_text(PAGE, FuseProtoSendGetattr)
 #pragma alloc_text(PAGE, FuseProtoSendFgetattr)
@@ -77,6 +88,11 @@ NTSTATUS FuseNtStatusFromErrno(INT32 Errno);
 #pragma alloc_text(PAGE, FuseProtoSendCreate)
 #pragma alloc_text(PAGE, FuseProtoSendOpendir)
 #pragma alloc_text(PAGE, FuseProtoSendOpen)
+#pragma alloc_text(PAGE, FuseProtoPostRelease)
+#pragma alloc_text(PAGE, FuseProtoPostRelease_ContextFini)
+#pragma alloc_text(PAGE, FuseProtoRepostRelease)
+#pragma alloc_text(PAGE, FuseProtoPostPrime)
+#pragma alloc_text(PAGE, FuseProtoPostPrime_ContextFini)
 #pragma alloc_text(PAGE, FuseProtoSendReleasedir)
 #pragma alloc_text(PAGE, FuseProtoSendRelease)
 #pragma alloc_text(PAGE, FuseProtoSendReaddir)
@@ -132,13 +148,11 @@ NTSTATUS FuseProtoPostInit(PDEVICE_OBJECT DeviceObject)
 
     FUSE_CONTEXT *Context;
 
-    FuseContextCreate(&Context, DeviceObject, 0);
+    FuseContextCreate(&Context, DeviceObject, 0, FUSE_PROTO_OPCODE_INIT);
     ASSERT(0 != Context);
     if (FuseContextIsStatus(Context))
         return FuseContextToStatus(Context);
 
-    Context->InternalResponse->Hint = FUSE_PROTO_OPCODE_INIT;
-
     FuseIoqPostPending(FuseDeviceExtension(DeviceObject)->Ioq, Context);
 
     return STATUS_SUCCESS;
@@ -158,7 +172,8 @@ VOID FuseProtoSendInit(FUSE_CONTEXT *Context)
         Context->FuseRequest->req.init.major = FUSE_PROTO_VERSION;
         Context->FuseRequest->req.init.minor = FUSE_PROTO_MINOR_VERSION;
         Context->FuseRequest->req.init.max_readahead = 0;   /* !!!: REVISIT */
-        Context->FuseRequest->req.init.flags = 0;           /* !!!: REVISIT */
+        Context->FuseRequest->req.init.flags =
+            FUSE_PROTO_INIT_NO_OPEN_SUPPORT | FUSE_PROTO_INIT_NO_OPENDIR_SUPPORT;
 
     FUSE_PROTO_SEND_END
 }
@@ -194,13 +209,16 @@ NTSTATUS FuseProtoPostForget(PDEVICE_OBJECT DeviceObject, PLIST_ENTRY ForgetList
 
     FUSE_CONTEXT *Context;
 
-    FuseContextCreate(&Context, DeviceObject, 0);
+    /* defer if congested; the cache keeps the items and retries on its next expiration */
+    if (FuseIoqIsCongested(FuseDeviceExtension(DeviceObject)->Ioq))
+        return STATUS_DEVICE_BUSY;
+
+    FuseContextCreate(&Context, DeviceObject, 0, FUSE_PROTO_OPCODE_FORGET);
     ASSERT(0 != Context);
     if (FuseContextIsStatus(Context))
         return FuseContextToStatus(Context);
 
     Context->Fini = FuseProtoPostForget_ContextFini;
-    Context->InternalResponse->Hint = FUSE_PROTO_OPCODE_FORGET;
 
     ASSERT(ForgetList != ForgetList->Flink);
     Context->Forget.ForgetList = *ForgetList;
@@ -264,6 +282,94 @@ VOID FuseProtoFillBatchForget(FUSE_CONTEXT *Context)
     Context->FuseRequest->req.batch_forget.count = (ULONG)(P - StartP);
 }
 
+NTSTATUS FuseProtoPostInterrupt(PDEVICE_OBJECT DeviceObject, UINT64 Unique)
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *Context;
+
+    FuseContextCreate(&Context, DeviceObject, 0, FUSE_PROTO_OPCODE_INTERRUPT);
+    ASSERT(0 != Context);
+    if (FuseContextIsStatus(Context))
+        return FuseContextToStatus(Context);
+
+    Context->Interrupt.Unique = Unique;
+
+    FuseIoqPostPending(FuseDeviceExtension(DeviceObject)->Ioq, Context);
+
+    return STATUS_SUCCESS;
+}
+
+VOID FuseProtoFillInterrupt(FUSE_CONTEXT *Context)
+    /*
+     * Fill INTERRUPT message. No reply is expected; one that arrives is ignored.
+     *
+     * The context is deleted as soon as the message is sent, so its address may be
+     * reused by a new context before the file system replies (e.g. with EAGAIN). As
+     * on Linux the unique is tagged with FUSE_PROTO_UNIQUE_INT_BIT, which is never set
+     * in the address of a context; FuseIoqEndProcessing drops replies to it.
+     *
+     * Context->Interrupt.Unique
+     *     unique of the request to interrupt
+     */
+{
+    PAGED_CODE();
+
+    FuseProtoInitRequest(Context,
+        FUSE_PROTO_REQ_SIZE(interrupt), FUSE_PROTO_OPCODE_INTERRUPT, 0);
+    Context->FuseRequest->unique |= FUSE_PROTO_UNIQUE_INT_BIT;
+    Context->FuseRequest->req.interrupt.unique = Context->Interrupt.Unique;
+}
+
+VOID FuseProtoUndoLateReply(FUSE_CONTEXT *Context, FUSE_PROTO_RSP *FuseResponse)
+    /*
+     * Undo a successful reply to a request that has already been failed (see FuseIoqPostZombie).
+     * No one will use what the file system has done for it, so FORGET the inode that a LOOKUP,
+     * MKNOD, MKDIR, SYMLINK, LINK or CREATE has looked up and RELEASE the handle that an OPEN,
+     * OPENDIR or CREATE has opened.
+     *
+     * Context->Opcode, Context->Nodeid, Context->OpenFlags
+     *     the request as it was sent (see FuseIoqStartProcessing)
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE *Cache = FuseDeviceExtension(Context->DeviceObject)->Cache;
+
+    if (0 != FuseResponse->error)
+        return;
+
+    switch (Context->Opcode)
+    {
+    case FUSE_PROTO_OPCODE_LOOKUP:
+    case FUSE_PROTO_OPCODE_MKNOD:
+    case FUSE_PROTO_OPCODE_MKDIR:
+    case FUSE_PROTO_OPCODE_SYMLINK:
+    case FUSE_PROTO_OPCODE_LINK:
+        /* all these replies consist of an entry */
+        if (FUSE_PROTO_RSP_SIZE(lookup) <= FuseResponse->len &&
+            0 != FuseResponse->rsp.lookup.entry.nodeid)
+            FuseCacheForgetNodeid(Cache, FuseResponse->rsp.lookup.entry.nodeid);
+        break;
+    case FUSE_PROTO_OPCODE_CREATE:
+        if (FUSE_PROTO_RSP_SIZE(create) <= FuseResponse->len)
+        {
+            FuseFileReleaseOrphan(Context->DeviceObject,
+                FuseResponse->rsp.create.entry.nodeid, FuseResponse->rsp.create.fh,
+                Context->OpenFlags, FALSE);
+            FuseCacheForgetNodeid(Cache, FuseResponse->rsp.create.entry.nodeid);
+        }
+        break;
+    case FUSE_PROTO_OPCODE_OPEN:
+    case FUSE_PROTO_OPCODE_OPENDIR:
+        if (FUSE_PROTO_RSP_SIZE(open) <= FuseResponse->len)
+            FuseFileReleaseOrphan(Context->DeviceObject,
+                Context->Nodeid, FuseResponse->rsp.open.fh,
+                Context->OpenFlags, FUSE_PROTO_OPCODE_OPENDIR == Context->Opcode);
+        break;
+    }
+}
+
 VOID FuseProtoSendStatfs(FUSE_CONTEXT *Context)
     /*
      * Send STATFS message.
@@ -687,17 +793,20 @@ VOID FuseProtoSendOpendir(FUSE_CONTEXT *Context)
      *
      * Context->Lookup.Ino
      *     inode number of directory to open
+     *
+     * If the file system answers ENOSYS, it is never sent again and the caller may open
+     * the directory without a handle (FUSE "no opendir" convention).
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_(OPENDIR)
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(open), FUSE_PROTO_OPCODE_OPENDIR, Context->Lookup.Ino);
         Context->FuseRequest->req.open.flags = Context->File->OpenFlags;
 
-    FUSE_PROTO_SEND_END
+    FUSE_PROTO_SEND_END_(OPENDIR)
 }
 
 VOID FuseProtoSendOpen(FUSE_CONTEXT *Context)
@@ -706,17 +815,156 @@ VOID FuseProtoSendOpen(FUSE_CONTEXT *Context)
      *
      * Context->Lookup.Ino
      *     inode number of file to open
+     *
+     * If the file system answers ENOSYS, it is never sent again and the caller may open
+     * the file without a handle (FUSE "no open" convention).
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_(OPEN)
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(open), FUSE_PROTO_OPCODE_OPEN, Context->Lookup.Ino);
         Context->FuseRequest->req.open.flags = Context->File->OpenFlags;
 
-    FUSE_PROTO_SEND_END
+    FUSE_PROTO_SEND_END_(OPEN)
+}
+
+NTSTATUS FuseProtoPostRelease(PDEVICE_OBJECT DeviceObject, FUSE_FILE *File)
+    /*
+     * Post RELEASE/RELEASEDIR for a file in the background. The file is deleted when
+     * the reply arrives.
+     *
+     * Files released while a background RELEASE context is still queued (and has not
+     * started sending) are added to that context, up to a limit; the context then sends
+     * one message per file.
+     *
+     * If the Ioq is congested STATUS_DEVICE_BUSY is returned and the caller is expected
+     * to send RELEASE itself; this throttles the closing thread rather than the queue.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_IOQ *Ioq = FuseDeviceExtension(DeviceObject)->Ioq;
+    FUSE_CONTEXT *Context;
+
+    ASSERT(!File->IsReparsePoint);
+    ASSERT(!File->NoOpen);
+    ASSERT(0 == File->ReleaseNext);
+
+    if (FuseIoqMergeRelease(Ioq, File))
+        return STATUS_SUCCESS;
+
+    if (FuseIoqIsCongested(Ioq))
+        return STATUS_DEVICE_BUSY;
+
+    FuseContextCreate(&Context, DeviceObject, 0, FUSE_PROTO_OPCODE_RELEASE);
+    ASSERT(0 != Context);
+    if (FuseContextIsStatus(Context))
+        return FuseContextToStatus(Context);
+
+    Context->Fini = FuseProtoPostRelease_ContextFini;
+    Context->Release.FileList = File;
+    Context->Release.FileCount = 1;
+
+    FuseIoqPostPending(Ioq, Context);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseProtoPostRelease_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FUSE_FILE *File, *NextFile;
+
+    if (0 != Context->File)
+        FuseFileDelete(Context->DeviceObject, Context->File);
+    for (File = Context->Release.FileList; 0 != File; File = NextFile)
+    {
+        NextFile = File->ReleaseNext;
+        FuseFileDelete(Context->DeviceObject, File);
+    }
+}
+
+VOID FuseProtoRepostRelease(PDEVICE_OBJECT DeviceObject, FUSE_CONTEXT *Context)
+    /*
+     * Hand the files of a failed background RELEASE context that it has not yet sent
+     * RELEASE for to a new context, so that the file system still sees their RELEASE.
+     * The file of the request in flight stays with the failed context. If no context
+     * can be created the files also stay and are deleted by the context's Fini.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *NewContext;
+
+    if (0 == Context->Release.FileList)
+        return;
+
+    FuseContextCreate(&NewContext, DeviceObject, 0, FUSE_PROTO_OPCODE_RELEASE);
+    ASSERT(0 != NewContext);
+    if (FuseContextIsStatus(NewContext))
+        return;
+
+    NewContext->Fini = FuseProtoPostRelease_ContextFini;
+    NewContext->Release.FileList = Context->Release.FileList;
+    NewContext->Release.FileCount = Context->Release.FileCount;
+    Context->Release.FileList = 0;
+
+    FuseIoqPostPending(FuseDeviceExtension(DeviceObject)->Ioq, NewContext);
+}
+
+NTSTATUS FuseProtoPostPrime(PDEVICE_OBJECT DeviceObject, PVOID Buffer, ULONG Length)
+    /*
+     * Post a background context that LOOKUP's the entries of a snapshot to warm up
+     * the entry cache; the snapshot is copied. The context takes a single background
+     * credit and sends one LOOKUP at a time, so priming yields to foreground requests.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *Context;
+    FUSE_SNAPSHOT *Snapshot;
+    NTSTATUS Result;
+
+    Result = FuseSnapshotValidate(Buffer, Length);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    FuseContextCreate(&Context, DeviceObject, 0, FUSE_CONTEXT_HINT_PRIME);
+    ASSERT(0 != Context);
+    if (FuseContextIsStatus(Context))
+        return FuseContextToStatus(Context);
+
+    Snapshot = FuseContextAlloc(Context, ((FUSE_SNAPSHOT *)Buffer)->Size);
+    if (0 == Snapshot)
+        goto fail;
+    RtlCopyMemory(Snapshot, Buffer, ((FUSE_SNAPSHOT *)Buffer)->Size);
+
+    Context->Prime.Primer = FuseContextAlloc(Context, FuseSnapshotPrimerSize(Snapshot));
+    if (0 == Context->Prime.Primer)
+        goto fail;
+    FuseSnapshotPrimerInit(Context->Prime.Primer, Snapshot);
+
+    Context->Fini = FuseProtoPostPrime_ContextFini;
+
+    FuseIoqPostPending(FuseDeviceExtension(DeviceObject)->Ioq, Context);
+
+    return STATUS_SUCCESS;
+
+fail:
+    FuseContextDelete(Context);
+    return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+static VOID FuseProtoPostPrime_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FuseCacheDereferenceGen(FuseDeviceExtension(Context->DeviceObject)->Cache, Context->Prime.CacheGen);
+        /* handles NULL gens */
 }
 
 VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context)
@@ -33,6 +33,8 @@
 
 #define FUSE_PROTO_UNKNOWN_INO          0xffffffff
 
+#define FUSE_PROTO_UNIQUE_INT_BIT       1   /* INTERRUPT requests (FUSE_INT_REQ_BIT) */
+
 enum FUSE_PROTO_OPCODE
 {
     FUSE_PROTO_OPCODE_LOOKUP            = 1,
@@ -0,0 +1,359 @@
+/**
+ * @file winfuse/security.c
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfuse/driver.h>
+
+/*
+ * Security descriptor and credential cache
+ *
+ * The descriptor cache maps POSIX permission tuples to prebuilt self-relative security
+ * descriptors:
+ *     <uid, gid, mode> -> security_descriptor
+ *
+ * A volume typically has only a handful of distinct tuples, so the descriptor cache is a
+ * small bounded list kept in LRU (least-recently-used) order. Descriptors are reference
+ * counted so that they can be used outside the cache lock and survive eviction while in use.
+ *
+ * The credential cache maps access token identities to POSIX credentials:
+ *     <authentication_id, modified_id> -> <uid, gid>
+ *
+ * The token's modified ID changes whenever the token is modified (e.g. its primary group
+ * is changed), so a stale mapping is never found. Both IDs are read from TokenStatistics
+ * into a stack buffer through a kernel handle to the token; SeQueryInformationToken would
+ * allocate a buffer on every query. The credential cache is a direct-mapped
+ * table; each slot is protected by a sequence counter, so that lookups do not take locks.
+ * Updates that race with another update on the same slot are simply dropped.
+ */
+
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PSecurityCache);
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *SecurityCache);
+NTSTATUS FuseSecurityCacheReferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor, PULONG PLength);
+VOID FuseSecurityCacheDereferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    PSECURITY_DESCRIPTOR SecurityDescriptor);
+NTSTATUS FuseSecurityCacheGetTokenCredentials(FUSE_SECURITY_CACHE *SecurityCache,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FuseSecurityCacheCreate)
+#pragma alloc_text(PAGE, FuseSecurityCacheDelete)
+#pragma alloc_text(PAGE, FuseSecurityCacheReferenceDescriptor)
+#pragma alloc_text(PAGE, FuseSecurityCacheDereferenceDescriptor)
+#pragma alloc_text(PAGE, FuseSecurityCacheGetTokenCredentials)
+#endif
+
+#define FUSE_SECURITY_CACHE_CAPACITY    64
+#define FUSE_CREDENTIALS_SLOT_COUNT     64
+
+typedef struct _FUSE_SECURITY_CACHE_ITEM FUSE_SECURITY_CACHE_ITEM;
+
+typedef struct _FUSE_CREDENTIALS_SLOT
+{
+    LONG Sequence;                      /* odd: update in progress; 0: empty */
+    LUID AuthenticationId;
+    LUID ModifiedId;
+    UINT32 Uid, Gid;
+} FUSE_CREDENTIALS_SLOT;
+
+struct _FUSE_SECURITY_CACHE
+{
+    ULONG Capacity;
+    FAST_MUTEX Mutex;
+    LIST_ENTRY ItemList;
+    ULONG ItemCount;
+    FUSE_CREDENTIALS_SLOT CredentialsSlots[FUSE_CREDENTIALS_SLOT_COUNT];
+};
+
+struct _FUSE_SECURITY_CACHE_ITEM
+{
+    LIST_ENTRY ListEntry;
+    LONG RefCount;
+    UINT32 Uid, Gid, Mode;
+    ULONG Length;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 DescriptorBuf[];
+};
+
+static inline FUSE_SECURITY_CACHE_ITEM *FuseSecurityCacheLookupItem(
+    FUSE_SECURITY_CACHE *SecurityCache, UINT32 Uid, UINT32 Gid, UINT32 Mode)
+{
+    for (PLIST_ENTRY Entry = SecurityCache->ItemList.Flink;
+        &SecurityCache->ItemList != Entry;
+        Entry = Entry->Flink)
+    {
+        FUSE_SECURITY_CACHE_ITEM *Item =
+            CONTAINING_RECORD(Entry, FUSE_SECURITY_CACHE_ITEM, ListEntry);
+        if (Item->Uid == Uid && Item->Gid == Gid && Item->Mode == Mode)
+        {
+            /* mark as most-recently used */
+            RemoveEntryList(&Item->ListEntry);
+            InsertTailList(&SecurityCache->ItemList, &Item->ListEntry);
+
+            InterlockedIncrement(&Item->RefCount);
+            return Item;
+        }
+    }
+    return 0;
+}
+
+static inline VOID FuseSecurityCacheDereferenceItem(FUSE_SECURITY_CACHE_ITEM *Item)
+{
+    if (0 == InterlockedDecrement(&Item->RefCount))
+        FuseFree(Item);
+}
+
+static inline FUSE_CREDENTIALS_SLOT *FuseSecurityCacheCredentialsSlot(
+    FUSE_SECURITY_CACHE *SecurityCache, PLUID AuthenticationId, PLUID ModifiedId)
+{
+    ULONG Hash = FuseHashMix32(
+        AuthenticationId->LowPart ^ (UINT32)AuthenticationId->HighPart ^
+        FuseHashMix32(ModifiedId->LowPart ^ (UINT32)ModifiedId->HighPart));
+    return &SecurityCache->CredentialsSlots[Hash % FUSE_CREDENTIALS_SLOT_COUNT];
+}
+
+static inline BOOLEAN FuseSecurityCacheLookupCredentials(FUSE_SECURITY_CACHE *SecurityCache,
+    PLUID AuthenticationId, PLUID ModifiedId, PUINT32 PUid, PUINT32 PGid)
+{
+    volatile FUSE_CREDENTIALS_SLOT *Slot =
+        FuseSecurityCacheCredentialsSlot(SecurityCache, AuthenticationId, ModifiedId);
+    LONG Sequence;
+    UINT32 Uid, Gid;
+    BOOLEAN Match;
+
+    Sequence = Slot->Sequence;
+    if (0 == Sequence || 0 != (Sequence & 1))
+        return FALSE;
+    KeMemoryBarrier();
+
+    Match =
+        Slot->AuthenticationId.LowPart == AuthenticationId->LowPart &&
+        Slot->AuthenticationId.HighPart == AuthenticationId->HighPart &&
+        Slot->ModifiedId.LowPart == ModifiedId->LowPart &&
+        Slot->ModifiedId.HighPart == ModifiedId->HighPart;
+    Uid = Slot->Uid;
+    Gid = Slot->Gid;
+
+    KeMemoryBarrier();
+    if (!Match || Sequence != Slot->Sequence)
+        return FALSE;
+
+    *PUid = Uid;
+    *PGid = Gid;
+    return TRUE;
+}
+
+static inline VOID FuseSecurityCacheInsertCredentials(FUSE_SECURITY_CACHE *SecurityCache,
+    PLUID AuthenticationId, PLUID ModifiedId, UINT32 Uid, UINT32 Gid)
+{
+    volatile FUSE_CREDENTIALS_SLOT *Slot =
+        FuseSecurityCacheCredentialsSlot(SecurityCache, AuthenticationId, ModifiedId);
+    LONG Sequence;
+
+    Sequence = Slot->Sequence;
+    if (0 != (Sequence & 1) ||
+        Sequence != InterlockedCompareExchange(&Slot->Sequence, Sequence | 1, Sequence))
+        return; /* concurrent update; drop ours */
+
+    Slot->AuthenticationId.LowPart = AuthenticationId->LowPart;
+    Slot->AuthenticationId.HighPart = AuthenticationId->HighPart;
+    Slot->ModifiedId.LowPart = ModifiedId->LowPart;
+    Slot->ModifiedId.HighPart = ModifiedId->HighPart;
+    Slot->Uid = Uid;
+    Slot->Gid = Gid;
+
+    Sequence = (LONG)((ULONG)Sequence + 2);
+    InterlockedExchange(&Slot->Sequence, 0 != Sequence ? Sequence : 2);
+        /* 0 is reserved for empty slots */
+}
+
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PSecurityCache)
+{
+    PAGED_CODE();
+
+    FUSE_SECURITY_CACHE *SecurityCache;
+
+    *PSecurityCache = 0;
+
+    if (0 == Capacity)
+        Capacity = FUSE_SECURITY_CACHE_CAPACITY;
+
+    SecurityCache = FuseAllocNonPaged(sizeof *SecurityCache);
+        /* FAST_MUTEX's must be in non-paged memory */
+    if (0 == SecurityCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(SecurityCache, sizeof *SecurityCache);
+    SecurityCache->Capacity = Capacity;
+    ExInitializeFastMutex(&SecurityCache->Mutex);
+    InitializeListHead(&SecurityCache->ItemList);
+
+    *PSecurityCache = SecurityCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *SecurityCache)
+{
+    PAGED_CODE();
+
+    for (PLIST_ENTRY Entry = SecurityCache->ItemList.Flink; &SecurityCache->ItemList != Entry;)
+    {
+        FUSE_SECURITY_CACHE_ITEM *Item =
+            CONTAINING_RECORD(Entry, FUSE_SECURITY_CACHE_ITEM, ListEntry);
+        Entry = Entry->Flink;
+        ASSERT(1 == Item->RefCount);
+        FuseFree(Item);
+    }
+
+    FuseFree(SecurityCache);
+}
+
+NTSTATUS FuseSecurityCacheReferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor, PULONG PLength)
+{
+    PAGED_CODE();
+
+    FUSE_SECURITY_CACHE_ITEM *Item, *NewItem = 0, *OldItem = 0;
+    PSECURITY_DESCRIPTOR SecurityDescriptor = 0;
+    ULONG Length;
+    NTSTATUS Result;
+
+    *PSecurityDescriptor = 0;
+    *PLength = 0;
+
+    ExAcquireFastMutex(&SecurityCache->Mutex);
+    Item = FuseSecurityCacheLookupItem(SecurityCache, Uid, Gid, Mode);
+    ExReleaseFastMutex(&SecurityCache->Mutex);
+
+    if (0 == Item)
+    {
+        Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, Mode, &SecurityDescriptor);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Length = RtlLengthSecurityDescriptor(SecurityDescriptor);
+        NewItem = FuseAlloc(FIELD_OFFSET(FUSE_SECURITY_CACHE_ITEM, DescriptorBuf) + Length);
+        if (0 == NewItem)
+        {
+            FuseFreeExternal(SecurityDescriptor);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(NewItem, FIELD_OFFSET(FUSE_SECURITY_CACHE_ITEM, DescriptorBuf));
+        NewItem->RefCount = 2; /* one for the cache and one for the caller */
+        NewItem->Uid = Uid;
+        NewItem->Gid = Gid;
+        NewItem->Mode = Mode;
+        NewItem->Length = Length;
+        RtlCopyMemory(NewItem->DescriptorBuf, SecurityDescriptor, Length);
+        FuseFreeExternal(SecurityDescriptor);
+
+        ExAcquireFastMutex(&SecurityCache->Mutex);
+
+        Item = FuseSecurityCacheLookupItem(SecurityCache, Uid, Gid, Mode);
+        if (0 == Item)
+        {
+            if (SecurityCache->ItemCount >= SecurityCache->Capacity)
+            {
+                /* evict least-recently used */
+                OldItem = CONTAINING_RECORD(RemoveHeadList(&SecurityCache->ItemList),
+                    FUSE_SECURITY_CACHE_ITEM, ListEntry);
+                SecurityCache->ItemCount--;
+            }
+
+            InsertTailList(&SecurityCache->ItemList, &NewItem->ListEntry);
+            SecurityCache->ItemCount++;
+
+            Item = NewItem;
+            NewItem = 0;
+        }
+
+        ExReleaseFastMutex(&SecurityCache->Mutex);
+
+        if (0 != OldItem)
+            FuseSecurityCacheDereferenceItem(OldItem);
+        if (0 != NewItem)
+            FuseFree(NewItem);
+    }
+
+    *PSecurityDescriptor = Item->DescriptorBuf;
+    *PLength = Item->Length;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FuseSecurityCacheDereferenceDescriptor(FUSE_SECURITY_CACHE *SecurityCache,
+    PSECURITY_DESCRIPTOR SecurityDescriptor)
+{
+    PAGED_CODE();
+
+    if (0 == SecurityDescriptor)
+        return;
+
+    FuseSecurityCacheDereferenceItem(
+        CONTAINING_RECORD(SecurityDescriptor, FUSE_SECURITY_CACHE_ITEM, DescriptorBuf));
+}
+
+NTSTATUS FuseSecurityCacheGetTokenCredentials(FUSE_SECURITY_CACHE *SecurityCache,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid)
+{
+    PAGED_CODE();
+
+    HANDLE TokenHandle;
+    TOKEN_STATISTICS Statistics;
+    ULONG Length;
+    UINT32 Uid, Gid;
+    NTSTATUS Result;
+
+    *PUid = 0;
+    *PGid = 0;
+
+    Result = ObOpenObjectByPointer(Token, OBJ_KERNEL_HANDLE, 0, TOKEN_QUERY,
+        *SeTokenObjectType, KernelMode, &TokenHandle);
+    if (!NT_SUCCESS(Result))
+        return Result;
+    Result = ZwQueryInformationToken(TokenHandle, TokenStatistics,
+        &Statistics, sizeof Statistics, &Length);
+    ZwClose(TokenHandle);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (!FuseSecurityCacheLookupCredentials(SecurityCache,
+        &Statistics.AuthenticationId, &Statistics.ModifiedId, &Uid, &Gid))
+    {
+        Result = FuseGetTokenUid(Token, TokenUser, &Uid);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Result = FuseGetTokenUid(Token, TokenPrimaryGroup, &Gid);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        FuseSecurityCacheInsertCredentials(SecurityCache,
+            &Statistics.AuthenticationId, &Statistics.ModifiedId, Uid, Gid);
+    }
+
+    *PUid = Uid;
+    *PGid = Gid;
+
+    return STATUS_SUCCESS;
+}
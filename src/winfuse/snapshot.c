@@ -0,0 +1,373 @@
+/**
+ * @file winfuse/snapshot.c
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfuse/driver.h>
+
+/*
+ * Entry cache snapshots
+ *
+ * A snapshot records the hot part of the entry cache, so that a file system that is
+ * remounted (e.g. after an upgrade) can warm up its new entry cache instead of starting
+ * cold. The user mode file system exports a snapshot before it unmounts, keeps it
+ * wherever it likes and hands it back after it mounts again; the driver then LOOKUP's
+ * the snapshot entries in the background (see FuseOpReserved_Prime).
+ *
+ * Inode numbers need not survive a remount, so a snapshot records (parent, name) pairs
+ * where the parent is another record; a record's parent always precedes it, so priming
+ * can resolve records in order. Only entries that have been hit while cached (and the
+ * directories leading to them) are exported; if the buffer is too small the hottest
+ * entries are kept.
+ *
+ * This file has no kernel dependencies so that it can be tested in user mode.
+ */
+
+ULONG FuseSnapshotBuild(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count,
+    PVOID Buffer, ULONG Length);
+NTSTATUS FuseSnapshotValidate(PVOID Buffer, ULONG Length);
+ULONG FuseSnapshotPrimerSize(FUSE_SNAPSHOT *Snapshot);
+VOID FuseSnapshotPrimerInit(FUSE_SNAPSHOT_PRIMER *Primer, FUSE_SNAPSHOT *Snapshot);
+BOOLEAN FuseSnapshotPrimerNext(FUSE_SNAPSHOT_PRIMER *Primer, PUINT64 PParentIno, PSTRING Name);
+VOID FuseSnapshotPrimerSetIno(FUSE_SNAPSHOT_PRIMER *Primer, UINT64 Ino);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FuseSnapshotBuild)
+#pragma alloc_text(PAGE, FuseSnapshotValidate)
+#pragma alloc_text(PAGE, FuseSnapshotPrimerSize)
+#pragma alloc_text(PAGE, FuseSnapshotPrimerInit)
+#pragma alloc_text(PAGE, FuseSnapshotPrimerNext)
+#pragma alloc_text(PAGE, FuseSnapshotPrimerSetIno)
+#endif
+
+#define FUSE_SNAPSHOT_MAX_DEPTH         256
+#define FUSE_SNAPSHOT_NONE              ((ULONG)-2)
+                                        /* parent is not in the cache */
+#define FUSE_SNAPSHOT_UNSELECTED        ((ULONG)-1)
+#define FUSE_SNAPSHOT_SELECTED          ((ULONG)-3)
+
+struct _FUSE_SNAPSHOT_PRIMER
+{
+    FUSE_SNAPSHOT *Snapshot;
+    ULONG Index, Offset;
+    ULONG Current;
+    UINT64 Inos[];                      /* resolved inode numbers; 0 if unresolved */
+};
+
+static inline BOOLEAN FuseSnapshotNameValid(PCHAR Name, ULONG Length)
+{
+    if (0 == Length || FUSE_SNAPSHOT_NAME_MAX < Length)
+        return FALSE;
+    if ('.' == Name[0] && (1 == Length || (2 == Length && '.' == Name[1])))
+        return FALSE;
+    for (ULONG I = 0; Length > I; I++)
+        if ('/' == Name[I] || '\0' == Name[I])
+            return FALSE;
+    return TRUE;
+}
+
+/*
+ * In-place heap sort: it needs no memory and no recursion and the entry counts
+ * are bounded by the cache capacity.
+ */
+typedef BOOLEAN FUSE_SNAPSHOT_LESS(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J);
+typedef VOID FUSE_SNAPSHOT_SWAP(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J);
+static VOID FuseSnapshotHeapSort(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count,
+    FUSE_SNAPSHOT_LESS *Less, FUSE_SNAPSHOT_SWAP *Swap)
+{
+    for (ULONG End = Count, Start = Count / 2;;)
+    {
+        ULONG Root, Child;
+
+        if (0 < Start)
+            Start--;
+        else if (1 < End)
+            Swap(Entries, 0, --End);
+        else
+            break;
+
+        for (Root = Start; End > (Child = 2 * Root + 1); Root = Child)
+        {
+            if (End > Child + 1 && Less(Entries, Child, Child + 1))
+                Child++;
+            if (!Less(Entries, Root, Child))
+                break;
+            Swap(Entries, Root, Child);
+        }
+    }
+}
+
+static BOOLEAN FuseSnapshotInoLess(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J)
+{
+    return Entries[I].Ino < Entries[J].Ino;
+}
+
+static VOID FuseSnapshotEntrySwap(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J)
+{
+    FUSE_SNAPSHOT_ENTRY Temp = Entries[I];
+    Entries[I] = Entries[J];
+    Entries[J] = Temp;
+}
+
+/* Order is a permutation of the entries that is stored across the entries */
+static BOOLEAN FuseSnapshotHotterLess(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J)
+{
+    /* sorts hottest first; on ties shallowest first */
+    FUSE_SNAPSHOT_ENTRY *EntryI = Entries + Entries[I].Order, *EntryJ = Entries + Entries[J].Order;
+    if (EntryI->Frequency != EntryJ->Frequency)
+        return EntryI->Frequency > EntryJ->Frequency;
+    return EntryI->Depth < EntryJ->Depth;
+}
+
+static BOOLEAN FuseSnapshotDepthLess(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J)
+{
+    return Entries[Entries[I].Order].Depth < Entries[Entries[J].Order].Depth;
+}
+
+static VOID FuseSnapshotOrderSwap(FUSE_SNAPSHOT_ENTRY *Entries, ULONG I, ULONG J)
+{
+    ULONG Temp = Entries[I].Order;
+    Entries[I].Order = Entries[J].Order;
+    Entries[J].Order = Temp;
+}
+
+static ULONG FuseSnapshotFindIno(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count, UINT64 Ino)
+{
+    ULONG Lo = 0, Hi = Count;
+    while (Lo < Hi)
+    {
+        ULONG Mid = Lo + (Hi - Lo) / 2;
+        if (Entries[Mid].Ino < Ino)
+            Lo = Mid + 1;
+        else
+            Hi = Mid;
+    }
+    return Count > Lo && Entries[Lo].Ino == Ino ? Lo : FUSE_SNAPSHOT_NONE;
+}
+
+ULONG FuseSnapshotBuild(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count,
+    PVOID Buffer, ULONG Length)
+    /*
+     * Build a snapshot from the entries of a cache into Buffer and return its size,
+     * or 0 if Buffer cannot hold even an empty snapshot. Entries is reordered.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_SNAPSHOT *Snapshot = Buffer;
+    FUSE_SNAPSHOT_RECORD *Record;
+    FUSE_SNAPSHOT_ENTRY *Entry;
+    ULONG Size, Extra, RecordCount;
+
+    if (sizeof *Snapshot > Length)
+        return 0;
+
+    /* link every entry to its parent entry */
+    FuseSnapshotHeapSort(Entries, Count, FuseSnapshotInoLess, FuseSnapshotEntrySwap);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Entry = Entries + I;
+        Entry->Parent = FUSE_PROTO_ROOT_INO == Entry->ParentIno ?
+            FUSE_SNAPSHOT_ROOT : FuseSnapshotFindIno(Entries, Count, Entry->ParentIno);
+        Entry->Index = FUSE_SNAPSHOT_UNSELECTED;
+        Entry->Order = I;
+    }
+
+    /* entries that cannot be reached from the root (or have unusable names) get depth 0 */
+    for (ULONG I = 0; Count > I; I++)
+    {
+        ULONG Depth = 0, J = I;
+        for (;;)
+        {
+            Entry = Entries + J;
+            if (0 == Entry->Ino ||
+                !FuseSnapshotNameValid(Entry->Name.Buffer, Entry->Name.Length) ||
+                FUSE_SNAPSHOT_MAX_DEPTH <= Depth)
+            {
+                Depth = 0;
+                break;
+            }
+            Depth++;
+            if (FUSE_SNAPSHOT_ROOT == Entry->Parent)
+                break;
+            if (FUSE_SNAPSHOT_NONE == Entry->Parent)
+            {
+                Depth = 0;
+                break;
+            }
+            J = Entry->Parent;
+        }
+        Entries[I].Depth = Depth;
+    }
+
+    /* select the hottest entries (and their ancestors) that fit */
+    Snapshot->Flags = 0;
+    Size = sizeof *Snapshot;
+    FuseSnapshotHeapSort(Entries, Count, FuseSnapshotHotterLess, FuseSnapshotOrderSwap);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Entry = Entries + Entries[I].Order;
+        if (0 == Entry->Frequency)
+            break;
+        if (0 == Entry->Depth)
+            continue;
+
+        Extra = 0;
+        for (ULONG J = Entries[I].Order;
+            FUSE_SNAPSHOT_ROOT != J && FUSE_SNAPSHOT_UNSELECTED == Entries[J].Index;
+            J = Entries[J].Parent)
+            Extra += FUSE_SNAPSHOT_RECORD_SIZE(Entries[J].Name.Length);
+        if (Length - Size < Extra)
+        {
+            Snapshot->Flags |= FUSE_SNAPSHOT_TRUNCATED;
+            continue;
+        }
+        Size += Extra;
+
+        for (ULONG J = Entries[I].Order;
+            FUSE_SNAPSHOT_ROOT != J && FUSE_SNAPSHOT_UNSELECTED == Entries[J].Index;
+            J = Entries[J].Parent)
+            Entries[J].Index = FUSE_SNAPSHOT_SELECTED;
+    }
+
+    /* emit the selected entries shallowest first, so that parents precede children */
+    for (ULONG I = 0; Count > I; I++)
+        Entries[I].Order = I;
+    FuseSnapshotHeapSort(Entries, Count, FuseSnapshotDepthLess, FuseSnapshotOrderSwap);
+    Record = (PVOID)(Snapshot + 1);
+    RecordCount = 0;
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Entry = Entries + Entries[I].Order;
+        if (FUSE_SNAPSHOT_SELECTED != Entry->Index)
+            continue;
+
+        Entry->Index = RecordCount++;
+        Record->Parent = FUSE_SNAPSHOT_ROOT == Entry->Parent ?
+            FUSE_SNAPSHOT_ROOT : Entries[Entry->Parent].Index;
+        Record->Frequency = Entry->Frequency;
+        Record->NameLength = Entry->Name.Length;
+        RtlCopyMemory(Record->Name, Entry->Name.Buffer, Entry->Name.Length);
+        RtlZeroMemory(Record->Name + Entry->Name.Length,
+            FUSE_SNAPSHOT_RECORD_SIZE(Entry->Name.Length) -
+                FIELD_OFFSET(FUSE_SNAPSHOT_RECORD, Name) - Entry->Name.Length);
+        Record = (PVOID)((PUINT8)Record + FUSE_SNAPSHOT_RECORD_SIZE(Entry->Name.Length));
+    }
+    ASSERT((PUINT8)Snapshot + Size == (PUINT8)Record);
+
+    Snapshot->Signature = FUSE_SNAPSHOT_SIGNATURE;
+    Snapshot->Size = Size;
+    Snapshot->Count = RecordCount;
+
+    return Size;
+}
+
+NTSTATUS FuseSnapshotValidate(PVOID Buffer, ULONG Length)
+{
+    PAGED_CODE();
+
+    FUSE_SNAPSHOT *Snapshot = Buffer;
+    FUSE_SNAPSHOT_RECORD *Record;
+    ULONG Offset;
+
+    if (sizeof *Snapshot > Length ||
+        FUSE_SNAPSHOT_SIGNATURE != Snapshot->Signature ||
+        sizeof *Snapshot > Snapshot->Size || Length < Snapshot->Size ||
+        (Snapshot->Size - sizeof *Snapshot) / FUSE_SNAPSHOT_RECORD_SIZE(1) < Snapshot->Count)
+        return STATUS_INVALID_PARAMETER;
+
+    Offset = sizeof *Snapshot;
+    for (ULONG I = 0; Snapshot->Count > I; I++)
+    {
+        Record = (PVOID)((PUINT8)Snapshot + Offset);
+        if (Snapshot->Size - Offset < FIELD_OFFSET(FUSE_SNAPSHOT_RECORD, Name) ||
+            Snapshot->Size - Offset < FUSE_SNAPSHOT_RECORD_SIZE(Record->NameLength) ||
+            (FUSE_SNAPSHOT_ROOT != Record->Parent && I <= Record->Parent) ||
+            !FuseSnapshotNameValid(Record->Name, Record->NameLength))
+            return STATUS_INVALID_PARAMETER;
+        Offset += FUSE_SNAPSHOT_RECORD_SIZE(Record->NameLength);
+    }
+    if (Snapshot->Size != Offset)
+        return STATUS_INVALID_PARAMETER;
+
+    return STATUS_SUCCESS;
+}
+
+ULONG FuseSnapshotPrimerSize(FUSE_SNAPSHOT *Snapshot)
+    /*
+     * The snapshot must have been validated.
+     */
+{
+    PAGED_CODE();
+
+    return FIELD_OFFSET(FUSE_SNAPSHOT_PRIMER, Inos) + Snapshot->Count * sizeof(UINT64);
+}
+
+VOID FuseSnapshotPrimerInit(FUSE_SNAPSHOT_PRIMER *Primer, FUSE_SNAPSHOT *Snapshot)
+{
+    PAGED_CODE();
+
+    Primer->Snapshot = Snapshot;
+    Primer->Index = 0;
+    Primer->Offset = sizeof *Snapshot;
+    Primer->Current = (ULONG)-1;
+}
+
+BOOLEAN FuseSnapshotPrimerNext(FUSE_SNAPSHOT_PRIMER *Primer, PUINT64 PParentIno, PSTRING Name)
+    /*
+     * Return the next record to LOOKUP. Records whose parent could not be resolved
+     * are skipped. The caller reports the inode number of a successful LOOKUP using
+     * FuseSnapshotPrimerSetIno.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_SNAPSHOT *Snapshot = Primer->Snapshot;
+    FUSE_SNAPSHOT_RECORD *Record;
+    UINT64 ParentIno;
+
+    while (Snapshot->Count > Primer->Index)
+    {
+        Record = (PVOID)((PUINT8)Snapshot + Primer->Offset);
+        Primer->Current = Primer->Index++;
+        Primer->Offset += FUSE_SNAPSHOT_RECORD_SIZE(Record->NameLength);
+        Primer->Inos[Primer->Current] = 0;
+
+        ParentIno = FUSE_SNAPSHOT_ROOT == Record->Parent ?
+            FUSE_PROTO_ROOT_INO : Primer->Inos[Record->Parent];
+        if (0 == ParentIno)
+            continue;
+
+        *PParentIno = ParentIno;
+        Name->Length = Name->MaximumLength = Record->NameLength;
+        Name->Buffer = Record->Name;
+        return TRUE;
+    }
+
+    Primer->Current = (ULONG)-1;
+    return FALSE;
+}
+
+VOID FuseSnapshotPrimerSetIno(FUSE_SNAPSHOT_PRIMER *Primer, UINT64 Ino)
+{
+    PAGED_CODE();
+
+    ASSERT(Primer->Snapshot->Count > Primer->Current);
+    Primer->Inos[Primer->Current] = Ino;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file winfuse/snapshot.h
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINFUSE_SNAPSHOT_H_INCLUDED
+#define WINFUSE_SNAPSHOT_H_INCLUDED
+
+/*
+ * Entry cache snapshot format
+ *
+ * A snapshot is a FUSE_SNAPSHOT header followed by Count FUSE_SNAPSHOT_RECORD's, each
+ * aligned to 4 bytes. Records do not contain inode numbers, which need not survive a
+ * remount; instead each record refers to its parent by record index and parents always
+ * precede their children.
+ */
+#define FUSE_SNAPSHOT_SIGNATURE         'PNSF'
+#define FUSE_SNAPSHOT_ROOT              ((UINT32)-1)
+                                        /* Parent of records whose parent is the root */
+#define FUSE_SNAPSHOT_TRUNCATED         0x00000001
+                                        /* some hot entries did not fit */
+#define FUSE_SNAPSHOT_NAME_MAX          255
+typedef struct _FUSE_SNAPSHOT
+{
+    UINT32 Signature;                   /* FUSE_SNAPSHOT_SIGNATURE */
+    UINT32 Size;                        /* including records */
+    UINT32 Count;                       /* number of records */
+    UINT32 Flags;                       /* FUSE_SNAPSHOT_* */
+} FUSE_SNAPSHOT;
+typedef struct _FUSE_SNAPSHOT_RECORD
+{
+    UINT32 Parent;                      /* parent record index or FUSE_SNAPSHOT_ROOT */
+    UINT32 Frequency;                   /* cache hits while the entry was cached */
+    UINT16 NameLength;
+    CHAR Name[];
+} FUSE_SNAPSHOT_RECORD;
+#define FUSE_SNAPSHOT_RECORD_SIZE(NameLength)\
+    FSP_FSCTL_ALIGN_UP(FIELD_OFFSET(FUSE_SNAPSHOT_RECORD, Name) + (NameLength), 4)
+
+/* snapshot building */
+typedef struct _FUSE_SNAPSHOT_ENTRY
+{
+    UINT64 Ino, ParentIno;
+    UINT32 Frequency;
+    STRING Name;
+    ULONG Parent, Depth, Index, Order;  /* private to FuseSnapshotBuild */
+} FUSE_SNAPSHOT_ENTRY;
+ULONG FuseSnapshotBuild(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count,
+    PVOID Buffer, ULONG Length);
+NTSTATUS FuseSnapshotValidate(PVOID Buffer, ULONG Length);
+
+/* snapshot priming */
+typedef struct _FUSE_SNAPSHOT_PRIMER FUSE_SNAPSHOT_PRIMER;
+ULONG FuseSnapshotPrimerSize(FUSE_SNAPSHOT *Snapshot);
+VOID FuseSnapshotPrimerInit(FUSE_SNAPSHOT_PRIMER *Primer, FUSE_SNAPSHOT *Snapshot);
+BOOLEAN FuseSnapshotPrimerNext(FUSE_SNAPSHOT_PRIMER *Primer, PUINT64 PParentIno, PSTRING Name);
+VOID FuseSnapshotPrimerSetIno(FUSE_SNAPSHOT_PRIMER *Primer, UINT64 Ino);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Description:
+ *     Entry cache lookup benchmark: fills an entry cache and looks entries up the way path
+ *     walks do, and reports the time and (where the CPU counters are available) the cache
+ *     misses per lookup, as well as the memory per entry. A lookup walks the hash chain of
+ *     its bucket; the fields that the walk looks at are kept in the first cache line of an
+ *     item, so each rejected candidate costs one line. Misses are looked up with names
+ *     that are cached under other parents, so they walk the whole chain. The driver's
+ *     cache.c is compiled in user mode on Linux with the kernel services it needs stubbed.
+ *
+ * Compile:
+ *     - cc -O2 -I../../src -o cachewalk cachewalk.c
+ *
+ * Run:
+ *     - ./cachewalk [ENTRIES [LOAD [LOOKUPS]]]
+ *     - ENTRIES (default 1000000) should be large enough for the items to exceed the last
+ *       level cache. LOAD is the number of items per hash bucket (default 4, the most that
+ *       a cache under the memory budget manager may have).
+ *     - Cache misses are counted with perf_event_open; they are reported as n/a if the
+ *       counters are not accessible (see /proc/sys/kernel/perf_event_paranoid).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PSTR;
+typedef uint8_t UINT8, BOOLEAN, *PBOOLEAN;
+typedef uint16_t UINT16, USHORT;
+typedef int32_t INT32, LONG, NTSTATUS;
+typedef uint32_t UINT32, ULONG, *PULONG;
+typedef int64_t INT64;
+typedef uint64_t UINT64, *PUINT64;
+typedef struct { USHORT Length, MaximumLength; PSTR Buffer; } STRING, *PSTRING;
+typedef struct _LIST_ENTRY { struct _LIST_ENTRY *Flink, *Blink; } LIST_ENTRY, *PLIST_ENTRY;
+typedef int FAST_MUTEX;
+typedef PVOID PDEVICE_OBJECT;
+#define TRUE                            1
+#define FALSE                           0
+#define PAGE_SIZE                       4096
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(Status)              (0 <= (NTSTATUS)(Status))
+#define FIELD_OFFSET(T, F)              offsetof(T, F)
+#define CONTAINING_RECORD(P, T, F)      ((T *)((char *)(P) - offsetof(T, F)))
+#define C_ASSERT(E)                     _Static_assert(E, #E)
+#define FSP_FSCTL_ALIGN_UP(X, A)        (((X) + (A) - 1) & ~((A) - 1))
+#define ASSERT(E)                       ((void)0)
+#define DEBUGTEST(P)                    TRUE
+#define PAGED_CODE()
+#define RtlCopyMemory(D, S, N)          memcpy(D, S, N)
+#define RtlZeroMemory(D, N)             memset(D, 0, N)
+#define RtlEqualMemory(D, S, N)         (0 == memcmp(D, S, N))
+#define RtlUpperChar(C)                 ((CHAR)toupper((UINT8)(C)))
+#define ExInitializeFastMutex(M)        ((void)(M))
+#define ExAcquireFastMutex(M)           ((void)(M))
+#define ExReleaseFastMutex(M)           ((void)(M))
+#define InterlockedIncrement(P)         __sync_add_and_fetch(P, 1)
+#define InterlockedDecrement(P)         __sync_sub_and_fetch(P, 1)
+#define InterlockedExchange(P, V)       __sync_lock_test_and_set(P, V)
+#define InterlockedCompareExchange(P, V, C)\
+    __sync_val_compare_and_swap(P, C, V)
+#define FuseAlloc(Size)                 malloc(Size)
+#define FuseAllocNonPaged(Size)         malloc(Size)
+#define FuseAllocMustSucceed(Size)      malloc(Size)
+#define FuseAllocCacheAlignedMustSucceed(Size)\
+    aligned_alloc(64, FSP_FSCTL_ALIGN_UP(Size, 64))
+#define FuseFree(Pointer)               free(Pointer)
+
+static inline VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+static inline BOOLEAN IsListEmpty(PLIST_ENTRY ListHead)
+{
+    return ListHead->Flink == ListHead;
+}
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = Entry->Flink, Blink = Entry->Blink;
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return Flink == Blink;
+}
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+    RemoveEntryList(Entry);
+    return Entry;
+}
+static inline VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+static inline VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static UINT64 KeQueryInterruptTime(VOID)
+{
+    /* like KeQueryInterruptTime a coarse clock is a memory read, not a clock source read */
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &Ts);
+    return (UINT64)Ts.tv_sec * 10000000 + Ts.tv_nsec / 100;
+}
+
+#define WINFUSE_DRIVER_H_INCLUDED
+#include <winfuse/snapshot.h>
+
+/* must match src/winfuse/proto.h (which needs the MSVC extensions to compile) */
+#define FUSE_PROTO_ROOT_INO             1
+typedef struct
+{
+    UINT64 ino;
+    UINT64 size;
+    UINT64 blocks;
+    UINT64 atime;
+    UINT64 mtime;
+    UINT64 ctime;
+    UINT32 atimensec;
+    UINT32 mtimensec;
+    UINT32 ctimensec;
+    UINT32 mode;
+    UINT32 nlink;
+    UINT32 uid;
+    UINT32 gid;
+    UINT32 rdev;
+    UINT32 blksize;
+    UINT32 padding;
+} FUSE_PROTO_ATTR;
+typedef struct
+{
+    UINT64 nodeid;
+    UINT64 generation;
+    UINT64 entry_valid;
+    UINT64 attr_valid;
+    UINT32 entry_valid_nsec;
+    UINT32 attr_valid_nsec;
+    FUSE_PROTO_ATTR attr;
+} FUSE_PROTO_ENTRY;
+typedef struct
+{
+    UINT64 nodeid;
+    UINT64 nlookup;
+} FUSE_PROTO_FORGET_ONE;
+
+/* must match src/winfuse/driver.h */
+#define FUSE_STATS_OPCODE_COUNT         64
+typedef struct _FUSE_STATS
+{
+    UINT32 Size;
+    UINT32 MaxBackground;
+    UINT32 CongestionThreshold;
+    UINT32 BackgroundActive;
+    UINT32 BackgroundQueued;
+    UINT32 Flags;
+    UINT32 TimeoutCount;
+    UINT32 ZombieCount;
+    UINT64 ContextMemory;
+    UINT64 ContextMemoryPeak;
+    UINT64 ContextMemoryBudget;
+    UINT64 ContextMemoryRefused;
+    UINT32 CacheCapacity;
+    UINT32 CacheItemCount;
+    UINT64 CacheMemory;
+    UINT64 CacheLookups;
+    UINT64 CacheHits;
+    UINT64 RequestCount[FUSE_STATS_OPCODE_COUNT];
+} FUSE_STATS;
+typedef struct _FUSE_CACHE FUSE_CACHE;
+static inline UINT64 FuseHashMix64(UINT64 k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* the benchmark does not forget or export entries */
+typedef struct _FUSE_EPOCH { int Dummy; } FUSE_EPOCH;
+static NTSTATUS FuseEpochCreate(FUSE_EPOCH **PEpoch)
+{
+    *PEpoch = malloc(sizeof **PEpoch);
+    return 0 != *PEpoch ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+static VOID FuseEpochDelete(FUSE_EPOCH *Epoch)
+{
+    free(Epoch);
+}
+static PVOID FuseEpochEnter(FUSE_EPOCH *Epoch)
+{
+    return Epoch;
+}
+static VOID FuseEpochLeave(FUSE_EPOCH *Epoch, PVOID Slot)
+{
+}
+static UINT64 FuseEpochAdvance(FUSE_EPOCH *Epoch, UINT64 InterruptTime)
+{
+    return (UINT64)-1LL;
+}
+static NTSTATUS FuseProtoPostForget(PDEVICE_OBJECT DeviceObject, PLIST_ENTRY ForgetList)
+{
+    return STATUS_INSUFFICIENT_RESOURCES;
+}
+ULONG FuseSnapshotBuild(FUSE_SNAPSHOT_ENTRY *Entries, ULONG Count,
+    PVOID Buffer, ULONG Length)
+{
+    return 0;
+}
+
+#include <winfuse/cache.c>
+
+/*
+ * Names are drawn from a few hundred names that recur in every directory (as in a source
+ * tree), so that most of them are interned and shared.
+ */
+#define NAME_COUNT                      256
+#define ENTRIES_PER_DIR                 16
+
+static char Names[NAME_COUNT][32];
+
+static VOID MakeName(ULONG Index, STRING *Name)
+{
+    Name->Buffer = Names[Index % NAME_COUNT];
+    Name->Length = Name->MaximumLength = (USHORT)strlen(Name->Buffer);
+}
+
+static ULONG Random(UINT64 *State)
+{
+    /* xorshift64* */
+    *State ^= *State >> 12;
+    *State ^= *State << 25;
+    *State ^= *State >> 27;
+    return (ULONG)((*State * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static int PerfOpen(VOID)
+{
+    struct perf_event_attr Attr;
+
+    memset(&Attr, 0, sizeof Attr);
+    Attr.size = sizeof Attr;
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    Attr.disabled = 1;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+}
+
+static double Now(VOID)
+{
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static VOID Run(const char *Label, FUSE_CACHE *Cache, int Perf,
+    ULONG EntryCount, ULONG LookupCount, UINT64 InoOffset, BOOLEAN ExpectHit)
+{
+    FUSE_PROTO_ENTRY Entry;
+    PVOID Item;
+    BOOLEAN TimesStale;
+    STRING Name;
+    UINT64 State = 0x9e3779b97f4a7c15ULL, Misses = 0;
+    ULONG Found = 0, Index;
+    double Start, Elapsed;
+
+    if (0 <= Perf)
+    {
+        ioctl(Perf, PERF_EVENT_IOC_RESET, 0);
+        ioctl(Perf, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    Start = Now();
+    for (ULONG I = 0; LookupCount > I; I++)
+    {
+        Index = Random(&State) % EntryCount;
+        MakeName(Index, &Name);
+        Found += FuseCacheGetEntry(Cache, InoOffset + Index / ENTRIES_PER_DIR, &Name,
+            &Entry, &Item, &TimesStale);
+    }
+    Elapsed = Now() - Start;
+    if (0 <= Perf)
+    {
+        ioctl(Perf, PERF_EVENT_IOC_DISABLE, 0);
+        if (sizeof Misses != read(Perf, &Misses, sizeof Misses))
+            Perf = -1;
+    }
+
+    if (0 <= Perf)
+        printf("%-6s %8.1f ns/lookup %8.2f cache misses/lookup\n",
+            Label, Elapsed * 1e9 / LookupCount, (double)Misses / LookupCount);
+    else
+        printf("%-6s %8.1f ns/lookup      n/a cache misses/lookup\n",
+            Label, Elapsed * 1e9 / LookupCount);
+    if ((ExpectHit ? LookupCount : 0) != Found)
+        printf("%-6s unexpected: %lu of %lu lookups found an entry\n",
+            Label, (unsigned long)Found, (unsigned long)LookupCount);
+}
+
+int main(int argc, char *argv[])
+{
+    FUSE_CACHE *Cache;
+    FUSE_PROTO_ENTRY Entry;
+    FUSE_STATS Stats;
+    PVOID Item;
+    STRING Name;
+    ULONG EntryCount, Load, LookupCount, BucketCount, UsedBuckets = 0;
+    int Perf;
+
+    EntryCount = 2 <= argc ? (ULONG)strtoul(argv[1], 0, 10) : 1000000;
+    Load = 3 <= argc ? (ULONG)strtoul(argv[2], 0, 10) : 4;
+    LookupCount = 4 <= argc ? (ULONG)strtoul(argv[3], 0, 10) : 10000000;
+    if (0 == EntryCount || 0 == Load || 0 == LookupCount)
+    {
+        fprintf(stderr, "usage: cachewalk [ENTRIES [LOAD [LOOKUPS]]]\n");
+        return 2;
+    }
+
+    for (ULONG I = 0; NAME_COUNT > I; I++)
+        snprintf(Names[I], sizeof Names[I], "%s%lu.%s",
+            0 == I % 3 ? "include" : 1 == I % 3 ? "src" : "Makefile",
+            (unsigned long)I, 0 == I % 2 ? "h" : "c");
+
+    if (!NT_SUCCESS(FuseCacheCreate(EntryCount, FALSE, &Cache)))
+        return 1;
+
+    /* a fixed capacity cache has 4/3 buckets per item; raise the load to LOAD */
+    BucketCount = (EntryCount + Load - 1) / Load;
+    if (Cache->ItemBucketCount > BucketCount)
+        Cache->ItemBucketCount = BucketCount;
+
+    memset(&Entry, 0, sizeof Entry);
+    Entry.entry_valid = Entry.attr_valid = 3600;
+    for (ULONG I = 0; EntryCount > I; I++)
+    {
+        MakeName(I, &Name);
+        Entry.nodeid = Entry.attr.ino = 1000000000ULL + I;
+        FuseCacheSetEntry(Cache, 2 + I / ENTRIES_PER_DIR, &Name, &Entry, &Item);
+    }
+
+    for (ULONG I = 0; Cache->ItemBucketCount > I; I++)
+        UsedBuckets += 0 != Cache->ItemBuckets[I];
+
+    memset(&Stats, 0, sizeof Stats);
+    FuseCacheQueryStats(Cache, &Stats);
+    printf("%lu entries, %lu buckets, %.2f items per used bucket\n",
+        (unsigned long)Stats.CacheItemCount, (unsigned long)Cache->ItemBucketCount,
+        (double)Stats.CacheItemCount / UsedBuckets);
+    printf("item %lu bytes (hash chain fields in the first %lu), "
+        "%.1f bytes of memory per entry\n",
+        (unsigned long)sizeof(FUSE_CACHE_ITEM),
+        (unsigned long)FIELD_OFFSET(FUSE_CACHE_ITEM, ListEntry),
+        (double)Stats.CacheMemory / Stats.CacheItemCount);
+
+    Perf = PerfOpen();
+    Run("hit", Cache, Perf, EntryCount, LookupCount, 2, TRUE);
+    Run("miss", Cache, Perf, EntryCount, LookupCount, 2 + EntryCount, FALSE);
+    if (0 <= Perf)
+        close(Perf);
+
+    FuseCacheDelete(Cache);
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Description:
+ *     Directory listing benchmark: enumerates a large directory and reports how many READDIR
+ *     round trips to the file system the enumeration cost. WinFuse keeps the undelivered tail
+ *     of a READDIR reply on the directory handle (the enumeration cursor), so consecutive
+ *     QueryDirectory calls drain it instead of fetching the same entries again. The message
+ *     counts are obtained from the driver with FUSE_IOCTL_QUERY_STATS before and after each
+ *     enumeration.
+ *
+ * Compile:
+ *     - cl dirlist.c
+ *
+ * Run:
+ *     - dirlist.exe DIRECTORY [FILECOUNT [ITERATIONS]]
+ *     - The files dirlist-N are created in DIRECTORY (on a WinFuse volume) if missing.
+ *     - Compare the reported entries per READDIR with the size of a READDIR reply of the
+ *       file system; without a cursor it is roughly the number of entries that fit the
+ *       QueryDirectory buffer instead.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* must match src/winfuse/driver.h */
+#define FUSE_IOCTL_QUERY_STATS          \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'S', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FUSE_STATS_OPCODE_COUNT         64
+typedef struct _FUSE_STATS
+{
+    UINT32 Size;
+    UINT32 MaxBackground;
+    UINT32 CongestionThreshold;
+    UINT32 BackgroundActive;
+    UINT32 BackgroundQueued;
+    UINT32 Flags;
+    UINT32 TimeoutCount;
+    UINT32 ZombieCount;
+    UINT64 ContextMemory;
+    UINT64 ContextMemoryPeak;
+    UINT64 ContextMemoryBudget;
+    UINT64 ContextMemoryRefused;
+    UINT32 CacheCapacity;
+    UINT32 CacheItemCount;
+    UINT64 CacheMemory;
+    UINT64 CacheLookups;
+    UINT64 CacheHits;
+    UINT64 RequestCount[FUSE_STATS_OPCODE_COUNT];
+} FUSE_STATS;
+#define FUSE_PROTO_OPCODE_LOOKUP        1
+#define FUSE_PROTO_OPCODE_GETATTR       3
+#define FUSE_PROTO_OPCODE_OPENDIR       27
+#define FUSE_PROTO_OPCODE_READDIR       28
+
+static int QueryStats(HANDLE Handle, FUSE_STATS *Stats)
+{
+    DWORD BytesTransferred;
+
+    memset(Stats, 0, sizeof *Stats);
+    return DeviceIoControl(Handle, FUSE_IOCTL_QUERY_STATS,
+        0, 0, Stats, sizeof *Stats, &BytesTransferred, 0) &&
+        sizeof *Stats <= BytesTransferred;
+}
+
+static int CreateFiles(const wchar_t *Directory, unsigned FileCount)
+{
+    wchar_t Path[MAX_PATH];
+    HANDLE Handle;
+
+    for (unsigned I = 0; FileCount > I; I++)
+    {
+        _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\dirlist-%u", Directory, I);
+        Handle = CreateFileW(
+            Path,
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            0,
+            CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL,
+            0);
+        if (INVALID_HANDLE_VALUE == Handle)
+        {
+            if (ERROR_FILE_EXISTS == GetLastError())
+                continue;
+            return 0;
+        }
+        CloseHandle(Handle);
+    }
+
+    return 1;
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    wchar_t Pattern[MAX_PATH];
+    WIN32_FIND_DATAW FindData;
+    HANDLE Handle, FindHandle;
+    FUSE_STATS Before, After;
+    LARGE_INTEGER Frequency, Start, Now;
+    unsigned FileCount, Iterations;
+    unsigned long long Entries = 0, Readdirs = 0, Opendirs = 0, Lookups = 0;
+
+    if (2 > argc)
+    {
+        fwprintf(stderr, L"usage: dirlist DIRECTORY [FILECOUNT [ITERATIONS]]\n");
+        return 2;
+    }
+    FileCount = 3 <= argc ? wcstoul(argv[2], 0, 10) : 10000;
+    Iterations = 4 <= argc ? wcstoul(argv[3], 0, 10) : 10;
+    if (0 == Iterations)
+        return 2;
+
+    if (!CreateFiles(argv[1], FileCount))
+    {
+        fwprintf(stderr, L"cannot create files: error %lu\n", GetLastError());
+        return 1;
+    }
+
+    Handle = CreateFileW(
+        argv[1],
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        0,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        0);
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+        fwprintf(stderr, L"cannot open %s: error %lu\n", argv[1], GetLastError());
+        return 1;
+    }
+    if (!QueryStats(Handle, &Before))
+    {
+        fwprintf(stderr, L"cannot query stats: error %lu (not a WinFuse volume?)\n",
+            GetLastError());
+        return 1;
+    }
+
+    _snwprintf_s(Pattern, MAX_PATH, _TRUNCATE, L"%s\\*", argv[1]);
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (unsigned J = 0; Iterations > J; J++)
+    {
+        FindHandle = FindFirstFileW(Pattern, &FindData);
+        if (INVALID_HANDLE_VALUE == FindHandle)
+        {
+            fwprintf(stderr, L"cannot list %s: error %lu\n", argv[1], GetLastError());
+            return 1;
+        }
+        do
+            Entries++;
+        while (FindNextFileW(FindHandle, &FindData));
+        FindClose(FindHandle);
+    }
+    QueryPerformanceCounter(&Now);
+
+    if (!QueryStats(Handle, &After))
+    {
+        fwprintf(stderr, L"cannot query stats: error %lu\n", GetLastError());
+        return 1;
+    }
+    CloseHandle(Handle);
+
+    Readdirs = After.RequestCount[FUSE_PROTO_OPCODE_READDIR] -
+        Before.RequestCount[FUSE_PROTO_OPCODE_READDIR];
+    Opendirs = After.RequestCount[FUSE_PROTO_OPCODE_OPENDIR] -
+        Before.RequestCount[FUSE_PROTO_OPCODE_OPENDIR];
+    Lookups = After.RequestCount[FUSE_PROTO_OPCODE_LOOKUP] -
+        Before.RequestCount[FUSE_PROTO_OPCODE_LOOKUP] +
+        After.RequestCount[FUSE_PROTO_OPCODE_GETATTR] -
+        Before.RequestCount[FUSE_PROTO_OPCODE_GETATTR];
+
+    wprintf(L"%llu entries in %u listings, %.0f entries/sec\n",
+        Entries, Iterations,
+        (double)Entries * Frequency.QuadPart / (double)(Now.QuadPart - Start.QuadPart));
+    wprintf(L"%llu READDIR, %llu OPENDIR, %llu LOOKUP/GETATTR\n",
+        Readdirs, Opendirs, Lookups);
+    wprintf(L"%.1f entries per READDIR round trip\n",
+        0 != Readdirs ? (double)Entries / (double)Readdirs : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Description:
+ *     Header churn benchmark: repeatedly opens, reads and closes a small set of files, the
+ *     way a compiler opens the same headers over and over during a build. Every cycle costs
+ *     OPEN and RELEASE round trips to the file system, unless the WinFuse handle cache (the
+ *     HandleCacheTimeout driver parameter) lets a reopen reuse the handle of a recent close.
+ *
+ * Compile:
+ *     - cl hdrchurn.c
+ *
+ * Run:
+ *     - hdrchurn.exe DIRECTORY [FILECOUNT [SECONDS]]
+ *     - The files hdrchurn-N.h are created in DIRECTORY (on a WinFuse volume) if missing.
+ *     - Compare the reported opens/sec with HandleCacheTimeout set to 0 and to e.g. 1000
+ *       (a REG_DWORD under the driver's service Parameters key; restart the driver).
+ *       The file system must set KEEP_CACHE on OPEN for handles to be reused.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int CreateHeaders(const wchar_t *Directory, unsigned FileCount)
+{
+    static const char Content[] =
+        "#pragma once\n"
+        "/* hdrchurn benchmark header */\n"
+        "#define HDRCHURN_VALUE 1\n";
+    wchar_t Path[MAX_PATH];
+    HANDLE Handle;
+    DWORD BytesTransferred;
+
+    for (unsigned I = 0; FileCount > I; I++)
+    {
+        _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\hdrchurn-%u.h", Directory, I);
+        Handle = CreateFileW(
+            Path,
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            0,
+            CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL,
+            0);
+        if (INVALID_HANDLE_VALUE == Handle)
+        {
+            if (ERROR_FILE_EXISTS == GetLastError())
+                continue;
+            return 0;
+        }
+        if (!WriteFile(Handle, Content, sizeof Content - 1, &BytesTransferred, 0))
+        {
+            CloseHandle(Handle);
+            return 0;
+        }
+        CloseHandle(Handle);
+    }
+
+    return 1;
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    wchar_t Path[MAX_PATH];
+    char Buffer[4096];
+    HANDLE Handle;
+    DWORD BytesTransferred;
+    LARGE_INTEGER Frequency, Start, Now;
+    unsigned FileCount, Seconds;
+    unsigned long long Opens = 0;
+
+    if (2 > argc)
+    {
+        fwprintf(stderr, L"usage: hdrchurn DIRECTORY [FILECOUNT [SECONDS]]\n");
+        return 2;
+    }
+    FileCount = 3 <= argc ? wcstoul(argv[2], 0, 10) : 64;
+    Seconds = 4 <= argc ? wcstoul(argv[3], 0, 10) : 10;
+    if (0 == FileCount || 0 == Seconds)
+        return 2;
+
+    if (!CreateHeaders(argv[1], FileCount))
+    {
+        fwprintf(stderr, L"cannot create headers: error %lu\n", GetLastError());
+        return 1;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    do
+    {
+        for (unsigned I = 0; FileCount > I; I++)
+        {
+            _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\hdrchurn-%u.h", argv[1], I);
+            Handle = CreateFileW(
+                Path,
+                GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                0,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                0);
+            if (INVALID_HANDLE_VALUE == Handle)
+            {
+                fwprintf(stderr, L"cannot open %s: error %lu\n", Path, GetLastError());
+                return 1;
+            }
+            while (ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0) &&
+                0 != BytesTransferred)
+                ;
+            CloseHandle(Handle);
+        }
+        Opens += FileCount;
+        QueryPerformanceCounter(&Now);
+    } while ((unsigned long long)(Now.QuadPart - Start.QuadPart) <
+        (unsigned long long)Seconds * Frequency.QuadPart);
+
+    wprintf(L"%llu opens in %u files, %.0f opens/sec\n",
+        Opens, FileCount,
+        (double)Opens * Frequency.QuadPart / (double)(Now.QuadPart - Start.QuadPart));
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Description:
+ *     File name decoding benchmark: converts a list of POSIX (UTF-8) file names to Windows
+ *     (UTF-16) file names, the way READDIR replies are converted for directory listings.
+ *     It compares FusePosixPathDecodeName, which does the conversion and the mapping of
+ *     characters invalid on Windows in a single pass, with the two-pass conversion it
+ *     replaced: RtlUTF8ToUnicodeN followed by FspPosixDecodeWindowsPath. Both passes are
+ *     reimplemented here, so that the benchmark builds in user mode on Linux.
+ *
+ * Compile:
+ *     - cc -O2 -I../../src -o namedec namedec.c
+ *
+ * Run:
+ *     - find /usr -printf '%f\n' > names.txt
+ *     - ./namedec names.txt [ITERATIONS]
+ *     - The outputs of the two conversions are compared; any difference is reported and
+ *       the program fails.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef void VOID;
+typedef int BOOLEAN;
+typedef char *PSTR;
+typedef uint8_t UINT8, *PUINT8;
+typedef uint16_t USHORT, WCHAR, *PWSTR;
+typedef uint32_t UINT32, ULONG, *PULONG;
+typedef uint64_t UINT64;
+typedef intptr_t LONG_PTR;
+typedef struct { USHORT Length, MaximumLength; PSTR Buffer; } STRING, *PSTRING;
+#define TRUE                            1
+#define FALSE                           0
+#define RtlCopyMemory(D, S, N)          memcpy(D, S, N)
+
+#define WINFUSE_DRIVER_H_INCLUDED
+#define PAGED_CODE()
+#include <winfuse/path.c>
+
+static BOOLEAN Utf8ToUtf16(PSTRING Name,
+    PWSTR WideName, ULONG WideNameSize, PULONG PWideNameLength)
+{
+    /* first pass: RtlUTF8ToUnicodeN */
+    PUINT8 P = (PUINT8)Name->Buffer, EndP = P + Name->Length;
+    PWSTR Q = WideName, EndQ = Q + WideNameSize / sizeof(WCHAR);
+    UINT32 C, Min;
+    ULONG I, N;
+
+    while (EndP > P)
+    {
+        C = *P;
+        if (0x80 > C)
+            N = 0, Min = 0;
+        else if (0xc2 <= C && 0xdf >= C)
+            N = 1, C &= 0x1f, Min = 0x80;
+        else if (0xe0 <= C && 0xef >= C)
+            N = 2, C &= 0x0f, Min = 0x800;
+        else if (0xf0 <= C && 0xf4 >= C)
+            N = 3, C &= 0x07, Min = 0x10000;
+        else
+            N = (ULONG)-1, Min = 0;
+
+        for (I = 1; (ULONG)-1 != N && N >= I && EndP - P > (LONG_PTR)I && 0x80 == (P[I] & 0xc0); I++)
+            C = (C << 6) | (P[I] & 0x3f);
+
+        if ((ULONG)-1 == N || N + 1 != I ||
+            Min > C || 0x10ffff < C || (0xd800 <= C && 0xdfff >= C))
+        {
+            C = 0xfffd;
+            I = 1;
+        }
+
+        if (0x10000 <= C)
+        {
+            if (2 > EndQ - Q)
+                return FALSE;
+            C -= 0x10000;
+            *Q++ = (WCHAR)(0xd800 + (C >> 10));
+            *Q++ = (WCHAR)(0xdc00 + (C & 0x3ff));
+        }
+        else
+        {
+            if (EndQ <= Q)
+                return FALSE;
+            *Q++ = (WCHAR)C;
+        }
+        P += I;
+    }
+
+    *PWideNameLength = (ULONG)((PUINT8)Q - (PUINT8)WideName);
+
+    return TRUE;
+}
+
+static VOID DecodeWindowsPath(PWSTR WideName, ULONG WideNameLength)
+{
+    /* second pass: FspPosixDecodeWindowsPath */
+    for (PWSTR P = WideName, EndP = P + WideNameLength / sizeof(WCHAR); EndP > P; P++)
+        if (128 > *P)
+            *P = FusePosixPathDecodeMap[*P];
+}
+
+static BOOLEAN TwoPassDecodeName(PSTRING Name,
+    PWSTR WideName, ULONG WideNameSize, PULONG PWideNameLength)
+{
+    if (!Utf8ToUtf16(Name, WideName, WideNameSize, PWideNameLength))
+        return FALSE;
+    DecodeWindowsPath(WideName, *PWideNameLength);
+    return TRUE;
+}
+
+static double Now(void)
+{
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static double Run(const char *Label,
+    BOOLEAN (*DecodeName)(PSTRING, PWSTR, ULONG, PULONG),
+    STRING *Names, size_t NameCount, size_t Bytes, unsigned Iterations)
+{
+    WCHAR WideName[255 * 2];
+    ULONG WideNameLength;
+    UINT64 Checksum = 0;
+    double Start, Elapsed;
+
+    Start = Now();
+    for (unsigned J = 0; Iterations > J; J++)
+        for (size_t I = 0; NameCount > I; I++)
+        {
+            DecodeName(&Names[I], WideName, sizeof WideName, &WideNameLength);
+            Checksum += WideNameLength + WideName[0];
+        }
+    Elapsed = Now() - Start;
+
+    printf("%-10s %8.2f ns/name %8.1f MB/s (checksum %llu)\n",
+        Label,
+        Elapsed * 1e9 / ((double)NameCount * Iterations),
+        (double)Bytes * Iterations / Elapsed / 1e6,
+        (unsigned long long)Checksum);
+
+    return Elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *File;
+    char Line[4096];
+    STRING *Names = 0;
+    size_t NameCount = 0, NameCapacity = 0, Bytes = 0, Mismatches = 0;
+    unsigned Iterations;
+    double OnePass, TwoPass;
+
+    if (2 > argc)
+    {
+        fprintf(stderr, "usage: namedec NAMEFILE [ITERATIONS]\n");
+        return 2;
+    }
+    Iterations = 3 <= argc ? (unsigned)strtoul(argv[2], 0, 10) : 100;
+    if (0 == Iterations)
+        return 2;
+
+    File = fopen(argv[1], "rb");
+    if (0 == File)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    while (0 != fgets(Line, sizeof Line, File))
+    {
+        size_t Length = strcspn(Line, "\n");
+        if (0 == Length || 255 < Length)
+            continue;
+        if (NameCapacity <= NameCount)
+        {
+            NameCapacity = 0 == NameCapacity ? 1024 : NameCapacity * 2;
+            Names = realloc(Names, NameCapacity * sizeof *Names);
+            if (0 == Names)
+                return 1;
+        }
+        Names[NameCount].Buffer = malloc(Length);
+        if (0 == Names[NameCount].Buffer)
+            return 1;
+        memcpy(Names[NameCount].Buffer, Line, Length);
+        Names[NameCount].Length = Names[NameCount].MaximumLength = (USHORT)Length;
+        NameCount++;
+        Bytes += Length;
+    }
+    fclose(File);
+
+    if (0 == NameCount)
+    {
+        fprintf(stderr, "%s: no names\n", argv[1]);
+        return 1;
+    }
+
+    for (size_t I = 0; NameCount > I; I++)
+    {
+        WCHAR WideName1[255 * 2], WideName2[255 * 2];
+        ULONG WideNameLength1, WideNameLength2;
+
+        FusePosixPathDecodeName(&Names[I], WideName1, sizeof WideName1, &WideNameLength1);
+        TwoPassDecodeName(&Names[I], WideName2, sizeof WideName2, &WideNameLength2);
+        if (WideNameLength1 != WideNameLength2 ||
+            0 != memcmp(WideName1, WideName2, WideNameLength1))
+        {
+            if (10 > Mismatches)
+                fprintf(stderr, "mismatch: %.*s\n", Names[I].Length, Names[I].Buffer);
+            Mismatches++;
+        }
+    }
+
+    printf("%zu names, %zu bytes, %u iterations\n", NameCount, Bytes, Iterations);
+    OnePass = Run("one-pass", FusePosixPathDecodeName, Names, NameCount, Bytes, Iterations);
+    TwoPass = Run("two-pass", TwoPassDecodeName, Names, NameCount, Bytes, Iterations);
+    printf("speedup    %8.2fx\n", TwoPass / OnePass);
+
+    for (size_t I = 0; NameCount > I; I++)
+        free(Names[I].Buffer);
+    free(Names);
+
+    return 0 == Mismatches ? 0 : 1;
+}
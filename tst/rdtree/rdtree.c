@@ -0,0 +1,221 @@
+/*
+ * Description:
+ *     Recursive delete benchmark: creates a directory tree and deletes it the way "rd /s"
+ *     does (enumerate a directory, delete its files, recurse into its subdirectories, then
+ *     remove it), and reports the round trips to the file system that the delete cost.
+ *     Marking a directory for deletion requires it to be empty; WinFuse answers this from
+ *     the child count of the enumeration that preceded it instead of sending a READDIR.
+ *     The message counts are obtained from the driver with FUSE_IOCTL_QUERY_STATS.
+ *
+ * Compile:
+ *     - cl rdtree.c
+ *
+ * Run:
+ *     - rdtree.exe DIRECTORY [DEPTH]
+ *     - The tree rdtree is created in DIRECTORY (on a WinFuse volume) and then deleted.
+ *       Every directory has 9 files and, above DEPTH (default 4), 10 subdirectories; a
+ *       DEPTH of 4 makes 11111 directories and 99999 files.
+ *     - Compare the reported READDIR per directory; without the child count each directory
+ *       costs one READDIR more than its enumeration needs.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FILES_PER_DIR                   9
+#define DIRS_PER_DIR                    10
+
+/* must match src/winfuse/driver.h */
+#define FUSE_IOCTL_QUERY_STATS          \
+    CTL_CODE(0x8000 + 'F', 0x800 + 'S', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FUSE_STATS_OPCODE_COUNT         64
+typedef struct _FUSE_STATS
+{
+    UINT32 Size;
+    UINT32 MaxBackground;
+    UINT32 CongestionThreshold;
+    UINT32 BackgroundActive;
+    UINT32 BackgroundQueued;
+    UINT32 Flags;
+    UINT32 TimeoutCount;
+    UINT32 ZombieCount;
+    UINT64 ContextMemory;
+    UINT64 ContextMemoryPeak;
+    UINT64 ContextMemoryBudget;
+    UINT64 ContextMemoryRefused;
+    UINT32 CacheCapacity;
+    UINT32 CacheItemCount;
+    UINT64 CacheMemory;
+    UINT64 CacheLookups;
+    UINT64 CacheHits;
+    UINT64 RequestCount[FUSE_STATS_OPCODE_COUNT];
+} FUSE_STATS;
+#define FUSE_PROTO_OPCODE_LOOKUP        1
+#define FUSE_PROTO_OPCODE_UNLINK        10
+#define FUSE_PROTO_OPCODE_RMDIR         11
+#define FUSE_PROTO_OPCODE_READDIR       28
+
+static unsigned long long DirCount, FileCount;
+
+static int QueryStats(HANDLE Handle, FUSE_STATS *Stats)
+{
+    DWORD BytesTransferred;
+
+    memset(Stats, 0, sizeof *Stats);
+    return DeviceIoControl(Handle, FUSE_IOCTL_QUERY_STATS,
+        0, 0, Stats, sizeof *Stats, &BytesTransferred, 0) &&
+        sizeof *Stats <= BytesTransferred;
+}
+
+static int CreateTree(const wchar_t *Directory, unsigned Depth)
+{
+    wchar_t Path[MAX_PATH];
+    HANDLE Handle;
+
+    if (!CreateDirectoryW(Directory, 0))
+        return 0;
+    DirCount++;
+
+    for (unsigned I = 0; FILES_PER_DIR > I; I++)
+    {
+        _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\f%u", Directory, I);
+        Handle = CreateFileW(
+            Path,
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            0,
+            CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL,
+            0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return 0;
+        CloseHandle(Handle);
+        FileCount++;
+    }
+
+    if (0 < Depth)
+        for (unsigned I = 0; DIRS_PER_DIR > I; I++)
+        {
+            _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\d%u", Directory, I);
+            if (!CreateTree(Path, Depth - 1))
+                return 0;
+        }
+
+    return 1;
+}
+
+static int DeleteTree(const wchar_t *Directory)
+{
+    wchar_t Path[MAX_PATH];
+    WIN32_FIND_DATAW FindData;
+    HANDLE FindHandle;
+
+    _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\*", Directory);
+    FindHandle = FindFirstFileW(Path, &FindData);
+    if (INVALID_HANDLE_VALUE == FindHandle)
+        return 0;
+    do
+    {
+        if (L'.' == FindData.cFileName[0] &&
+            (L'\0' == FindData.cFileName[1] ||
+                (L'.' == FindData.cFileName[1] && L'\0' == FindData.cFileName[2])))
+            continue;
+
+        _snwprintf_s(Path, MAX_PATH, _TRUNCATE, L"%s\\%s", Directory, FindData.cFileName);
+        if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if (!DeleteTree(Path))
+            {
+                FindClose(FindHandle);
+                return 0;
+            }
+        }
+        else if (!DeleteFileW(Path))
+        {
+            FindClose(FindHandle);
+            return 0;
+        }
+    } while (FindNextFileW(FindHandle, &FindData));
+    FindClose(FindHandle);
+
+    return RemoveDirectoryW(Directory);
+}
+
+static unsigned long long Delta(FUSE_STATS *Before, FUSE_STATS *After, unsigned Opcode)
+{
+    return After->RequestCount[Opcode] - Before->RequestCount[Opcode];
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    wchar_t Root[MAX_PATH];
+    HANDLE Handle;
+    FUSE_STATS Before, After;
+    LARGE_INTEGER Frequency, Start, Now;
+    unsigned Depth;
+
+    if (2 > argc)
+    {
+        fwprintf(stderr, L"usage: rdtree DIRECTORY [DEPTH]\n");
+        return 2;
+    }
+    Depth = 3 <= argc ? wcstoul(argv[2], 0, 10) : 4;
+
+    Handle = CreateFileW(
+        argv[1],
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        0,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        0);
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+        fwprintf(stderr, L"cannot open %s: error %lu\n", argv[1], GetLastError());
+        return 1;
+    }
+
+    _snwprintf_s(Root, MAX_PATH, _TRUNCATE, L"%s\\rdtree", argv[1]);
+    if (!CreateTree(Root, Depth))
+    {
+        fwprintf(stderr, L"cannot create tree: error %lu\n", GetLastError());
+        return 1;
+    }
+
+    if (!QueryStats(Handle, &Before))
+    {
+        fwprintf(stderr, L"cannot query stats: error %lu (not a WinFuse volume?)\n",
+            GetLastError());
+        return 1;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    if (!DeleteTree(Root))
+    {
+        fwprintf(stderr, L"cannot delete tree: error %lu\n", GetLastError());
+        return 1;
+    }
+    QueryPerformanceCounter(&Now);
+
+    if (!QueryStats(Handle, &After))
+    {
+        fwprintf(stderr, L"cannot query stats: error %lu\n", GetLastError());
+        return 1;
+    }
+    CloseHandle(Handle);
+
+    wprintf(L"%llu directories and %llu files deleted in %.3f sec\n",
+        DirCount, FileCount,
+        (double)(Now.QuadPart - Start.QuadPart) / (double)Frequency.QuadPart);
+    wprintf(L"%llu READDIR, %llu RMDIR, %llu UNLINK, %llu LOOKUP\n",
+        Delta(&Before, &After, FUSE_PROTO_OPCODE_READDIR),
+        Delta(&Before, &After, FUSE_PROTO_OPCODE_RMDIR),
+        Delta(&Before, &After, FUSE_PROTO_OPCODE_UNLINK),
+        Delta(&Before, &After, FUSE_PROTO_OPCODE_LOOKUP));
+    wprintf(L"%.2f READDIR per directory\n",
+        (double)Delta(&Before, &After, FUSE_PROTO_OPCODE_READDIR) / (double)DirCount);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file epoch-test.c
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+
+#define WINFUSE_DRIVER_H_INCLUDED
+#define PAGED_CODE()
+#define FuseAlloc(Size)                 _aligned_malloc(Size, 64)
+#define FuseAllocCacheAligned(Size)     _aligned_malloc(Size, 64)
+#define FuseFree(Pointer)               _aligned_free(Pointer)
+#define KeQueryMaximumProcessorCountEx(GroupNumber)\
+    GetActiveProcessorCount(GroupNumber)
+#define KeGetCurrentProcessorNumberEx(ProcNumber)\
+    GetCurrentProcessorNumber()
+typedef struct _FUSE_EPOCH FUSE_EPOCH;
+#include <winfuse/epoch.c>
+
+static void epoch_advance_test(void)
+{
+    FUSE_EPOCH *Epoch;
+    PVOID Slot1, Slot2;
+    NTSTATUS Result;
+
+    Result = FuseEpochCreate(&Epoch);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    ASSERT((UINT64)-1LL == FuseEpochAdvance(Epoch, 100));
+
+    Slot1 = FuseEpochEnter(Epoch);
+    ASSERT(0 != Slot1);
+    ASSERT(100 == FuseEpochAdvance(Epoch, 200));
+    ASSERT(100 == FuseEpochAdvance(Epoch, 300));    /* cannot advance past Slot1 */
+
+    Slot2 = FuseEpochEnter(Epoch);
+    ASSERT(0 != Slot2);
+    FuseEpochLeave(Epoch, Slot1);
+    ASSERT(200 == FuseEpochAdvance(Epoch, 400));
+
+    FuseEpochLeave(Epoch, Slot2);
+    FuseEpochLeave(Epoch, 0);
+    ASSERT((UINT64)-1LL == FuseEpochAdvance(Epoch, 500));
+
+    FuseEpochDelete(Epoch);
+}
+
+#define EPOCH_STRESS_THREAD_COUNT       16
+#define EPOCH_STRESS_ITERATION_COUNT    200000
+
+static struct
+{
+    FUSE_EPOCH *Epoch;
+    volatile LONG64 Clock;
+    volatile LONG64 ActiveTime[EPOCH_STRESS_THREAD_COUNT];
+    volatile LONG Done;
+} EpochStress;
+
+static unsigned __stdcall epoch_stress_thread(void *Data)
+{
+    volatile LONG64 *PActiveTime = &EpochStress.ActiveTime[(ULONG_PTR)Data];
+    PVOID Slot;
+
+    for (ULONG I = 0; EPOCH_STRESS_ITERATION_COUNT > I; I++)
+    {
+        Slot = FuseEpochEnter(EpochStress.Epoch);
+
+        /* an operation "uses" an item: record the time of use, like LastUsedTime */
+        InterlockedExchange64(PActiveTime, InterlockedCompareExchange64(&EpochStress.Clock, 0, 0));
+        if (0 == I % 64)
+            SwitchToThread();
+        InterlockedExchange64(PActiveTime, MAXLONG64);
+
+        FuseEpochLeave(EpochStress.Epoch, Slot);
+    }
+
+    InterlockedIncrement(&EpochStress.Done);
+
+    return 0;
+}
+
+static void epoch_stress_test(void)
+{
+    HANDLE Threads[EPOCH_STRESS_THREAD_COUNT];
+    ULONG Violations = 0, Advances = 0;
+    UINT64 OldestTime, LastOldestTime = 0;
+    LONG64 Time, ActiveTime;
+    NTSTATUS Result;
+
+    memset(&EpochStress, 0, sizeof EpochStress);
+    for (ULONG I = 0; EPOCH_STRESS_THREAD_COUNT > I; I++)
+        EpochStress.ActiveTime[I] = MAXLONG64;
+
+    Result = FuseEpochCreate(&EpochStress.Epoch);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    for (ULONG I = 0; EPOCH_STRESS_THREAD_COUNT > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, epoch_stress_thread, (PVOID)(ULONG_PTR)I, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    while (EPOCH_STRESS_THREAD_COUNT != InterlockedCompareExchange(&EpochStress.Done, 0, 0))
+    {
+        /* the expiration routine: advance and compute the oldest active time */
+        Time = InterlockedIncrement64(&EpochStress.Clock);
+        OldestTime = FuseEpochAdvance(EpochStress.Epoch, Time);
+        if (OldestTime != LastOldestTime)
+            Advances++;
+        LastOldestTime = OldestTime;
+
+        /*
+         * An operation that used an item before this round (ActiveTime < Time) and is still
+         * active must not be older than the oldest active time; otherwise the item could be
+         * forgotten while in use.
+         */
+        for (ULONG I = 0; EPOCH_STRESS_THREAD_COUNT > I; I++)
+        {
+            ActiveTime = InterlockedCompareExchange64(&EpochStress.ActiveTime[I], 0, 0);
+            if (ActiveTime < Time && (UINT64)ActiveTime < OldestTime)
+                Violations++;
+        }
+    }
+
+    WaitForMultipleObjects(EPOCH_STRESS_THREAD_COUNT, Threads, TRUE, INFINITE);
+    for (ULONG I = 0; EPOCH_STRESS_THREAD_COUNT > I; I++)
+        CloseHandle(Threads[I]);
+
+    ASSERT(0 == Violations);
+    ASSERT(0 < Advances);
+
+    /* quiescent: every epoch drains */
+    FuseEpochAdvance(EpochStress.Epoch, InterlockedIncrement64(&EpochStress.Clock));
+    ASSERT((UINT64)-1LL == FuseEpochAdvance(EpochStress.Epoch,
+        InterlockedIncrement64(&EpochStress.Clock)));
+
+    FuseEpochDelete(EpochStress.Epoch);
+}
+
+void epoch_tests(void)
+{
+    TEST(epoch_advance_test);
+    TEST(epoch_stress_test);
+}
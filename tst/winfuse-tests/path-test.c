@@ -146,8 +146,90 @@ void path_suffix_test(void)
     }
 }
 
+void path_decode_name_test(void)
+{
+    static struct
+    {
+        PSTR Name;
+        PWSTR WideName;
+    } Tests[] =
+    {
+        { "", L"" },
+        { "a", L"a" },
+        { "abcdefghijklmnopqrstuvwxyz0123456789", L"abcdefghijklmnopqrstuvwxyz0123456789" },
+        { "abcdefghijklmnopqrstuvwxyz:0123456789*", L"abcdefghijklmnopqrstuvwxyz\xf03a" L"0123456789\xf02a" },
+        { "a\\b\"c<d>e?f|g\x01h", L"a\xf05c" L"b\xf022" L"c\xf03c" L"d\xf03e" L"e\xf03f" L"f\xf07c" L"g\xf001" L"h" },
+        { "caf\xc3\xa9", L"caf\xe9" },
+        { "0123456789abcdef\xe2\x82\xac" "0123456789abcdef", L"0123456789abcdef\x20ac" L"0123456789abcdef" },
+        { "\xf0\x9f\x98\x80.txt", L"\xd83d\xde00.txt" },
+        { "a\xff" "b", L"a\xfffd" L"b" },
+        { "a\xc0\xaf" "b", L"a\xfffd\xfffd" L"b" },
+        { "a\xed\xa0\x80", L"a\xfffd\xfffd\xfffd" },
+        { "a\xe2\x82", L"a\xfffd\xfffd" },
+    };
+
+    for (size_t i = 0; sizeof Tests / sizeof Tests[0] > i; i++)
+    {
+        STRING Name;
+        WCHAR WideName[255];
+        ULONG WideNameLength;
+        BOOLEAN Success;
+
+        Name.Length = Name.MaximumLength = (USHORT)strlen(Tests[i].Name);
+        Name.Buffer = Tests[i].Name;
+
+        Success = FusePosixPathDecodeName(&Name, WideName, sizeof WideName, &WideNameLength);
+        ASSERT(Success);
+        ASSERT(WideNameLength == wcslen(Tests[i].WideName) * sizeof(WCHAR));
+        ASSERT(0 == memcmp(Tests[i].WideName, WideName, WideNameLength));
+
+        if (0 < WideNameLength)
+        {
+            Success = FusePosixPathDecodeName(&Name,
+                WideName, WideNameLength - sizeof(WCHAR), &WideNameLength);
+            ASSERT(!Success);
+        }
+    }
+}
+
+void path_encode_test(void)
+{
+    static struct
+    {
+        PSTR WindowsPath;
+        PSTR PosixPath;
+    } Tests[] =
+    {
+        { "", "" },
+        { "\\a\\b", "/a/b" },
+        { "a\xef\x80\xba" "b\xef\x80\xaa", "a:b*" },
+        { "a\xef\x81\x9c" "b\xef\x80\x81", "a\\b\x01" },
+        /* private use characters that FusePosixPathDecodeMap does not produce */
+        { "a\xef\x80\x80" "b", "a\xef\x80\x80" "b" },
+        { "a\xef\x80\xaf" "b", "a\xef\x80\xaf" "b" },
+        { "a\xef\x80\xa1" "b\xef\x81\x81", "a\xef\x80\xa1" "b\xef\x81\x81" },
+        { "a\xef\x82\x80", "a\xef\x82\x80" },
+        { "a\xef\x80", "a\xef\x80" },
+    };
+
+    for (size_t i = 0; sizeof Tests / sizeof Tests[0] > i; i++)
+    {
+        CHAR Path[255];
+        ULONG Length;
+
+        Length = (ULONG)strlen(Tests[i].WindowsPath);
+        memcpy(Path, Tests[i].WindowsPath, Length);
+
+        FusePosixPathEncode(Path, &Length);
+        ASSERT(Length == strlen(Tests[i].PosixPath));
+        ASSERT(0 == memcmp(Tests[i].PosixPath, Path, Length));
+    }
+}
+
 void path_tests(void)
 {
     TEST(path_prefix_test);
     TEST(path_suffix_test);
+    TEST(path_decode_name_test);
+    TEST(path_encode_test);
 }
@@ -0,0 +1,299 @@
+/**
+ * @file snapshot-test.c
+ *
+ * @copyright 2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+
+#define WINFUSE_DRIVER_H_INCLUDED
+#define PAGED_CODE()
+#include <winfuse/proto.h>
+#include <winfuse/snapshot.h>
+#include <winfuse/snapshot.c>
+
+#define SNAPSHOT_ENTRY(Ino, ParentIno, Frequency, Name)\
+    { Ino, ParentIno, Frequency, { sizeof Name - 1, sizeof Name - 1, Name } }
+
+/*
+ * /a (cold), /a/b, /a/b/c, /x, /y (cold), an orphan, an invalid name and the root item.
+ */
+static FUSE_SNAPSHOT_ENTRY SnapshotEntries[] =
+{
+    SNAPSHOT_ENTRY(4, 3, 1, "c"),
+    SNAPSHOT_ENTRY(7, 99, 100, "o"),
+    SNAPSHOT_ENTRY(2, 1, 0, "a"),
+    SNAPSHOT_ENTRY(5, 1, 10, "x"),
+    SNAPSHOT_ENTRY(8, 1, 3, "p/q"),
+    SNAPSHOT_ENTRY(1, 1, 50, "/"),
+    SNAPSHOT_ENTRY(3, 2, 5, "b"),
+    SNAPSHOT_ENTRY(6, 1, 0, "y"),
+};
+
+static ULONG snapshot_build(PVOID Buffer, ULONG Length)
+{
+    FUSE_SNAPSHOT_ENTRY Entries[sizeof SnapshotEntries / sizeof SnapshotEntries[0]];
+    memcpy(Entries, SnapshotEntries, sizeof Entries);
+    return FuseSnapshotBuild(Entries, sizeof Entries / sizeof Entries[0], Buffer, Length);
+}
+
+static FUSE_SNAPSHOT_RECORD *snapshot_record(FUSE_SNAPSHOT *Snapshot, ULONG Index)
+{
+    FUSE_SNAPSHOT_RECORD *Record = (PVOID)(Snapshot + 1);
+    for (ULONG I = 0; Index > I; I++)
+        Record = (PVOID)((PUINT8)Record + FUSE_SNAPSHOT_RECORD_SIZE(Record->NameLength));
+    return Record;
+}
+
+static ULONG snapshot_find(FUSE_SNAPSHOT *Snapshot, PSTR Name)
+{
+    for (ULONG I = 0; Snapshot->Count > I; I++)
+    {
+        FUSE_SNAPSHOT_RECORD *Record = snapshot_record(Snapshot, I);
+        if (strlen(Name) == Record->NameLength && 0 == memcmp(Name, Record->Name, Record->NameLength))
+            return I;
+    }
+    return (ULONG)-1;
+}
+
+static void snapshot_build_test(void)
+{
+    union
+    {
+        FUSE_SNAPSHOT V;
+        UINT8 B[1024];
+    } Buffer;
+    FUSE_SNAPSHOT *Snapshot = &Buffer.V;
+    ULONG Size, A, B, C, X;
+
+    Size = snapshot_build(Snapshot, sizeof Buffer);
+    ASSERT(sizeof *Snapshot + 4 * FUSE_SNAPSHOT_RECORD_SIZE(1) == Size);
+    ASSERT(FUSE_SNAPSHOT_SIGNATURE == Snapshot->Signature);
+    ASSERT(Size == Snapshot->Size);
+    ASSERT(4 == Snapshot->Count);
+    ASSERT(0 == Snapshot->Flags);
+    ASSERT(STATUS_SUCCESS == FuseSnapshotValidate(Snapshot, Size));
+
+    A = snapshot_find(Snapshot, "a");
+    B = snapshot_find(Snapshot, "b");
+    C = snapshot_find(Snapshot, "c");
+    X = snapshot_find(Snapshot, "x");
+    ASSERT((ULONG)-1 != A && (ULONG)-1 != B && (ULONG)-1 != C && (ULONG)-1 != X);
+    ASSERT((ULONG)-1 == snapshot_find(Snapshot, "y"));
+    ASSERT((ULONG)-1 == snapshot_find(Snapshot, "o"));
+    ASSERT((ULONG)-1 == snapshot_find(Snapshot, "p/q"));
+    ASSERT((ULONG)-1 == snapshot_find(Snapshot, "/"));
+
+    ASSERT(FUSE_SNAPSHOT_ROOT == snapshot_record(Snapshot, A)->Parent);
+    ASSERT(FUSE_SNAPSHOT_ROOT == snapshot_record(Snapshot, X)->Parent);
+    ASSERT(A == snapshot_record(Snapshot, B)->Parent);
+    ASSERT(B == snapshot_record(Snapshot, C)->Parent);
+    ASSERT(0 == snapshot_record(Snapshot, A)->Frequency);
+    ASSERT(5 == snapshot_record(Snapshot, B)->Frequency);
+    ASSERT(10 == snapshot_record(Snapshot, X)->Frequency);
+
+    /* the header does not fit */
+    ASSERT(0 == snapshot_build(Snapshot, sizeof *Snapshot - 1));
+
+    /* no entries */
+    ASSERT(sizeof *Snapshot == FuseSnapshotBuild(0, 0, Snapshot, sizeof Buffer));
+    ASSERT(0 == Snapshot->Count);
+    ASSERT(STATUS_SUCCESS == FuseSnapshotValidate(Snapshot, sizeof *Snapshot));
+}
+
+static void snapshot_truncate_test(void)
+{
+    union
+    {
+        FUSE_SNAPSHOT V;
+        UINT8 B[1024];
+    } Buffer;
+    FUSE_SNAPSHOT *Snapshot = &Buffer.V;
+    ULONG Size;
+
+    /* only the hottest entry fits */
+    Size = snapshot_build(Snapshot, sizeof *Snapshot + 2 * FUSE_SNAPSHOT_RECORD_SIZE(1));
+    ASSERT(sizeof *Snapshot + FUSE_SNAPSHOT_RECORD_SIZE(1) == Size);
+    ASSERT(1 == Snapshot->Count);
+    ASSERT(FUSE_SNAPSHOT_TRUNCATED == Snapshot->Flags);
+    ASSERT(0 == snapshot_find(Snapshot, "x"));
+    ASSERT(STATUS_SUCCESS == FuseSnapshotValidate(Snapshot, Size));
+
+    /* /x and /a/b (which brings /a along) fit; /a/b/c does not */
+    Size = snapshot_build(Snapshot, sizeof *Snapshot + 3 * FUSE_SNAPSHOT_RECORD_SIZE(1));
+    ASSERT(sizeof *Snapshot + 3 * FUSE_SNAPSHOT_RECORD_SIZE(1) == Size);
+    ASSERT(3 == Snapshot->Count);
+    ASSERT(FUSE_SNAPSHOT_TRUNCATED == Snapshot->Flags);
+    ASSERT((ULONG)-1 == snapshot_find(Snapshot, "c"));
+    ASSERT(STATUS_SUCCESS == FuseSnapshotValidate(Snapshot, Size));
+
+    /* an empty snapshot still records that entries were dropped */
+    Size = snapshot_build(Snapshot, sizeof *Snapshot);
+    ASSERT(sizeof *Snapshot == Size);
+    ASSERT(0 == Snapshot->Count);
+    ASSERT(FUSE_SNAPSHOT_TRUNCATED == Snapshot->Flags);
+}
+
+static void snapshot_validate_test(void)
+{
+    union
+    {
+        FUSE_SNAPSHOT V;
+        UINT8 B[1024];
+    } Buffer, Copy;
+    FUSE_SNAPSHOT *Snapshot = &Buffer.V;
+    ULONG Size, B;
+
+    Size = snapshot_build(Snapshot, sizeof Buffer);
+    B = snapshot_find(Snapshot, "b");
+
+    ASSERT(STATUS_SUCCESS == FuseSnapshotValidate(Snapshot, sizeof Buffer));
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(Snapshot, Size - 1));
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(Snapshot, sizeof *Snapshot - 1));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    Copy.V.Signature++;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    Copy.V.Size += 4;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, sizeof Copy));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    Copy.V.Count++;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    Copy.V.Count = (UINT32)-1;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    /* a record cannot refer to itself or a later record */
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    snapshot_record(&Copy.V, B)->Parent = B;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    snapshot_record(&Copy.V, B)->Name[0] = '/';
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    snapshot_record(&Copy.V, B)->NameLength = 0;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    memcpy(&Copy, &Buffer, sizeof Buffer);
+    snapshot_record(&Copy.V, Copy.V.Count - 1)->NameLength = 0xffff;
+    ASSERT(STATUS_INVALID_PARAMETER == FuseSnapshotValidate(&Copy, Size));
+
+    /* random corruption is rejected or yields a snapshot that can be primed */
+    srand(0);
+    for (ULONG I = 0; 10000 > I; I++)
+    {
+        memcpy(&Copy, &Buffer, sizeof Buffer);
+        Copy.B[sizeof *Snapshot + rand() % (Size - sizeof *Snapshot)] = (UINT8)rand();
+        if (STATUS_SUCCESS == FuseSnapshotValidate(&Copy, Size))
+        {
+            static UINT8 PrimerBuf[1024];
+            FUSE_SNAPSHOT_PRIMER *Primer = (PVOID)PrimerBuf;
+            UINT64 ParentIno;
+            STRING Name;
+            ASSERT(sizeof PrimerBuf >= FuseSnapshotPrimerSize(&Copy.V));
+            FuseSnapshotPrimerInit(Primer, &Copy.V);
+            while (FuseSnapshotPrimerNext(Primer, &ParentIno, &Name))
+                FuseSnapshotPrimerSetIno(Primer, 1000 + Primer->Current);
+        }
+    }
+}
+
+/* the file system after a remount: same tree, different inode numbers; /a/b fails */
+static BOOLEAN snapshot_lookup(UINT64 ParentIno, PSTRING Name, BOOLEAN FailB, PUINT64 PIno)
+{
+    static struct
+    {
+        UINT64 ParentIno;
+        PSTR Name;
+        UINT64 Ino;
+    } Tree[] =
+    {
+        { 1, "a", 20 },
+        { 20, "b", 30 },
+        { 30, "c", 40 },
+        { 1, "x", 50 },
+    };
+    for (ULONG I = 0; sizeof Tree / sizeof Tree[0] > I; I++)
+        if (Tree[I].ParentIno == ParentIno &&
+            strlen(Tree[I].Name) == Name->Length &&
+            0 == memcmp(Tree[I].Name, Name->Buffer, Name->Length))
+        {
+            if (FailB && 30 == Tree[I].Ino)
+                return FALSE;
+            *PIno = Tree[I].Ino;
+            return TRUE;
+        }
+    return FALSE;
+}
+
+static void snapshot_prime_dotest(BOOLEAN FailB)
+{
+    union
+    {
+        FUSE_SNAPSHOT V;
+        UINT8 B[1024];
+    } Buffer;
+    FUSE_SNAPSHOT *Snapshot = &Buffer.V;
+    FUSE_SNAPSHOT_PRIMER *Primer;
+    UINT64 ParentIno, Ino;
+    STRING Name;
+    ULONG LookupCount = 0, FailCount = 0;
+
+    snapshot_build(Snapshot, sizeof Buffer);
+
+    Primer = malloc(FuseSnapshotPrimerSize(Snapshot));
+    ASSERT(0 != Primer);
+    FuseSnapshotPrimerInit(Primer, Snapshot);
+
+    while (FuseSnapshotPrimerNext(Primer, &ParentIno, &Name))
+    {
+        LookupCount++;
+        if (snapshot_lookup(ParentIno, &Name, FailB, &Ino))
+            FuseSnapshotPrimerSetIno(Primer, Ino);
+        else
+            FailCount++;
+    }
+    ASSERT(!FuseSnapshotPrimerNext(Primer, &ParentIno, &Name));
+
+    /* a failed LOOKUP skips the subtree below it */
+    ASSERT((FailB ? 3 : 4) == LookupCount);
+    ASSERT((FailB ? 1 : 0) == FailCount);
+
+    free(Primer);
+}
+
+static void snapshot_prime_test(void)
+{
+    snapshot_prime_dotest(FALSE);
+    snapshot_prime_dotest(TRUE);
+}
+
+void snapshot_tests(void)
+{
+    TEST(snapshot_build_test);
+    TEST(snapshot_truncate_test);
+    TEST(snapshot_validate_test);
+    TEST(snapshot_prime_test);
+}
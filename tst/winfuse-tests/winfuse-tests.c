@@ -27,7 +27,9 @@ int main(int argc, char *argv[])
     FspLoad(0);
 
     TESTSUITE(coro_tests);
+    TESTSUITE(epoch_tests);
     TESTSUITE(path_tests);
+    TESTSUITE(snapshot_tests);
     TESTSUITE(transact_tests);
 
     tlib_run_tests(argc, argv);